@@ -0,0 +1,500 @@
+/**
+ * micro-benchmarks for the scanner, the chunks and the filters.
+ *
+ * generates synthetic sql corpora in a temporary directory and writes
+ * the results as JSON to stdout.
+ *
+ * Usage: psqlchunks-bench [corpus size in MB] [repetitions]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <memory>
+
+#include <unistd.h>
+#include <regex.h>
+
+#include "scanner.h"
+#include "filter.h"
+#include "simd.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+#define DEFAULT_CORPUS_MB       32
+#define DEFAULT_REPETITIONS     3
+
+
+/***** allocation counting *****/
+
+static unsigned long alloc_count = 0;
+
+extern "C" {
+    void * __libc_malloc(size_t);
+    void * __libc_calloc(size_t, size_t);
+    void * __libc_realloc(void *, size_t);
+
+    void * malloc(size_t size)
+    {
+        alloc_count++;
+        return __libc_malloc(size);
+    }
+
+    void * calloc(size_t nmemb, size_t size)
+    {
+        alloc_count++;
+        return __libc_calloc(nmemb, size);
+    }
+
+    void * realloc(void * ptr, size_t size)
+    {
+        alloc_count++;
+        return __libc_realloc(ptr, size);
+    }
+}
+
+
+/***** timing *****/
+
+static double
+now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+/***** corpora *****/
+
+struct Corpus {
+    const char * name;
+    std::string path;
+    size_t bytes;
+};
+
+
+static void
+gen_chunk(std::string & out, unsigned int n, unsigned int sql_lines, size_t line_len,
+            unsigned int comment_lines, bool end_marker)
+{
+    std::ostringstream desc;
+    desc << "chunk number " << n;
+
+    out.append("-----------------------------------------------------------\n");
+    out.append("-- start: ");
+    out.append(desc.str());
+    out.append("\n-----------------------------------------------------------\n");
+
+    for (unsigned int i = 0; i < sql_lines; i++) {
+        if ((comment_lines > 0) && ((i % 2) == 0)) {
+            for (unsigned int c = 0; c < comment_lines; c++) {
+                out.append("    -- explaining the next statement in great detail\n");
+            }
+        }
+        std::ostringstream line;
+        line << "insert into bench_table (id, payload) values (" << n << ", '";
+        out.append(line.str());
+        size_t fill = line_len > 60 ? line_len - 60 : 1;
+        out.append(fill, static_cast<char>('a' + (i % 26)));
+        out.append("');\n");
+        if ((i % 7) == 6) {
+            out.append("\n");
+        }
+    }
+
+    if (end_marker) {
+        out.append("-----------------------------------------------------------\n");
+        out.append("-- end: ");
+        out.append(desc.str());
+        out.append("\n-----------------------------------------------------------\n");
+    }
+    out.append("\n");
+}
+
+
+static bool
+write_corpus(Corpus & corpus, const std::string & dir, const std::string & contents)
+{
+    corpus.path = dir + "/" + corpus.name + ".sql";
+    corpus.bytes = contents.size();
+
+    FILE * fh = fopen(corpus.path.c_str(), "wb");
+    if (!fh) {
+        log_error("could not create %s", corpus.path.c_str());
+        return false;
+    }
+    bool success = (fwrite(contents.data(), 1, contents.size(), fh) == contents.size());
+    success = (fclose(fh) == 0) && success;
+    return success;
+}
+
+
+static bool
+generate_corpora(std::vector<Corpus> & corpora, const std::string & dir, size_t target)
+{
+    const char * names[] = {"tiny_chunks", "huge_chunks", "long_lines",
+                "heavy_comments", "bundle"};
+
+    for (size_t c = 0; c < (sizeof(names) / sizeof(names[0])); c++) {
+        Corpus corpus;
+        corpus.name = names[c];
+        std::string contents;
+        contents.reserve(target + (1024*1024));
+
+        unsigned int n = 0;
+        while (contents.size() < target) {
+            switch (c) {
+                case 0: // many chunks with a single statement
+                    gen_chunk(contents, n, 1 + (n % 3), 80, 0, (n % 2) == 0);
+                    break;
+                case 1: // few chunks with many lines - seed data
+                    gen_chunk(contents, n, 50000, 100, 0, true);
+                    break;
+                case 2: // lines of 64kB
+                    gen_chunk(contents, n, 4, 64 * 1024, 0, false);
+                    break;
+                case 3: // more comments than sql
+                    gen_chunk(contents, n, 6, 80, 4, true);
+                    break;
+                case 4: // the output of "psqlchunks concat" with file markers
+                    if ((n % 50) == 0) {
+                        std::ostringstream marker;
+                        marker << "\n----[ File: migrations/" << (n / 50) << ".sql\n";
+                        contents.append(marker.str());
+                    }
+                    gen_chunk(contents, n, 3, 80, 0, true);
+                    break;
+            }
+            n++;
+        }
+
+        if (!write_corpus(corpus, dir, contents)) {
+            return false;
+        }
+        corpora.push_back(corpus);
+    }
+    return true;
+}
+
+
+/***** benchmarks *****/
+
+/** exposes the line classification of the scanner */
+class BenchScanner : public ChunkScanner
+{
+    public:
+        BenchScanner(Input & input) : ChunkScanner(input) {};
+
+        int classify(const char * line, size_t length, size_t & content_pos)
+        {
+            return static_cast<int>(classifyLine(line, length, content_pos));
+        }
+};
+
+
+struct Result {
+    std::string corpus;
+    std::string benchmark;
+    size_t bytes;
+    unsigned long chunks;
+    unsigned long lines;
+    double seconds;
+    unsigned long allocs;
+};
+
+
+enum Benchmark {
+    BENCH_SCAN,
+    BENCH_CLASSIFY,
+    BENCH_GETSQL,
+    BENCH_LINE_FILTER,
+    BENCH_DESCRIPTION_REGEX,
+    BENCH_CONTENT_REGEX,
+    BENCH_CONTENT_REGEX_MULTI,
+    BENCH_CONTENT_REGEX_POSIX,
+    BENCH_FILTER_CHAIN,
+    BENCH_SCAN_HEADER_FILTER
+};
+
+static const char * benchmark_names[] = {
+    "scanner_next_chunk",
+    "classify_line",
+    "chunk_get_sql",
+    "line_filter",
+    "description_regex_filter",
+    "content_regex_filter",
+    "content_regex_multi",
+    "content_regex_posix",
+    "filter_chain",
+    "scanner_header_filter"
+};
+
+/** patterns of the multi pattern benchmarks, which compare the filter chain to regexec */
+static const char * multi_patterns[] = {
+    "insert into bench_table",
+    "values \\(1[0-9]*5, ",
+    "'(aa|bb|cc)+'\\)"
+};
+#define MULTI_PATTERN_COUNT (sizeof(multi_patterns) / sizeof(multi_patterns[0]))
+
+
+template <class T>
+T * make_filter(const char * params)
+{
+    T * filter = new T();
+    std::string errmsg;
+    if (!filter->setParams(params, errmsg)) {
+        log_error("invalid filter parameters: %s", errmsg.c_str());
+        abort();
+    }
+    return filter;
+}
+
+
+/**
+ * run a single benchmark once. for the chunk and filter benchmarks only
+ * the operation on the chunk is measured, the scanner is excluded from
+ * the time and the allocation count.
+ */
+static Result
+run_once(const Corpus & corpus, Benchmark benchmark)
+{
+    Result result;
+    result.corpus = corpus.name;
+    result.benchmark = benchmark_names[benchmark];
+    result.bytes = corpus.bytes;
+    result.chunks = 0;
+    result.lines = 0;
+    result.seconds = 0.0;
+    result.allocs = 0;
+
+    std::auto_ptr<Input> input(Input::open(corpus.path.c_str()));
+    if (!input.get()) {
+        log_error("could not open %s", corpus.path.c_str());
+        abort();
+    }
+
+    if (benchmark == BENCH_CLASSIFY) {
+        BenchScanner scanner(*input);
+        LineRef line;
+        size_t content_pos;
+        volatile int sink = 0;
+
+        unsigned long allocs_before = alloc_count;
+        double start = now_seconds();
+        while (input->nextLine(line)) {
+            sink = scanner.classify(line.data, line.length, content_pos);
+            result.lines++;
+        }
+        result.seconds = now_seconds() - start;
+        result.allocs = alloc_count - allocs_before;
+        UNUSED_PARAMETER(sink);
+        return result;
+    }
+
+    std::auto_ptr<Filter> filter;
+    switch (benchmark) {
+        case BENCH_LINE_FILTER:
+            filter.reset(make_filter<LineFilter>("17,4711,100000,2500000,9999999"));
+            break;
+        case BENCH_DESCRIPTION_REGEX:
+            filter.reset(make_filter<DescriptionRegexFilter>("number [0-9]*7$"));
+            break;
+        case BENCH_CONTENT_REGEX:
+            filter.reset(make_filter<ContentRegexFilter>("values \\(12[0-9]+, 'q"));
+            break;
+        default:
+            break;
+    }
+
+    FilterChain chain;
+    regex_t posix[MULTI_PATTERN_COUNT];
+    for (size_t i = 0; i < MULTI_PATTERN_COUNT; i++) {
+        chain.addFilter(make_filter<ContentRegexFilter>(multi_patterns[i]));
+        regcomp(&posix[i], multi_patterns[i], REG_EXTENDED | REG_ICASE);
+    }
+
+    // an expensive filter given before a cheap one, which the chain has to reorder
+    FilterChain mixed_chain;
+    mixed_chain.addFilter(make_filter<ContentRegexFilter>("values \\(12[0-9]+, 'q"));
+    mixed_chain.addFilter(make_filter<DescriptionRegexFilter>("number [0-9]*7$"));
+    mixed_chain.addFilter(make_filter<LineFilter>("17,4711,100000,2500000,9999999"));
+
+    // rejected by the scanner before it stores the sql
+    FilterChain header_chain;
+    header_chain.addFilter(make_filter<DescriptionRegexFilter>("number [0-9]*7$"));
+
+    ChunkScanner scanner(*input);
+    if (benchmark == BENCH_SCAN_HEADER_FILTER) {
+        scanner.setFilterChain(&header_chain);
+    }
+    Chunk chunk;
+    volatile size_t sink = 0;
+    unsigned long allocs_before = alloc_count;
+    double start = now_seconds();
+
+    while (true) {
+        if ((benchmark == BENCH_SCAN) || (benchmark == BENCH_SCAN_HEADER_FILTER)) {
+            if (!scanner.nextChunk(chunk)) {
+                break;
+            }
+        }
+        else {
+            // only the operation on the chunk is measured
+            result.seconds += now_seconds() - start;
+            result.allocs += alloc_count - allocs_before;
+            bool have_chunk = scanner.nextChunk(chunk);
+            allocs_before = alloc_count;
+            start = now_seconds();
+            if (!have_chunk) {
+                break;
+            }
+
+            if (benchmark == BENCH_GETSQL) {
+                sink = chunk.getSql().size();
+            }
+            else if (benchmark == BENCH_FILTER_CHAIN) {
+                sink = mixed_chain.match(chunk) ? 1 : 0;
+            }
+            else if (benchmark == BENCH_CONTENT_REGEX_MULTI) {
+                sink = chain.match(chunk) ? 1 : 0;
+            }
+            else if (benchmark == BENCH_CONTENT_REGEX_POSIX) {
+                // what the filter chain did before: regexec for each pattern
+                const std::string & sql = chunk.getSql();
+                size_t i = 0;
+                while ((i < MULTI_PATTERN_COUNT)
+                        && (regexec(&posix[i], sql.c_str(), 0, NULL, 0) == 0)) {
+                    i++;
+                }
+                sink = (i == MULTI_PATTERN_COUNT) ? 1 : 0;
+            }
+            else {
+                sink = filter->match(chunk) ? 1 : 0;
+            }
+        }
+        result.chunks++;
+    }
+
+    if ((benchmark == BENCH_SCAN) || (benchmark == BENCH_SCAN_HEADER_FILTER)) {
+        result.seconds = now_seconds() - start;
+        result.allocs = alloc_count - allocs_before;
+    }
+    for (size_t i = 0; i < MULTI_PATTERN_COUNT; i++) {
+        regfree(&posix[i]);
+    }
+    UNUSED_PARAMETER(sink);
+    return result;
+}
+
+
+static void
+print_json_string(const std::string & str)
+{
+    putchar('"');
+    for (std::string::const_iterator cit = str.begin(); cit != str.end(); ++cit) {
+        if ((*cit == '"') || (*cit == '\\')) {
+            putchar('\\');
+        }
+        putchar(*cit);
+    }
+    putchar('"');
+}
+
+
+static void
+print_results(const std::vector<Result> & results, size_t corpus_mb, unsigned int repetitions)
+{
+    printf("{\n");
+    printf("  \"simd\": ");
+    print_json_string(simd_implementation());
+    printf(",\n  \"corpus_mb\": %lu,\n", static_cast<unsigned long>(corpus_mb));
+    printf("  \"repetitions\": %u,\n", repetitions);
+    printf("  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result & r = results[i];
+        double seconds = r.seconds > 0.0 ? r.seconds : 1e-9;
+
+        printf("    {\"corpus\": ");
+        print_json_string(r.corpus);
+        printf(", \"benchmark\": ");
+        print_json_string(r.benchmark);
+        printf(", \"bytes\": %lu, \"chunks\": %lu, \"lines\": %lu, \"seconds\": %.6f, "
+                    "\"bytes_per_sec\": %.0f, \"chunks_per_sec\": %.0f, \"lines_per_sec\": %.0f, "
+                    "\"allocs\": %lu, \"allocs_per_chunk\": %.3f}%s\n",
+                    static_cast<unsigned long>(r.bytes),
+                    r.chunks,
+                    r.lines,
+                    r.seconds,
+                    r.bytes / seconds,
+                    r.chunks / seconds,
+                    r.lines / seconds,
+                    r.allocs,
+                    r.chunks > 0 ? static_cast<double>(r.allocs) / r.chunks : 0.0,
+                    (i + 1) < results.size() ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    size_t corpus_mb = DEFAULT_CORPUS_MB;
+    unsigned int repetitions = DEFAULT_REPETITIONS;
+
+    if (argc > 1) {
+        corpus_mb = static_cast<size_t>(atoi(argv[1]));
+    }
+    if (argc > 2) {
+        repetitions = static_cast<unsigned int>(atoi(argv[2]));
+    }
+    if ((corpus_mb == 0) || (repetitions == 0)) {
+        fprintf(stderr, "Usage: %s [corpus size in MB] [repetitions]\n", argv[0]);
+        return 1;
+    }
+
+    const char * tmpdir = getenv("TMPDIR");
+    std::string dir_template = std::string(tmpdir ? tmpdir : "/tmp") + "/psqlchunks-bench.XXXXXX";
+    std::vector<char> dir_name(dir_template.begin(), dir_template.end());
+    dir_name.push_back('\0');
+    if (!mkdtemp(&dir_name[0])) {
+        log_error("could not create temporary directory");
+        return 1;
+    }
+    std::string dir(&dir_name[0]);
+
+    std::vector<Corpus> corpora;
+    bool success = generate_corpora(corpora, dir, corpus_mb * 1024 * 1024);
+
+    std::vector<Result> results;
+    if (success) {
+        for (std::vector<Corpus>::const_iterator cit = corpora.begin(); cit != corpora.end(); ++cit) {
+            for (int b = BENCH_SCAN; b <= BENCH_SCAN_HEADER_FILTER; b++) {
+                // keep the fastest run
+                Result best = run_once(*cit, static_cast<Benchmark>(b));
+                for (unsigned int r = 1; r < repetitions; r++) {
+                    Result result = run_once(*cit, static_cast<Benchmark>(b));
+                    if (result.seconds < best.seconds) {
+                        best = result;
+                    }
+                }
+                results.push_back(best);
+            }
+        }
+        print_results(results, corpus_mb, repetitions);
+    }
+
+    for (std::vector<Corpus>::const_iterator cit = corpora.begin(); cit != corpora.end(); ++cit) {
+        unlink(cit->path.c_str());
+    }
+    rmdir(dir.c_str());
+
+    return success ? 0 : 1;
+}
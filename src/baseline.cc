@@ -0,0 +1,228 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "baseline.h"
+#include "debug.h"
+
+// the header followed by the version of the format
+static const char * s_baseline_header = "# psqlchunks baseline ";
+#define BASELINE_VERSION    3
+
+using namespace PsqlChunks;
+
+
+Baseline::Baseline(double _max_ratio, uint64_t _max_slowdown_ns)
+    : max_ratio(_max_ratio), max_slowdown_ns(_max_slowdown_ns), entries(), by_description(),
+      updated(), replaced(), occurrences(), regressed_count(0), mutex()
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+
+Baseline::~Baseline()
+{
+    pthread_mutex_destroy(&mutex);
+}
+
+
+bool
+Baseline::load(const char * path)
+{
+    FILE * fh = fopen(path, "r");
+    if (!fh) {
+        log_debug("could not open baseline %s", path);
+        return false;
+    }
+
+    std::set<std::string> ambiguous;
+    bool valid = false;
+    int version = 0;
+    char * line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, fh)) >= 0) {
+        if ((len > 0) && (line[len - 1] == '\n')) {
+            line[--len] = '\0';
+        }
+
+        if (!valid) {
+            // the first line identifies the file. version 1 has no occurrences,
+            // version 2 no files
+            size_t header_len = strlen(s_baseline_header);
+            if (strncmp(line, s_baseline_header, header_len) == 0) {
+                version = atoi(line + header_len);
+            }
+            valid = (version >= 1) && (version <= BASELINE_VERSION);
+            if (!valid) {
+                break;
+            }
+            continue;
+        }
+        if ((len == 0) || (line[0] == '#')) {
+            continue;
+        }
+
+        // file, hash, occurrence, milliseconds and description
+        BaselineKey key;
+        char * start = line;
+        if (version >= 3) {
+            char * tab = strchr(line, '\t');
+            if (tab == NULL) {
+                log_warn("skipping invalid line of the baseline %s", path);
+                continue;
+            }
+            key.filename.assign(line, tab - line);
+            start = tab + 1;
+        }
+        char * end;
+        key.hash = strtoull(start, &end, 16);
+        if (*end != '\t') {
+            log_warn("skipping invalid line of the baseline %s", path);
+            continue;
+        }
+        if (version >= 2) {
+            key.occurrence = strtoul(end + 1, &end, 10);
+            if (*end != '\t') {
+                log_warn("skipping invalid line of the baseline %s", path);
+                continue;
+            }
+        }
+        double ms = strtod(end + 1, &end);
+        if ((*end != '\t') || (ms < 0)) {
+            log_warn("skipping invalid line of the baseline %s", path);
+            continue;
+        }
+
+        Entry entry;
+        entry.ns = static_cast<uint64_t>(ms * 1e6);
+        entry.description.assign(end + 1);
+        entries[key] = entry;
+
+        if (by_description.count(entry.description) || ambiguous.count(entry.description)) {
+            by_description.erase(entry.description);
+            ambiguous.insert(entry.description);
+        }
+        else {
+            by_description[entry.description] = key;
+        }
+    }
+    free(line);
+    fclose(fh);
+
+    if (!valid) {
+        log_error("%s is not a baseline", path);
+    }
+    return valid;
+}
+
+
+BaselineKey
+Baseline::nextKey(const Chunk & chunk)
+{
+    BaselineKey key;
+    key.filename = chunk.filename ? chunk.filename : "";
+    key.hash = chunk.getSqlHash();
+    std::pair<std::string, hash_t> file_hash(key.filename, key.hash);
+
+    pthread_mutex_lock(&mutex);
+    key.occurrence = occurrences[file_hash]++;
+    pthread_mutex_unlock(&mutex);
+    return key;
+}
+
+
+bool
+Baseline::compare(const Chunk & chunk, const BaselineKey & key, uint64_t & baseline_ns)
+{
+    Entry entry;
+    entry.ns = chunk.diagnostics.times.queryNs();
+    entry.description = chunk.getDescription();
+
+    pthread_mutex_lock(&mutex);
+    updated[key] = entry;
+
+    std::map<BaselineKey, Entry>::const_iterator eit = entries.find(key);
+    if (eit == entries.end()) {
+        // the entry of an old baseline without files
+        BaselineKey old_key = key;
+        old_key.filename.clear();
+        eit = entries.find(old_key);
+        if (eit != entries.end()) {
+            replaced.insert(old_key);
+        }
+    }
+    if (eit == entries.end()) {
+        // the sql of the chunk changed
+        std::map<std::string, BaselineKey>::const_iterator dit = by_description.find(entry.description);
+        if (dit != by_description.end()) {
+            eit = entries.find(dit->second);
+            replaced.insert(dit->second);
+        }
+    }
+
+    bool found = (eit != entries.end());
+    if (found) {
+        baseline_ns = eit->second.ns;
+    }
+
+    bool regressed = found && (entry.ns > (baseline_ns * max_ratio))
+                && (entry.ns > (baseline_ns + max_slowdown_ns));
+    if (regressed) {
+        regressed_count++;
+    }
+    pthread_mutex_unlock(&mutex);
+    return regressed;
+}
+
+
+bool
+Baseline::save(const char * path)
+{
+    std::map<BaselineKey, Entry> merged(updated);
+    for (std::map<BaselineKey, Entry>::iterator eit = entries.begin(); eit != entries.end(); ++eit) {
+        if (!replaced.count(eit->first)) {
+            merged.insert(*eit);
+        }
+    }
+
+    // write to a temporary file first, an interrupted run keeps the old baseline
+    std::string tmp_path = std::string(path) + ".XXXXXX";
+    std::vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+    tmp_name.push_back('\0');
+
+    int fd = mkstemp(&tmp_name[0]);
+    FILE * fh = (fd >= 0) ? fdopen(fd, "w") : NULL;
+    if (!fh) {
+        log_error("could not create the baseline %s: %s", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(&tmp_name[0]);
+        }
+        return false;
+    }
+
+    fprintf(fh, "%s%d\n", s_baseline_header, BASELINE_VERSION);
+    for (std::map<BaselineKey, Entry>::iterator mit = merged.begin(); mit != merged.end(); ++mit) {
+        fprintf(fh, "%s\t%s\t%u\t%.3f\t%s\n", mit->first.filename.c_str(),
+                    hash_to_hex(mit->first.hash).c_str(), mit->first.occurrence,
+                    mit->second.ns / 1e6, mit->second.description.c_str());
+    }
+    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+    bool success = (ferror(fh) == 0);
+    success = (fclose(fh) == 0) && success;
+    if (success && (rename(&tmp_name[0], path) != 0)) {
+        success = false;
+    }
+    if (!success) {
+        log_error("could not write the baseline %s", path);
+        unlink(&tmp_name[0]);
+    }
+    return success;
+}
@@ -0,0 +1,127 @@
+#ifndef __baseline_h__
+#define __baseline_h__
+
+#include <string>
+#include <map>
+#include <set>
+
+#include <pthread.h>
+
+#include "chunk.h"
+#include "hash.h"
+
+namespace PsqlChunks
+{
+
+    /**
+     * identifies a chunk in the baseline by its file, the hash of its sql
+     * and the number of chunks with the same sql run before it in the file
+     */
+    struct BaselineKey
+    {
+        /** as given on the command line. empty for entries of old baselines */
+        std::string filename;
+        hash_t hash;
+        unsigned int occurrence;
+
+        BaselineKey() : filename(), hash(0), occurrence(0) {};
+
+        bool operator<(const BaselineKey & other) const
+        {
+            if (filename != other.filename) {
+                return filename < other.filename;
+            }
+            if (hash != other.hash) {
+                return hash < other.hash;
+            }
+            return occurrence < other.occurrence;
+        }
+    };
+
+
+    /**
+     * the query times of the chunks of an earlier run, used to find
+     * chunks which got slower.
+     *
+     * a chunk is matched by its file, the hash of its sql and its
+     * occurrence, so chunks with the same sql keep their own times. changed
+     * chunks are matched by their description, unless several chunks of the
+     * baseline share it. with filters the occurrence only counts the chunks
+     * run.
+     *
+     * the baseline is a text file with a line for each chunk holding the
+     * file, the hash, the occurrence, the query time in milliseconds and
+     * the description, separated by tabs, so changes of it can be reviewed.
+     */
+    class Baseline
+    {
+        private:
+            Baseline(const Baseline&);
+            Baseline& operator=(const Baseline&);
+
+            struct Entry
+            {
+                uint64_t ns;
+                std::string description;
+            };
+
+            /** a chunk is slower than allowed when it exceeds both limits */
+            double max_ratio;
+            uint64_t max_slowdown_ns;
+
+            std::map<BaselineKey, Entry> entries;
+
+            /** the keys of the entries by description. ambiguous descriptions are not contained */
+            std::map<std::string, BaselineKey> by_description;
+
+            /** the chunks of the current run, kept by save */
+            std::map<BaselineKey, Entry> updated;
+
+            /** entries of changed chunks, which are replaced by save */
+            std::set<BaselineKey> replaced;
+
+            /** the chunks run so far by file and hash of their sql */
+            std::map<std::pair<std::string, hash_t>, unsigned int> occurrences;
+
+            unsigned int regressed_count;
+
+            /** the chunks are checked by the threads of parallel runs */
+            pthread_mutex_t mutex;
+
+        public:
+            Baseline(double _max_ratio, uint64_t _max_slowdown_ns);
+            ~Baseline();
+
+            /** returns false when the file can not be read or is not a baseline */
+            bool load(const char * path);
+
+            /**
+             * the key of a chunk about to be run. has to be called for
+             * every chunk run, in the order of its file, whether it passes
+             * or not
+             */
+            BaselineKey nextKey(const Chunk & chunk);
+
+            /**
+             * compare the query time of a chunk which passed with the
+             * baseline. returns true when it got slower than allowed, the
+             * query time of the baseline is returned in baseline_ns.
+             * the chunk is remembered for save
+             */
+            bool compare(const Chunk & chunk, const BaselineKey & key, uint64_t & baseline_ns);
+
+            unsigned int getRegressedCount()
+            {
+                return regressed_count;
+            }
+
+            /**
+             * write the query times of the chunks of this run. chunks of the
+             * baseline which were not run are kept
+             */
+            bool save(const char * path);
+    };
+
+};
+
+#endif /* __baseline_h__ */
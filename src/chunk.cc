@@ -1,5 +1,7 @@
 #include <sstream>
 #include <algorithm>
+#include <cstdlib>
+#include <cstring>
 
 #include <chunk.h>
 #include <debug.h>
@@ -8,32 +10,73 @@ using namespace PsqlChunks;
 
 static const char * s_chunk_sep = "-----------------------------------------------------------";
 static const char * s_comment_start = "-- ";
+static const char * s_empty = "";
+
+// size of the blocks used to store copies of lines
+#define CHUNK_STORAGE_BLOCK_SIZE    (64*1024)
 
 
 // prototypes for local functions
 void static writeBlock(std::ostream &stream, const char * block_type, const std::string & contents);
 void inline static stringAppend(std::string & target, std::string & fragment);
+bool static lineNumberLess(const Line & line, linenumber_t number);
+static char * allocateBlock(size_t size);
 
 
 // ### Line ############################################
 
 Line::Line()
-    : number(0), contents("")
+    : number(0), offset(0), data(s_empty), length(0)
+{
+}
+
+
+Line::Line(const char * _data, size_t _length, linenumber_t _number, byteoffset_t _offset)
+    : number(_number), offset(_offset), data(_data), length(_length)
+{
+}
+
+
+// ### Diagnostics ######################################
+
+void
+Diagnostics::clear()
 {
+    times.clear();
+    resources.clear();
+    error_line = 1;
+    status = Ok;
+    sqlstate.clear();
+    msg_primary.clear();
+    msg_detail.clear();
+    msg_hint.clear();
+    msg_internal_query.clear();
+    msg_context.clear();
 }
 
 
-Line::Line(std::string _contents, linenumber_t _number)
-    : number(_number), contents(_contents)
+void
+Diagnostics::swap(Diagnostics &other)
 {
+    std::swap(times, other.times);
+    std::swap(resources, other.resources);
+    std::swap(error_line, other.error_line);
+    std::swap(status, other.status);
+    sqlstate.swap(other.sqlstate);
+    msg_primary.swap(other.msg_primary);
+    msg_detail.swap(other.msg_detail);
+    msg_hint.swap(other.msg_hint);
+    msg_internal_query.swap(other.msg_internal_query);
+    msg_context.swap(other.msg_context);
 }
 
 
 // ### Chunk ############################################
 
 Chunk::Chunk()
-    : sql_lines(), start_comment(""), end_comment(""),
-      start_line(0), end_line(0), diagnostics()
+    : sql_lines(), start_comment(""), end_comment(""), storage(), storage_pos(NULL), storage_left(0),
+      large_storage(), owns_lines(false), sql(), sql_valid(false), start_line(0), end_line(0),
+      filename(NULL), diagnostics()
 {
 }
 
@@ -44,26 +87,86 @@ Chunk::clear()
     end_comment.clear();
     start_line = 0;
     end_line = 0;
+    filename = NULL;
+    diagnostics.clear();
 
-    // free the sql lines
-    for (linevector_t::iterator lit = sql_lines.begin(); lit != sql_lines.end(); ++lit) {
-        delete *lit;
-    }
+    // keeps the capacity
     sql_lines.clear();
+    sql.clear();
+    sql_valid = false;
+    line_starts.clear();
+    line_starts_utf8.clear();
+
+    // keep the first block of the storage for the next lines
+    if (storage.size() > 1) {
+        for (std::vector<char*>::iterator sit = storage.begin()+1; sit != storage.end(); ++sit) {
+            free(*sit);
+        }
+        storage.resize(1);
+    }
+    if (!storage.empty()) {
+        storage_pos = storage.front();
+        storage_left = CHUNK_STORAGE_BLOCK_SIZE;
+    }
+
+    for (std::vector<char*>::iterator sit = large_storage.begin(); sit != large_storage.end(); ++sit) {
+        free(*sit);
+    }
+    large_storage.clear();
+    owns_lines = false;
 }
 
 
 Chunk::~Chunk()
 {
     clear();
+    for (std::vector<char*>::iterator sit = storage.begin(); sit != storage.end(); ++sit) {
+        free(*sit);
+    }
 }
 
 Chunk& 
 Chunk::operator=(const Chunk &other) {
+    assign(other, false);
+    return *this;
+}
+
+
+void
+Chunk::copyOwned(const Chunk &other)
+{
+    assign(other, true);
+}
+
 
+void
+Chunk::swap(Chunk &other)
+{
+    sql_lines.swap(other.sql_lines);
+    start_comment.swap(other.start_comment);
+    end_comment.swap(other.end_comment);
+    storage.swap(other.storage);
+    std::swap(storage_pos, other.storage_pos);
+    std::swap(storage_left, other.storage_left);
+    large_storage.swap(other.large_storage);
+    std::swap(owns_lines, other.owns_lines);
+    sql.swap(other.sql);
+    std::swap(sql_valid, other.sql_valid);
+    line_starts.swap(other.line_starts);
+    line_starts_utf8.swap(other.line_starts_utf8);
+    std::swap(start_line, other.start_line);
+    std::swap(end_line, other.end_line);
+    std::swap(filename, other.filename);
+    diagnostics.swap(other.diagnostics);
+}
+
+
+void
+Chunk::assign(const Chunk &other, bool copy_lines)
+{
     // check for self-assignment
     if (this == &other) {
-        return *this;
+        return;
     }
 
     // deallocate this chunk
@@ -73,31 +176,66 @@ Chunk::operator=(const Chunk &other) {
     end_comment = other.end_comment;
     start_line = other.start_line;
     end_line = other.end_line;
+    filename = other.filename;
 
-    if (!other.sql_lines.empty()) {
-        for (linevector_t::const_iterator lit = other.sql_lines.begin(); 
-                lit != other.sql_lines.end(); ++lit) {
-            Line * n_line = new Line(**lit);
-            sql_lines.push_back(n_line);
+    // the lines of the other chunk are only valid as long as it exists
+    // when they are in its storage
+    copy_lines = copy_lines || other.owns_lines;
 
+    sql_lines = other.sql_lines;
+    if (copy_lines) {
+        for (linevector_t::iterator lit = sql_lines.begin(); lit != sql_lines.end(); ++lit) {
+            lit->data = store(lit->data, lit->length);
         }
     }
-    
-    diagnostics = other.diagnostics;
 
-    return *this;
+    diagnostics = other.diagnostics;
 }
 
 
 void
-Chunk::appendSqlLine(std::string linetext, linenumber_t line_number ) {
+Chunk::appendSqlLine(const char * data, size_t length, linenumber_t line_number,
+            byteoffset_t offset, bool copy)
+{
+    if (copy) {
+        data = store(data, length);
+    }
+    sql_lines.push_back(Line(data, length, line_number, offset));
+    addLineNumber(line_number);
+    sql_valid = false;
+}
+
+
+/**
+ * copy data into the storage of the chunk.
+ */
+const char *
+Chunk::store(const char * data, size_t length)
+{
+    if (length == 0) {
+        return s_empty;
+    }
+    owns_lines = true;
+
+    if (length > CHUNK_STORAGE_BLOCK_SIZE) {
+        // lines longer than the blocksize get a block of their own
+        char * block = allocateBlock(length);
+        large_storage.push_back(block);
+        memcpy(block, data, length);
+        return block;
+    }
 
-    Line * p_line = new Line();
-    p_line->number = line_number;
-    p_line->contents = linetext;
+    if (storage_left < length) {
+        storage_pos = allocateBlock(CHUNK_STORAGE_BLOCK_SIZE);
+        storage.push_back(storage_pos);
+        storage_left = CHUNK_STORAGE_BLOCK_SIZE;
+    }
 
-    sql_lines.push_back(p_line);
-    addLineNumber(p_line->number);
+    char * target = storage_pos;
+    memcpy(target, data, length);
+    storage_pos += length;
+    storage_left -= length;
+    return target;
 }
 
 
@@ -135,15 +273,91 @@ Chunk::getDescription() const
 }
 
 
-std::string
+const std::string &
 Chunk::getSql() const
 {
-    std::stringstream sqlstream;
+    if (sql_valid) {
+        return sql;
+    }
 
+    size_t length = 0;
     for (linevector_t::const_iterator lit = sql_lines.begin(); lit != sql_lines.end(); ++lit) {
-        sqlstream << (*lit)->contents << std::endl;
+        length += lit->length + 1;
     }
-    return sqlstream.str();
+
+    sql.clear();
+    sql.reserve(length);
+    line_starts.clear();
+    line_starts.reserve(sql_lines.size());
+    line_starts_utf8.clear();
+    for (linevector_t::const_iterator lit = sql_lines.begin(); lit != sql_lines.end(); ++lit) {
+        line_starts.push_back(sql.size());
+        sql.append(lit->data, lit->length);
+        sql.push_back('\n');
+    }
+    sql_valid = true;
+    return sql;
+}
+
+
+linenumber_t
+Chunk::lineAtPosition(size_t position, bool utf8) const
+{
+    const std::string & text = getSql();
+    const std::vector<size_t> * starts = &line_starts;
+    size_t length = text.size();
+
+    if (utf8) {
+        // count the characters of each line. everything but continuation bytes
+        // starts a character
+        if (line_starts_utf8.empty() && !line_starts.empty()) {
+            line_starts_utf8.reserve(line_starts.size());
+            size_t chars = 0;
+            for (size_t i = 0; i < line_starts.size(); i++) {
+                line_starts_utf8.push_back(chars);
+                size_t end = (i + 1) < line_starts.size() ? line_starts[i+1] : text.size();
+                for (size_t c = line_starts[i]; c < end; c++) {
+                    if ((static_cast<unsigned char>(text[c]) & 0xc0) != 0x80) {
+                        chars++;
+                    }
+                }
+            }
+            line_starts_utf8.push_back(chars);
+        }
+        if (!line_starts_utf8.empty()) {
+            length = line_starts_utf8.back();
+        }
+        starts = &line_starts_utf8;
+    }
+
+    if (position >= length) {
+        return LINE_NUMBER_NOT_AVAILABLE;
+    }
+
+    // the last line starting at or before the position. the utf8 table has an
+    // additional entry for the end of the text, which is never found here
+    std::vector<size_t>::const_iterator sit = std::upper_bound(starts->begin(), starts->end(), position);
+    return start_line + ((sit - starts->begin()) - 1);
+}
+
+
+/**
+ * compares the number of a line for findLine
+ */
+bool static
+lineNumberLess(const Line & line, linenumber_t number)
+{
+    return line.number < number;
+}
+
+
+size_t
+Chunk::findLine(linenumber_t line_number) const
+{
+    // the line numbers are ascending, only empty lines inserted for skipped
+    // lines may repeat the number of the line before them
+    return std::lower_bound(sql_lines.begin(), sql_lines.end(), line_number, lineNumberLess)
+                - sql_lines.begin();
 }
 
 
@@ -159,7 +373,7 @@ namespace PsqlChunks
         writeBlock(stream, "start", chunk.start_comment);
 
         for (linevector_t::const_iterator lit = chunk.sql_lines.begin(); lit != chunk.sql_lines.end(); ++lit) {
-            stream << (*lit)->contents << std::endl;
+            stream.write(lit->data, lit->length) << std::endl;
         }
 
         if (chunk.end_comment.empty()) {
@@ -176,7 +390,7 @@ namespace PsqlChunks
     std::ostream &
     operator<<(std::ostream &stream, Line &line)
     {
-        stream << line.contents << std::endl;
+        stream.write(line.data, line.length) << std::endl;
         return stream;
     }
 };
@@ -225,3 +439,16 @@ stringAppend(std::string & target, std::string & fragment)
 }
 
 
+
+
+static char *
+allocateBlock(size_t size)
+{
+    char * block = static_cast<char *>(malloc(size));
+    if (!block) {
+        log_error("could not allocate %lu bytes of chunk storage",
+                static_cast<unsigned long>(size));
+        abort();
+    }
+    return block;
+}
@@ -4,30 +4,55 @@
 #include <string>
 #include <vector>
 #include <iostream>
-#include <stdint.h>
 
-#include <sys/time.h>
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+#include <inttypes.h>
+
+#include "hash.h"
+#include "timing.h"
+#include "resources.h"
 
 #define LINE_NUMBER_NOT_AVAILABLE   0
 
 namespace PsqlChunks
 {
 
-    typedef uint32_t linenumber_t;
+    typedef uint64_t linenumber_t;
+    typedef uint64_t byteoffset_t;
 
+    /**
+     * a line of sql. the contents are not owned by the line, they point
+     * either into the input or into the storage of the chunk
+     */
     class Line
     {
         public:
             linenumber_t number;
-            std::string contents;
+
+            /** byte offset of the line in the input */
+            byteoffset_t offset;
+
+            const char * data;
+            size_t length;
 
             Line();
-            Line(std::string _contents, linenumber_t _number);
+            Line(const char * _data, size_t _length, linenumber_t _number, byteoffset_t _offset);
+
+            std::string str() const
+            {
+                return std::string(data, length);
+            }
 
             friend std::ostream &operator<<(std::ostream &, PsqlChunks::Line&);
     };
 
-    typedef std::vector<Line*> linevector_t;
+    /**
+     * the lines are stored by value, so all lines of a chunk are kept in a
+     * single block of memory, which gets reused when the chunk is cleared
+     */
+    typedef std::vector<Line> linevector_t;
 
     class Diagnostics {
 
@@ -35,8 +60,11 @@ namespace PsqlChunks
 
             enum CommandStatus {Ok, Fail};
 
-            /** runtime of the query */
-            struct timeval runtime;
+            /** time spent on the chunk, from scanning it to releasing its savepoint */
+            PhaseTimes times;
+
+            /** only measured when the resource accounting is enabled */
+            ResourceUsage resources;
 
             linenumber_t error_line;
             CommandStatus status;
@@ -47,13 +75,16 @@ namespace PsqlChunks
             std::string msg_internal_query;
             std::string msg_context;
 
-            Diagnostics() : runtime(), error_line(1), status(Ok), sqlstate(""),
+            Diagnostics() : times(), resources(), error_line(1), status(Ok), sqlstate(""),
                     msg_primary(""), msg_detail(""), msg_hint(""), msg_internal_query(""),
                     msg_context("")
             {
-                runtime.tv_sec = 0;
-                runtime.tv_usec = 0;
             };
+
+            /** reset to the initial state without giving up the memory of the strings */
+            void clear();
+
+            void swap(Diagnostics &);
     };
 
 
@@ -68,7 +99,28 @@ namespace PsqlChunks
             std::string start_comment;
             std::string end_comment;
 
+            /** blocks holding copies of lines which do not stay valid in the input */
+            std::vector<char*> storage;
+            char * storage_pos;
+            size_t storage_left;
+
+            /** blocks of lines longer than the block size */
+            std::vector<char*> large_storage;
+
+            /** some lines point into the storage */
+            bool owns_lines;
+
+            /** the sql as returned by getSql. built on the first call */
+            mutable std::string sql;
+            mutable bool sql_valid;
+
+            /** offsets of the starts of the lines in sql in bytes and in utf8 characters */
+            mutable std::vector<size_t> line_starts;
+            mutable std::vector<size_t> line_starts_utf8;
+
             void addLineNumber(linenumber_t);
+            const char * store(const char * data, size_t length);
+            void assign(const Chunk&, bool copy_lines);
 
         public:
             /** the line number the contents of the chunk started */
@@ -77,6 +129,9 @@ namespace PsqlChunks
             /** the line number the contents of the chunk ended */
             linenumber_t end_line;
 
+            /** the file the chunk was read from. not owned, NULL when not known */
+            const char * filename;
+
             Diagnostics diagnostics;
 
             Chunk();
@@ -84,17 +139,67 @@ namespace PsqlChunks
 
             Chunk& operator=(const Chunk&);
 
-            void appendSqlLine(std::string , linenumber_t);
+            /** exchange the contents with another chunk without copying the lines */
+            void swap(Chunk&);
+
+            /**
+             * like the assignment operator, but copies the sql into the
+             * chunk, so it stays valid after the input has been closed
+             */
+            void copyOwned(const Chunk&);
+
+            /**
+             * append a line of sql. with copy set to false the data
+             * has to stay valid for the lifetime of the chunk.
+             */
+            void appendSqlLine(const char * data, size_t length, linenumber_t line_number,
+                        byteoffset_t offset, bool copy);
             void appendStartComment(std::string );
             void appendEndComment(std::string );
-            std::string getSql() const;
+            /**
+             * the sql lines joined by linebreaks. the text is only built once
+             * and stays valid until the chunk gets modified
+             */
+            const std::string & getSql() const;
+
+            /** true when getSql does not need to build the sql */
+            bool hasBuiltSql() const
+            {
+                return sql_valid;
+            }
+
+            /**
+             * the line number of a position in the sql returned by getSql. the position
+             * starts at 0 and is counted in utf8 characters when utf8 is set, in bytes
+             * otherwise. returns LINE_NUMBER_NOT_AVAILABLE if the position is not inside the sql.
+             */
+            linenumber_t lineAtPosition(size_t position, bool utf8) const;
+
+            /** index of the first sql line with a number >= line_number */
+            size_t findLine(linenumber_t line_number) const;
+
+            /** hash of the sql as returned by getSql */
+            hash_t getSqlHash() const
+            {
+                return hash_string(getSql());
+            }
+
+            const std::string & getStartComment() const
+            {
+                return start_comment;
+            }
+
+            const std::string & getEndComment() const
+            {
+                return end_comment;
+            }
 
             bool hasSql() const
             {
                 return !sql_lines.empty();
             }
 
-            const linevector_t & getSqlLines()
+            const linevector_t & getSqlLines() const
             {
                 return sql_lines;
             }
@@ -107,6 +212,10 @@ namespace PsqlChunks
             /** get a description for the chunk. single line */
             std::string getDescription() const;
 
+            /**
+             * remove all contents. the memory of the lines is kept
+             * to be reused by the next contents of the chunk
+             */
             void clear();
 
             friend std::ostream &operator<<(std::ostream &, const PsqlChunks::Chunk&);
@@ -0,0 +1,593 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "chunkindex.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+// identifies index files. the last character is the version of the format
+static const char * s_index_magic = "PSQLCIX2";
+
+// detects index files written on machines with a different byte order
+static const uint64_t s_byte_order_mark = 0x0102030405060708ULL;
+
+// number of bytes of a LineRun in the index file
+#define RUN_RECORD_SIZE     (4 * sizeof(uint64_t))
+
+
+// prototypes for local functions
+void static write_u64(std::string & buf, uint64_t value);
+void static write_string(std::string & buf, const std::string & value);
+bool static read_u64(const std::string & buf, size_t & pos, uint64_t & value);
+bool static read_string(const std::string & buf, size_t & pos, std::string & value);
+bool static stat_mtime(const char * filename, uint64_t & size, uint64_t & sec, uint64_t & nsec);
+bool static valid_entry(const IndexEntry & entry, uint64_t file_size);
+bool static valid_run(const IndexEntry & entry, const LineRun & run, uint64_t file_size);
+bool static entry_ends_before(const IndexEntry & entry, linenumber_t line);
+
+
+// ### ChunkIndex #######################################
+
+void
+ChunkIndex::addChunk(const Chunk & chunk)
+{
+    IndexEntry entry;
+    entry.start_line = chunk.start_line;
+    entry.end_line = chunk.end_line;
+    entry.start_offset = 0;
+    entry.end_offset = 0;
+    entry.sql_hash = chunk.getSqlHash();
+    entry.start_comment = chunk.getStartComment();
+    entry.end_comment = chunk.getEndComment();
+
+    bool have_offset = false;
+    const linevector_t & lines = chunk.getSqlLines();
+    for (linevector_t::const_iterator lit = lines.begin(); lit != lines.end(); ++lit) {
+        const Line & line = *lit;
+        bool blank = (line.length == 0);
+
+        if (!blank) {
+            if (!have_offset) {
+                entry.start_offset = line.offset;
+                have_offset = true;
+            }
+            entry.end_offset = line.offset + line.length;
+        }
+
+        if (!entry.runs.empty()) {
+            LineRun & run = entry.runs.back();
+            if ((run.blank == blank) && (line.number == (run.first_number + run.count))) {
+                if (blank) {
+                    run.count++;
+                    continue;
+                }
+                // the previous line has to end directly before this one
+                if ((lit != lines.begin()) &&
+                        (line.offset == ((lit-1)->offset + (lit-1)->length + 1))) {
+                    run.count++;
+                    continue;
+                }
+            }
+        }
+
+        LineRun run;
+        run.first_number = line.number;
+        run.offset = line.offset;
+        run.count = 1;
+        run.blank = blank;
+        entry.runs.push_back(run);
+    }
+
+    entries.push_back(entry);
+}
+
+
+bool
+ChunkIndex::setFile(const char * filename, const MappedInput & input)
+{
+    if (!stat_mtime(filename, file_size, mtime_sec, mtime_nsec)) {
+        return false;
+    }
+    content_hash = hash_bytes(input.data(), input.size());
+    return true;
+}
+
+
+bool
+ChunkIndex::isValidFor(const char * filename, const MappedInput & input, bool & updated)
+{
+    uint64_t size, sec, nsec;
+    updated = false;
+
+    if (!stat_mtime(filename, size, sec, nsec)) {
+        return false;
+    }
+    if ((size != file_size) || (input.size() != file_size)) {
+        return false;
+    }
+    if ((sec == mtime_sec) && (nsec == mtime_nsec)) {
+        return true;
+    }
+
+    // the file might just have been touched - for example by a
+    // fresh checkout - so compare the contents
+    if (hash_bytes(input.data(), input.size()) != content_hash) {
+        return false;
+    }
+    mtime_sec = sec;
+    mtime_nsec = nsec;
+    updated = true;
+    return true;
+}
+
+
+bool
+ChunkIndex::load(const std::string & path, bool with_runs)
+{
+    FILE * fh = fopen(path.c_str(), "rb");
+    if (!fh) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fileno(fh), &st) != 0) {
+        fclose(fh);
+        return false;
+    }
+
+    std::string buf(static_cast<size_t>(st.st_size), '\0');
+    size_t nread = buf.empty() ? 0 : fread(&buf[0], 1, buf.size(), fh);
+    fclose(fh);
+    if (nread != buf.size()) {
+        log_debug("could not read index file %s", path.c_str());
+        return false;
+    }
+
+    size_t magic_len = strlen(s_index_magic);
+    if ((buf.size() < magic_len) || (buf.compare(0, magic_len, s_index_magic) != 0)) {
+        log_debug("%s is not an index file", path.c_str());
+        return false;
+    }
+
+    size_t pos = magic_len;
+    uint64_t bom, body_hash, entry_count;
+    if (!read_u64(buf, pos, bom) || (bom != s_byte_order_mark) ||
+            !read_u64(buf, pos, file_size) ||
+            !read_u64(buf, pos, mtime_sec) ||
+            !read_u64(buf, pos, mtime_nsec) ||
+            !read_u64(buf, pos, content_hash) ||
+            !read_u64(buf, pos, body_hash)) {
+        log_debug("invalid header in index file %s", path.c_str());
+        return false;
+    }
+
+    // the entries are only checked for values which would make the
+    // reader misbehave, damaged files are detected by the hash
+    if (hash_bytes(buf.data() + pos, buf.size() - pos) != body_hash) {
+        log_debug("damaged index file %s", path.c_str());
+        return false;
+    }
+    if (!read_u64(buf, pos, entry_count)) {
+        log_debug("invalid header in index file %s", path.c_str());
+        return false;
+    }
+
+    entries.clear();
+    entries.reserve(static_cast<size_t>(std::min(entry_count, static_cast<uint64_t>(buf.size()))));
+    for (uint64_t e = 0; e < entry_count; e++) {
+        IndexEntry entry;
+        uint64_t run_count;
+        if (!read_u64(buf, pos, entry.start_line) ||
+                !read_u64(buf, pos, entry.end_line) ||
+                !read_u64(buf, pos, entry.start_offset) ||
+                !read_u64(buf, pos, entry.end_offset) ||
+                !read_u64(buf, pos, entry.sql_hash) ||
+                !read_string(buf, pos, entry.start_comment) ||
+                !read_string(buf, pos, entry.end_comment) ||
+                !read_u64(buf, pos, run_count) ||
+                (((buf.size() - pos) / RUN_RECORD_SIZE) < run_count)) {
+            log_debug("truncated index file %s", path.c_str());
+            entries.clear();
+            return false;
+        }
+        if (!valid_entry(entry, file_size)) {
+            log_debug("invalid entry in index file %s", path.c_str());
+            entries.clear();
+            return false;
+        }
+
+        if (!with_runs) {
+            pos += run_count * RUN_RECORD_SIZE;
+            entries.push_back(entry);
+            continue;
+        }
+
+        entry.runs.reserve(static_cast<size_t>(run_count));
+        for (uint64_t r = 0; r < run_count; r++) {
+            LineRun run;
+            uint64_t blank;
+            if (!read_u64(buf, pos, run.first_number) ||
+                    !read_u64(buf, pos, run.offset) ||
+                    !read_u64(buf, pos, run.count) ||
+                    !read_u64(buf, pos, blank)) {
+                log_debug("truncated index file %s", path.c_str());
+                entries.clear();
+                return false;
+            }
+            run.blank = (blank != 0);
+            if ((blank > 1) || !valid_run(entry, run, file_size)) {
+                log_debug("invalid entry in index file %s", path.c_str());
+                entries.clear();
+                return false;
+            }
+            entry.runs.push_back(run);
+        }
+        entries.push_back(entry);
+    }
+    return true;
+}
+
+
+bool
+ChunkIndex::save(const std::string & path) const
+{
+    std::string buf(s_index_magic);
+    write_u64(buf, s_byte_order_mark);
+    write_u64(buf, file_size);
+    write_u64(buf, mtime_sec);
+    write_u64(buf, mtime_nsec);
+    write_u64(buf, content_hash);
+
+    // the hash of the body is filled in once the body is complete
+    size_t body_hash_pos = buf.size();
+    write_u64(buf, 0);
+    write_u64(buf, entries.size());
+
+    for (std::vector<IndexEntry>::const_iterator eit = entries.begin(); eit != entries.end(); ++eit) {
+        write_u64(buf, eit->start_line);
+        write_u64(buf, eit->end_line);
+        write_u64(buf, eit->start_offset);
+        write_u64(buf, eit->end_offset);
+        write_u64(buf, eit->sql_hash);
+        write_string(buf, eit->start_comment);
+        write_string(buf, eit->end_comment);
+        write_u64(buf, eit->runs.size());
+        for (std::vector<LineRun>::const_iterator rit = eit->runs.begin(); rit != eit->runs.end(); ++rit) {
+            write_u64(buf, rit->first_number);
+            write_u64(buf, rit->offset);
+            write_u64(buf, rit->count);
+            write_u64(buf, rit->blank ? 1 : 0);
+        }
+    }
+
+    uint64_t body_hash = hash_bytes(buf.data() + body_hash_pos + sizeof(uint64_t),
+                buf.size() - body_hash_pos - sizeof(uint64_t));
+    memcpy(&buf[body_hash_pos], &body_hash, sizeof(body_hash));
+
+    // write to a temporary file first, so concurrent readers never
+    // see a partial index
+    std::string tmp_path = path + ".XXXXXX";
+    std::vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+    tmp_name.push_back('\0');
+
+    int fd = mkstemp(&tmp_name[0]);
+    if (fd < 0) {
+        log_debug("could not create index file for %s", path.c_str());
+        return false;
+    }
+
+    bool success = true;
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t nwritten = write(fd, buf.data() + written, buf.size() - written);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            success = false;
+            break;
+        }
+        written += static_cast<size_t>(nwritten);
+    }
+    fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (close(fd) != 0) {
+        success = false;
+    }
+
+    if (success && (rename(&tmp_name[0], path.c_str()) != 0)) {
+        success = false;
+    }
+    if (!success) {
+        log_warn("could not write index file %s", path.c_str());
+        unlink(&tmp_name[0]);
+    }
+    return success;
+}
+
+
+bool
+ChunkIndex::saveMtime(const std::string & path) const
+{
+    int fd = open(path.c_str(), O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    // the mtime directly follows the magic, the byte order mark and the file size
+    uint64_t mtime[2];
+    mtime[0] = mtime_sec;
+    mtime[1] = mtime_nsec;
+    off_t pos = static_cast<off_t>(strlen(s_index_magic) + 2 * sizeof(uint64_t));
+
+    bool success = (pwrite(fd, mtime, sizeof(mtime), pos) == static_cast<ssize_t>(sizeof(mtime)));
+    if (close(fd) != 0) {
+        success = false;
+    }
+    if (!success) {
+        log_warn("could not update index file %s", path.c_str());
+    }
+    return success;
+}
+
+
+std::string
+ChunkIndex::pathFor(const char * filename, const char * index_dir)
+{
+    if (index_dir == NULL) {
+        return std::string(filename) + INDEX_SIDECAR_EXTENSION;
+    }
+
+    // the same file may be referenced by different relative paths
+    char resolved[PATH_MAX];
+    std::string name(filename);
+    if (realpath(filename, resolved) != NULL) {
+        name.assign(resolved);
+    }
+
+    std::string path(index_dir);
+    if (!path.empty() && (path[path.size()-1] != '/')) {
+        path.append("/");
+    }
+    path.append(hash_to_hex(hash_string(name)));
+    path.append(INDEX_SIDECAR_EXTENSION);
+    return path;
+}
+
+
+// ### IndexReader ######################################
+
+bool
+IndexReader::nextChunk(Chunk & chunk)
+{
+    chunk.clear();
+
+    if (eof()) {
+        return false;
+    }
+    const IndexEntry & entry = index.entries[position++];
+
+    chunk.appendStartComment(entry.start_comment);
+    chunk.appendEndComment(entry.end_comment);
+
+    if (with_sql) {
+        const char * file_end = input.data() + input.size();
+
+        for (std::vector<LineRun>::const_iterator rit = entry.runs.begin(); rit != entry.runs.end(); ++rit) {
+            if (rit->blank) {
+                for (uint64_t i = 0; i < rit->count; i++) {
+                    chunk.appendSqlLine("", 0, rit->first_number + i, rit->offset, false);
+                }
+                continue;
+            }
+
+            if (rit->offset > input.size()) {
+                log_error("index does not match the file - line offset is out of range");
+                return false;
+            }
+
+            const char * p = input.data() + rit->offset;
+            for (uint64_t i = 0; i < rit->count; i++) {
+                const char * nl = static_cast<const char *>(memchr(p, '\n', file_end - p));
+                size_t length = nl ? (nl - p) : (file_end - p);
+                chunk.appendSqlLine(p, length, rit->first_number + i,
+                            p - input.data(), false);
+                p = nl ? nl + 1 : file_end;
+            }
+        }
+    }
+
+    chunk.start_line = entry.start_line;
+    chunk.end_line = entry.end_line;
+    return true;
+}
+
+
+void
+IndexReader::seekLine(linenumber_t line)
+{
+    // the entries are ordered by their lines
+    std::vector<IndexEntry>::const_iterator eit = std::lower_bound(index.entries.begin(),
+                index.entries.end(), line, entry_ends_before);
+    position = eit - index.entries.begin();
+}
+
+
+// ### IndexCache #######################################
+
+IndexCache::IndexCache()
+    : indexes(), retired(), mutex()
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+
+IndexCache::~IndexCache()
+{
+    for (std::map<std::string, ChunkIndex*>::iterator iit = indexes.begin(); iit != indexes.end(); ++iit) {
+        delete iit->second;
+    }
+    for (std::vector<ChunkIndex*>::iterator rit = retired.begin(); rit != retired.end(); ++rit) {
+        delete *rit;
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+
+const ChunkIndex *
+IndexCache::find(const char * filename, const MappedInput & input)
+{
+    char resolved[PATH_MAX];
+    if (realpath(filename, resolved) == NULL) {
+        return NULL;
+    }
+
+    ChunkIndex * index = NULL;
+    pthread_mutex_lock(&mutex);
+    std::map<std::string, ChunkIndex*>::iterator iit = indexes.find(resolved);
+    bool updated;
+    if ((iit != indexes.end()) && iit->second->isValidFor(resolved, input, updated)) {
+        index = iit->second;
+    }
+    pthread_mutex_unlock(&mutex);
+    return index;
+}
+
+
+void
+IndexCache::add(const char * filename, ChunkIndex * index)
+{
+    char resolved[PATH_MAX];
+    if (realpath(filename, resolved) == NULL) {
+        delete index;
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    ChunkIndex *& cached = indexes[resolved];
+    if (cached) {
+        retired.push_back(cached);
+    }
+    cached = index;
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void
+IndexCache::trim()
+{
+    pthread_mutex_lock(&mutex);
+    for (std::vector<ChunkIndex*>::iterator rit = retired.begin(); rit != retired.end(); ++rit) {
+        delete *rit;
+    }
+    retired.clear();
+
+    if (indexes.size() > INDEX_CACHE_MAX_FILES) {
+        log_debug("dropping %zu cached indexes", indexes.size());
+        for (std::map<std::string, ChunkIndex*>::iterator iit = indexes.begin(); iit != indexes.end(); ++iit) {
+            delete iit->second;
+        }
+        indexes.clear();
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+// ### local functions ##################################
+
+void static
+write_u64(std::string & buf, uint64_t value)
+{
+    buf.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+
+void static
+write_string(std::string & buf, const std::string & value)
+{
+    write_u64(buf, value.size());
+    buf.append(value);
+}
+
+
+bool static
+read_u64(const std::string & buf, size_t & pos, uint64_t & value)
+{
+    if ((buf.size() - pos) < sizeof(value)) {
+        return false;
+    }
+    memcpy(&value, buf.data() + pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+
+bool static
+read_string(const std::string & buf, size_t & pos, std::string & value)
+{
+    uint64_t length;
+    if (!read_u64(buf, pos, length)) {
+        return false;
+    }
+    if ((buf.size() - pos) < length) {
+        return false;
+    }
+    value.assign(buf, pos, length);
+    pos += length;
+    return true;
+}
+
+
+bool static
+stat_mtime(const char * filename, uint64_t & size, uint64_t & sec, uint64_t & nsec)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return false;
+    }
+    size = static_cast<uint64_t>(st.st_size);
+    sec = static_cast<uint64_t>(st.st_mtim.tv_sec);
+    nsec = static_cast<uint64_t>(st.st_mtim.tv_nsec);
+    return true;
+}
+
+
+/**
+ * check that the lines and offsets of an entry lie within the file.
+ * a file has at most one line more than it has bytes
+ */
+bool static
+valid_entry(const IndexEntry & entry, uint64_t file_size)
+{
+    return (entry.start_line >= 1) && (entry.start_line <= entry.end_line)
+                && (entry.end_line <= (file_size + 1))
+                && (entry.start_offset <= entry.end_offset) && (entry.end_offset <= file_size);
+}
+
+
+/**
+ * check that a run lies within the lines of its entry and the file, so
+ * reading it does not exceed the file
+ */
+bool static
+valid_run(const IndexEntry & entry, const LineRun & run, uint64_t file_size)
+{
+    return (run.count >= 1) && (run.first_number >= entry.start_line)
+                && (run.first_number <= entry.end_line)
+                && (run.count <= (entry.end_line - run.first_number + 1))
+                && (run.offset <= file_size);
+}
+
+
+bool static
+entry_ends_before(const IndexEntry & entry, linenumber_t line)
+{
+    return entry.end_line < line;
+}
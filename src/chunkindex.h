@@ -0,0 +1,184 @@
+#ifndef __chunkindex_h__
+#define __chunkindex_h__
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <pthread.h>
+
+#include "chunk.h"
+#include "hash.h"
+#include "input.h"
+#include "scanner.h"
+
+// file name extension of index files stored next to the sql files
+#define INDEX_SIDECAR_EXTENSION ".chunkidx"
+
+// maximum number of files an IndexCache keeps the index of
+#define INDEX_CACHE_MAX_FILES 4096
+
+namespace PsqlChunks
+{
+
+    /**
+     * a run of consecutive sql lines of a chunk. either lines which
+     * have been taken from the input as they are, or empty lines which
+     * replaced ignored lines (separators, empty lines) inside the sql.
+     */
+    struct LineRun
+    {
+        linenumber_t first_number;
+
+        /** byte offset of the first line. not used for blank runs */
+        byteoffset_t offset;
+
+        uint64_t count;
+        bool blank;
+    };
+
+
+    /**
+     * everything needed to recreate a chunk without running the scanner
+     */
+    struct IndexEntry
+    {
+        linenumber_t start_line;
+        linenumber_t end_line;
+
+        /** byte range of the sql lines in the file */
+        byteoffset_t start_offset;
+        byteoffset_t end_offset;
+
+        hash_t sql_hash;
+        std::string start_comment;
+        std::string end_comment;
+        std::vector<LineRun> runs;
+    };
+
+
+    /**
+     * the chunk boundaries of a single file. index files are only
+     * valid for the exact contents of the file they were created from.
+     */
+    class ChunkIndex
+    {
+        private:
+            uint64_t file_size;
+            uint64_t mtime_sec;
+            uint64_t mtime_nsec;
+            hash_t content_hash;
+
+        public:
+            std::vector<IndexEntry> entries;
+
+            ChunkIndex() : file_size(0), mtime_sec(0), mtime_nsec(0),
+                    content_hash(0), entries() {};
+
+            /** record a chunk returned by the scanner */
+            void addChunk(const Chunk & chunk);
+
+            /** set the key of the index from the file and its contents */
+            bool setFile(const char * filename, const MappedInput & input);
+
+            /**
+             * check if the index belongs to the file. when only the mtime of the
+             * file differs, the index is still valid if the contents are
+             * unchanged. in this case the mtime of the index gets updated and
+             * true will be returned in the updated parameter.
+             */
+            bool isValidFor(const char * filename, const MappedInput & input, bool & updated);
+
+            /**
+             * returns false if the file does not exist or is not a valid index file.
+             * with with_runs set to false the line runs are not loaded and
+             * the entries can not be used to read the sql of the chunks.
+             */
+            bool load(const std::string & path, bool with_runs);
+
+            /** write the index. the file is replaced atomically */
+            bool save(const std::string & path) const;
+
+            /** only update the mtime stored in an existing index file */
+            bool saveMtime(const std::string & path) const;
+
+            /**
+             * the path of the index file for a sql file. with index_dir set to NULL
+             * the index is stored next to the sql file.
+             */
+            static std::string pathFor(const char * filename, const char * index_dir);
+    };
+
+
+    /**
+     * reads chunks from an index instead of scanning the file
+     */
+    class IndexReader : public ChunkSource
+    {
+        private:
+            IndexReader(const IndexReader&);
+            IndexReader& operator=(const IndexReader&);
+
+            const ChunkIndex & index;
+            const MappedInput & input;
+            size_t position;
+
+            /** also load the sql lines of the chunks */
+            bool with_sql;
+
+        public:
+            IndexReader(const ChunkIndex & _index, const MappedInput & _input, bool _with_sql)
+                : index(_index), input(_input), position(0), with_sql(_with_sql) {};
+
+            bool nextChunk( Chunk& );
+
+            bool eof()
+            {
+                return position >= index.entries.size();
+            }
+
+            /** skip all chunks which end before the given line */
+            void seekLine(linenumber_t line);
+    };
+
+
+
+    /**
+     * keeps the indexes of files in memory, for a process handling many
+     * requests. the cached indexes stay valid until the next call of trim,
+     * so they can be used by multiple threads without copying them.
+     */
+    class IndexCache
+    {
+        private:
+            IndexCache(const IndexCache&);
+            IndexCache& operator=(const IndexCache&);
+
+            /** by the real path of the file */
+            std::map<std::string, ChunkIndex*> indexes;
+
+            /** replaced indexes, which may still be in use */
+            std::vector<ChunkIndex*> retired;
+
+            pthread_mutex_t mutex;
+
+        public:
+            IndexCache();
+            ~IndexCache();
+
+            /** returns NULL when there is no index for the contents of the file */
+            const ChunkIndex * find(const char * filename, const MappedInput & input);
+
+            /** add the index of a file. the cache takes ownership of the index */
+            void add(const char * filename, ChunkIndex * index);
+
+            /**
+             * free the replaced indexes and drop all when there are too many. no
+             * index returned by find may be in use anymore
+             */
+            void trim();
+    };
+
+};
+
+#endif /* __chunkindex_h__ */
@@ -0,0 +1,138 @@
+#include "chunkqueue.h"
+
+using namespace PsqlChunks;
+
+
+ChunkQueue::ChunkQueue()
+    : items(), queued_bytes(0), closed(false), canceled(false), pending_output(),
+      mutex(), cond_not_empty(), cond_not_full()
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond_not_empty, NULL);
+    pthread_cond_init(&cond_not_full, NULL);
+}
+
+
+ChunkQueue::~ChunkQueue()
+{
+    for (std::deque<Item>::iterator iit = items.begin(); iit != items.end(); ++iit) {
+        delete iit->chunk;
+    }
+    pthread_cond_destroy(&cond_not_full);
+    pthread_cond_destroy(&cond_not_empty);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+bool
+ChunkQueue::push(const Chunk & chunk)
+{
+    // copy and build the sql on the scanning thread, the input
+    // may be gone when the chunk gets executed
+    Item item;
+    item.chunk = new Chunk();
+    item.chunk->copyOwned(chunk);
+    size_t bytes = item.chunk->getSql().size();
+
+    item.output = pending_output.str();
+    pending_output.str("");
+
+    pthread_mutex_lock(&mutex);
+    while (!canceled && !items.empty()
+                && ((items.size() >= CHUNK_QUEUE_MAX_CHUNKS)
+                    || ((queued_bytes + bytes) > CHUNK_QUEUE_MAX_BYTES))) {
+        pthread_cond_wait(&cond_not_full, &mutex);
+    }
+
+    bool pushed = !canceled;
+    if (pushed) {
+        items.push_back(item);
+        queued_bytes += bytes;
+        pthread_cond_signal(&cond_not_empty);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (!pushed) {
+        delete item.chunk;
+    }
+    return pushed;
+}
+
+
+bool
+ChunkQueue::pushFileEnd()
+{
+    Item item;
+    item.chunk = NULL;
+    item.output = pending_output.str();
+    pending_output.str("");
+
+    // takes no space, the producer does not wait for it
+    pthread_mutex_lock(&mutex);
+    bool pushed = !canceled;
+    if (pushed) {
+        items.push_back(item);
+        pthread_cond_signal(&cond_not_empty);
+    }
+    pthread_mutex_unlock(&mutex);
+    return pushed;
+}
+
+
+void
+ChunkQueue::close()
+{
+    Item item;
+    item.chunk = NULL;
+    item.output = pending_output.str();
+    pending_output.str("");
+
+    pthread_mutex_lock(&mutex);
+    if (!item.output.empty()) {
+        items.push_back(item);
+    }
+    closed = true;
+    pthread_cond_signal(&cond_not_empty);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+bool
+ChunkQueue::pop(std::string & output, Chunk *& chunk)
+{
+    pthread_mutex_lock(&mutex);
+    while (!canceled && !closed && items.empty()) {
+        pthread_cond_wait(&cond_not_empty, &mutex);
+    }
+
+    bool popped = !canceled && !items.empty();
+    if (popped) {
+        Item & item = items.front();
+        output.swap(item.output);
+        chunk = item.chunk;
+        if (chunk) {
+            queued_bytes -= chunk->getSql().size();
+        }
+        items.pop_front();
+        pthread_cond_signal(&cond_not_full);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return popped;
+}
+
+
+void
+ChunkQueue::cancel()
+{
+    pthread_mutex_lock(&mutex);
+    canceled = true;
+    for (std::deque<Item>::iterator iit = items.begin(); iit != items.end(); ++iit) {
+        delete iit->chunk;
+    }
+    items.clear();
+    queued_bytes = 0;
+    pthread_cond_broadcast(&cond_not_full);
+    pthread_cond_broadcast(&cond_not_empty);
+    pthread_mutex_unlock(&mutex);
+}
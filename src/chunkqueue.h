@@ -0,0 +1,102 @@
+#ifndef __chunkqueue_h__
+#define __chunkqueue_h__
+
+#include <string>
+#include <deque>
+#include <sstream>
+
+#include <pthread.h>
+
+#include "chunk.h"
+
+// maximum number of chunks and bytes of sql waiting in a ChunkQueue. a
+// chunk larger than the byte limit is still accepted when the queue is empty
+#define CHUNK_QUEUE_MAX_CHUNKS      1024
+#define CHUNK_QUEUE_MAX_BYTES       (64*1024*1024)
+
+namespace PsqlChunks
+{
+
+    /**
+     * a bounded queue handing chunks from a thread scanning the files
+     * to a thread executing them.
+     *
+     * the producer writes the output which belongs in front of the next
+     * chunk (file headers) to the output stream of the queue. the consumer
+     * receives it together with that chunk.
+     *
+     * Usage:
+     *   producer:                          consumer:
+     *     queue.output() << header;          while (queue.pop(text, chunk)) {
+     *     while (...) {                          // print text, run chunk
+     *         if (!queue.push(chunk)) {          delete chunk;
+     *             break; // canceled         }
+     *         }
+     *     }
+     *     queue.close();
+     */
+    class ChunkQueue
+    {
+        private:
+            ChunkQueue(const ChunkQueue&);
+            ChunkQueue& operator=(const ChunkQueue&);
+
+            struct Item
+            {
+                std::string output;
+                Chunk * chunk;
+            };
+
+            std::deque<Item> items;
+            size_t queued_bytes;
+            bool closed;
+            bool canceled;
+
+            /** written by the producer only */
+            std::ostringstream pending_output;
+
+            pthread_mutex_t mutex;
+            pthread_cond_t cond_not_empty;
+            pthread_cond_t cond_not_full;
+
+        public:
+            ChunkQueue();
+            ~ChunkQueue();
+
+            /** output for the consumer, handed over with the next chunk */
+            std::ostream & output()
+            {
+                return pending_output;
+            }
+
+            /**
+             * add a copy of the chunk which does not depend on the input.
+             * blocks while the queue is full. returns false when the
+             * consumer canceled the queue.
+             */
+            bool push(const Chunk & chunk);
+
+            /**
+             * mark the end of a file, so the consumer can finish it after
+             * its chunks. returns false when the consumer canceled the queue.
+             */
+            bool pushFileEnd();
+
+            /** no further chunks will be pushed */
+            void close();
+
+            /**
+             * wait for the next chunk. the caller takes ownership of the chunk,
+             * which is NULL for the end of a file and for the output written
+             * after the last chunk.
+             * returns false when the queue is closed and empty, or canceled.
+             */
+            bool pop(std::string & output, Chunk *& chunk);
+
+            /** discard the queued chunks and stop the producer */
+            void cancel();
+    };
+
+};
+
+#endif /* __chunkqueue_h__ */
@@ -0,0 +1,344 @@
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+
+#include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compressedinput.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+static const unsigned char gzip_magic[] = {0x1f, 0x8b};
+static const unsigned char zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+
+Compression
+PsqlChunks::detect_compression(const char * data, size_t len)
+{
+    if ((len >= sizeof(gzip_magic)) && (memcmp(data, gzip_magic, sizeof(gzip_magic)) == 0)) {
+        return COMPRESSION_GZIP;
+    }
+    if ((len >= sizeof(zstd_magic)) && (memcmp(data, zstd_magic, sizeof(zstd_magic)) == 0)) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+
+bool
+PsqlChunks::compression_supported(Compression compression)
+{
+#ifndef HAVE_ZSTD
+    if (compression == COMPRESSION_ZSTD) {
+        return false;
+    }
+#endif
+    UNUSED_PARAMETER(compression);
+    return true;
+}
+
+
+CompressedInput::CompressedInput(int _fd, bool _close_fd, Compression _compression,
+            const std::string & _pending)
+    : BufferedInput(), fd(_fd), close_fd(_close_fd), compression(_compression),
+      pending(_pending), blocks(DECOMPRESS_QUEUE_BLOCKS), head(0), count(0),
+      started(false), finished_decompressing(false), stopping(false),
+      thread(), mutex(), cond_filled(), cond_free()
+{
+    for (std::vector<Block>::iterator bit = blocks.begin(); bit != blocks.end(); ++bit) {
+        bit->data = NULL;
+        bit->size = 0;
+        bit->pos = 0;
+    }
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond_filled, NULL);
+    pthread_cond_init(&cond_free, NULL);
+}
+
+
+CompressedInput::~CompressedInput()
+{
+    if (started) {
+        pthread_mutex_lock(&mutex);
+        stopping = true;
+        pthread_cond_broadcast(&cond_free);
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, NULL);
+    }
+
+    for (std::vector<Block>::iterator bit = blocks.begin(); bit != blocks.end(); ++bit) {
+        free(bit->data);
+    }
+    pthread_cond_destroy(&cond_free);
+    pthread_cond_destroy(&cond_filled);
+    pthread_mutex_destroy(&mutex);
+
+    if (close_fd) {
+        close(fd);
+    }
+}
+
+
+void *
+CompressedInput::threadMain(void * arg)
+{
+    CompressedInput * input = static_cast<CompressedInput *>(arg);
+    if (input->compression == COMPRESSION_ZSTD) {
+        input->decompressZstd();
+    }
+    else {
+        input->decompressGzip();
+    }
+
+    pthread_mutex_lock(&input->mutex);
+    input->finished_decompressing = true;
+    pthread_cond_broadcast(&input->cond_filled);
+    pthread_mutex_unlock(&input->mutex);
+    return NULL;
+}
+
+
+size_t
+CompressedInput::readCompressed(char * target, size_t len)
+{
+    if (!pending.empty()) {
+        size_t n = std::min(len, pending.size());
+        memcpy(target, pending.data(), n);
+        pending.erase(0, n);
+        return n;
+    }
+
+    while (true) {
+        ssize_t nread = read(fd, target, len);
+        if (nread >= 0) {
+            return static_cast<size_t>(nread);
+        }
+        if (errno != EINTR) {
+            log_error("could not read input");
+            return 0;
+        }
+    }
+}
+
+
+CompressedInput::Block *
+CompressedInput::acquireBlock()
+{
+    pthread_mutex_lock(&mutex);
+    while ((count == blocks.size()) && !stopping) {
+        pthread_cond_wait(&cond_free, &mutex);
+    }
+    Block * block = NULL;
+    if (!stopping) {
+        block = &blocks[(head + count) % blocks.size()];
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (block) {
+        if (!block->data) {
+            block->data = static_cast<char *>(malloc(INPUT_BLOCK_SIZE));
+            if (!block->data) {
+                log_error("could not allocate decompression buffer");
+                abort();
+            }
+        }
+        block->size = 0;
+        block->pos = 0;
+    }
+    return block;
+}
+
+
+void
+CompressedInput::publishBlock()
+{
+    pthread_mutex_lock(&mutex);
+    count++;
+    pthread_cond_signal(&cond_filled);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void
+CompressedInput::decompressGzip()
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    // 16 selects the gzip format
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK) {
+        log_error("could not initialize gzip decompression");
+        return;
+    }
+
+    char * in = static_cast<char *>(malloc(DECOMPRESS_READ_SIZE));
+    Block * block = NULL;
+    bool at_end = false;
+    bool in_stream = false;
+    bool more_output = false;
+    int zrc = Z_OK;
+
+    // with a full output block there may be more output without further input
+    while (!at_end || (strm.avail_in > 0) || more_output) {
+        if ((strm.avail_in == 0) && !at_end) {
+            size_t nread = readCompressed(in, DECOMPRESS_READ_SIZE);
+            if (nread == 0) {
+                at_end = true;
+                continue;
+            }
+            strm.next_in = reinterpret_cast<Bytef *>(in);
+            strm.avail_in = static_cast<uInt>(nread);
+        }
+
+        if (!block && ((block = acquireBlock()) == NULL)) {
+            break;
+        }
+
+        strm.next_out = reinterpret_cast<Bytef *>(block->data + block->size);
+        strm.avail_out = static_cast<uInt>(INPUT_BLOCK_SIZE - block->size);
+        uInt avail_in = strm.avail_in;
+        zrc = inflate(&strm, Z_NO_FLUSH);
+        block->size = INPUT_BLOCK_SIZE - strm.avail_out;
+        more_output = (strm.avail_out == 0);
+        if (strm.avail_in != avail_in) {
+            in_stream = true;
+        }
+
+        if (zrc == Z_STREAM_END) {
+            // concatenated gzip files are decompressed like zcat does
+            inflateReset(&strm);
+            in_stream = false;
+        }
+        else if ((zrc != Z_OK) && (zrc != Z_BUF_ERROR)) {
+            log_error("could not decompress gzip input: %s", strm.msg ? strm.msg : "unknown error");
+            in_stream = false;
+            break;
+        }
+
+        if (block->size == INPUT_BLOCK_SIZE) {
+            publishBlock();
+            block = NULL;
+        }
+    }
+
+    if (in_stream && at_end) {
+        log_error("unexpected end of gzip input");
+    }
+    if (block && (block->size > 0)) {
+        publishBlock();
+    }
+    inflateEnd(&strm);
+    free(in);
+}
+
+
+#ifdef HAVE_ZSTD
+void
+CompressedInput::decompressZstd()
+{
+    ZSTD_DStream * dstrm = ZSTD_createDStream();
+    if (!dstrm) {
+        log_error("could not initialize zstd decompression");
+        return;
+    }
+
+    char * in_data = static_cast<char *>(malloc(DECOMPRESS_READ_SIZE));
+    ZSTD_inBuffer in = {in_data, 0, 0};
+    Block * block = NULL;
+    bool at_end = false;
+    bool more_output = false;
+
+    // 0 once a frame has been completely decoded
+    size_t zrc = 0;
+
+    // with a full output block there may be more output without further input
+    while (!at_end || (in.pos < in.size) || more_output) {
+        if ((in.pos == in.size) && !at_end) {
+            in.size = readCompressed(in_data, DECOMPRESS_READ_SIZE);
+            in.pos = 0;
+            if (in.size == 0) {
+                at_end = true;
+                continue;
+            }
+        }
+
+        if (!block && ((block = acquireBlock()) == NULL)) {
+            break;
+        }
+
+        ZSTD_outBuffer out = {block->data, INPUT_BLOCK_SIZE, block->size};
+        zrc = ZSTD_decompressStream(dstrm, &out, &in);
+        block->size = out.pos;
+        more_output = (out.pos == out.size);
+        if (ZSTD_isError(zrc)) {
+            log_error("could not decompress zstd input: %s", ZSTD_getErrorName(zrc));
+            zrc = 0;
+            break;
+        }
+
+        if (block->size == INPUT_BLOCK_SIZE) {
+            publishBlock();
+            block = NULL;
+        }
+    }
+
+    if ((zrc != 0) && at_end) {
+        log_error("unexpected end of zstd input");
+    }
+    if (block && (block->size > 0)) {
+        publishBlock();
+    }
+    ZSTD_freeDStream(dstrm);
+    free(in_data);
+}
+#else
+void
+CompressedInput::decompressZstd()
+{
+    log_error("zstd compressed input is not supported by this build");
+}
+#endif
+
+
+size_t
+CompressedInput::readBlock(char * target, size_t len)
+{
+    if (!started) {
+        if (pthread_create(&thread, NULL, threadMain, this) != 0) {
+            log_error("could not create decompression thread");
+            abort();
+        }
+        started = true;
+    }
+
+    pthread_mutex_lock(&mutex);
+    while ((count == 0) && !finished_decompressing) {
+        pthread_cond_wait(&cond_filled, &mutex);
+    }
+    if (count == 0) {
+        pthread_mutex_unlock(&mutex);
+        return 0;
+    }
+    Block & block = blocks[head];
+    pthread_mutex_unlock(&mutex);
+
+    // the decompression thread does not touch filled blocks
+    size_t n = std::min(len, block.size - block.pos);
+    memcpy(target, block.data + block.pos, n);
+    block.pos += n;
+
+    if (block.pos == block.size) {
+        pthread_mutex_lock(&mutex);
+        head = (head + 1) % blocks.size();
+        count--;
+        pthread_cond_signal(&cond_free);
+        pthread_mutex_unlock(&mutex);
+    }
+    return n;
+}
@@ -0,0 +1,101 @@
+#ifndef __compressedinput_h__
+#define __compressedinput_h__
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "input.h"
+
+// number of decompressed blocks of INPUT_BLOCK_SIZE bytes which may be
+// buffered ahead of the scanner
+#define DECOMPRESS_QUEUE_BLOCKS 4
+
+// size of the blocks read from the compressed file
+#define DECOMPRESS_READ_SIZE    (256*1024)
+
+// number of bytes needed to detect the compression
+#define COMPRESSION_MAGIC_LEN   4
+
+namespace PsqlChunks
+{
+
+    enum Compression {
+        COMPRESSION_NONE,
+        COMPRESSION_GZIP,
+        COMPRESSION_ZSTD
+    };
+
+    /** detect the compression from the first bytes of a file */
+    Compression detect_compression(const char * data, size_t len);
+
+    /** false if the compression is not supported by this build */
+    bool compression_supported(Compression compression);
+
+
+    /**
+     * reads a gzip or zstd compressed file descriptor.
+     *
+     * the decompression runs on its own thread, which stays at most
+     * DECOMPRESS_QUEUE_BLOCKS blocks ahead of the scanner. the thread
+     * gets started with the first read.
+     */
+    class CompressedInput : public BufferedInput
+    {
+        private:
+            CompressedInput(const CompressedInput&);
+            CompressedInput& operator=(const CompressedInput&);
+
+            struct Block
+            {
+                char * data;
+                size_t size;
+                size_t pos;
+            };
+
+            int fd;
+            bool close_fd;
+            Compression compression;
+
+            /** data already read from fd to detect the compression */
+            std::string pending;
+
+            /** ring of decompressed blocks. count blocks starting at head are filled */
+            std::vector<Block> blocks;
+            size_t head;
+            size_t count;
+
+            bool started;
+            bool finished_decompressing;
+            bool stopping;
+
+            pthread_t thread;
+            pthread_mutex_t mutex;
+            pthread_cond_t cond_filled;
+            pthread_cond_t cond_free;
+
+            static void * threadMain(void * arg);
+
+            /** read compressed data. returns 0 at the end of the file */
+            size_t readCompressed(char * target, size_t len);
+
+            /** wait for a free block. returns NULL when the input gets destroyed */
+            Block * acquireBlock();
+            void publishBlock();
+
+            void decompressGzip();
+            void decompressZstd();
+
+        protected:
+            size_t readBlock(char * target, size_t len);
+
+        public:
+            CompressedInput(int _fd, bool _close_fd, Compression _compression,
+                        const std::string & _pending);
+            ~CompressedInput();
+    };
+
+};
+
+#endif /* __compressedinput_h__ */
@@ -2,10 +2,11 @@
 #include <algorithm>
 #include <sstream>
 
-#include <ctime>
 #include <cstring>
 #include <cerrno>
 
+#include <poll.h>
+
 #include "debug.h"
 #include "db.h"
 
@@ -14,30 +15,9 @@
 using namespace PsqlChunks;
 
 
-bool
-timeval_subtract (struct timeval &result, struct timeval & x, struct timeval &y)
-{
-    if (x.tv_usec < y.tv_usec) {
-        int nsec = (y.tv_usec - x.tv_usec) / 1000000 + 1;
-        y.tv_usec -= 1000000 * nsec;
-        y.tv_sec += nsec;
-    }
-    if (x.tv_usec - y.tv_usec > 1000000) {
-        int nsec = (x.tv_usec - y.tv_usec) / 1000000;
-        y.tv_usec += 1000000 * nsec;
-        y.tv_sec -= nsec;
-    }
-
-    result.tv_sec = x.tv_sec - y.tv_sec;
-    result.tv_usec = x.tv_usec - y.tv_usec;
-
-    return x.tv_sec < y.tv_sec;
-}
-
-
-
 Db::Db()
-    : conn(NULL), do_commit(false), failed_count(0), in_transaction(false)
+    : conn(NULL), do_commit(false), failed_count(0), in_transaction(false), pipeline(false),
+      times(), account_resources(false), resource_sql(), resources()
 {
 }
 
@@ -69,11 +49,64 @@ Db::setEncoding(const char * enc_name)
     return true;
 }
 
+std::string
+Db::getServerFingerprint()
+{
+    static const char * fingerprint_sql =
+        "select version(), current_database(), current_user, "
+        "(select string_agg(name || '=' || setting, ',' order by name) "
+        "from pg_settings where source not in ('default', 'override'));";
+
+    if (!isConnected()) {
+        DbException e("lost db connection");
+        throw e;
+    }
+
+    PGresult * pgres = PQexec(conn, fingerprint_sql);
+    if (!pgres) {
+        log_error("PQExec failed");
+        DbException e("PQExec failed");
+        throw e;
+    }
+    if (PQresultStatus(pgres) != PGRES_TUPLES_OK) {
+        std::string msg("could not fetch the server fingerprint: ");
+        msg.append(PQresultErrorMessage(pgres));
+        PQclear(pgres);
+        DbException e(msg);
+        throw e;
+    }
+
+    std::string fingerprint;
+    for (int row = 0; row < PQntuples(pgres); row++) {
+        for (int col = 0; col < PQnfields(pgres); col++) {
+            fingerprint.append(PQgetvalue(pgres, row, col));
+            fingerprint.append("\n");
+        }
+    }
+    PQclear(pgres);
+
+    return fingerprint;
+}
+
+
 void
 Db::disconnect()
 {
-    finish();
+    if (conn) {
+        finish();
+        PQfinish(conn);
+        conn = NULL;
+    }
+}
+
+
+void
+Db::abandon()
+{
     PQfinish(conn);
+    conn = NULL;
+    in_transaction = false;
+    failed_count = 0;
 }
 
 
@@ -89,6 +122,31 @@ Db::isConnected()
 }
 
 
+bool
+Db::isAlive()
+{
+    // reads what the server sent, a closed socket breaks the connection
+    if (!conn || (PQconsumeInput(conn) == 0)) {
+        return false;
+    }
+    return PQstatus(conn) == CONNECTION_OK;
+}
+
+
+std::string
+Db::quoteIdentifier(const std::string & name)
+{
+    char * quoted = PQescapeIdentifier(conn, name.c_str(), name.size());
+    if (!quoted) {
+        DbException e(getErrorMessage());
+        throw e;
+    }
+    std::string result(quoted);
+    PQfreemem(quoted);
+    return result;
+}
+
+
 std::string
 Db::getErrorMessage()
 {
@@ -108,35 +166,53 @@ Db::runChunk(Chunk & chunk)
         throw e;
     }
 
-    begin();
-
-    std::string sql = chunk.getSql();
+    const std::string & sql = chunk.getSql();
     chunk.diagnostics.status = Diagnostics::Ok;
+    PhaseTimes & chunk_times = chunk.diagnostics.times;
 
-    // start time
-    struct timeval start_time;
-    if (gettimeofday(&start_time, NULL)!=0) {
-        DbException e(strerror(errno));
-        throw e;
+    // length of the commands in front of the sql of the chunk
+    size_t prefix_length = 0;
+    PGresult * pgres;
+
+    // the counters of the transaction are read, so it has to be started first
+    ResourceUsage resources_before;
+    if (account_resources) {
+        begin();
+        readResources(resources_before);
     }
 
-    executeSql("savepoint chunk;");
+    if (pipeline) {
+        std::string query;
+        if (!in_transaction) {
+            query.append("begin;\n");
+            in_transaction = true;
+        }
+        query.append("savepoint chunk;\n");
+        prefix_length = query.size();
+
+        // the linebreak ends a trailing line comment of the chunk
+        static const char * release_sql = "\n;\nrelease savepoint chunk;";
+        query.reserve(prefix_length + sql.size() + strlen(release_sql));
+        query.append(sql);
+        query.append(release_sql);
 
-    PGresult * pgres = PQexec(conn, sql.c_str());
+        log_debug("executing chunk with savepoint");
+        pgres = execTimed(query.c_str(), chunk_times);
+    }
+    else {
+        uint64_t savepoint_start = monotonic_ns();
+        begin();
+        executeSql("savepoint chunk;");
+        chunk_times.ns[PHASE_SAVEPOINT] += monotonic_ns() - savepoint_start;
+
+        pgres = execTimed(sql.c_str(), chunk_times);
+    }
     if (!pgres) {
         log_error("PQExec failed");
         DbException e("PQExec failed");
         throw e;
     }
 
-    // end time
-    struct timeval end_time;
-    if (gettimeofday(&end_time, NULL)!=0) {
-        DbException e(strerror(errno));
-        throw e;
-    }
-    timeval_subtract(chunk.diagnostics.runtime, end_time, start_time);
-
 
     if ((PQresultStatus(pgres) == PGRES_FATAL_ERROR) ||
         (PQresultStatus(pgres) == PGRES_NONFATAL_ERROR)) {
@@ -145,13 +221,22 @@ Db::runChunk(Chunk & chunk)
         // error line and position in that line
         char * statement_position = PQresultErrorField(pgres, PG_DIAG_STATEMENT_POSITION);
         if (statement_position) {
-            int pos = atoi(statement_position);
-            if ((sql.begin()+pos) < sql.end()) {
-                chunk.diagnostics.error_line = chunk.start_line
-                                + std::count(sql.begin(), sql.begin()+pos, '\n');
+            // the position starts at 1 and is counted in characters. other multibyte
+            // encodings than utf8 are treated as single byte encodings
+            const char * encoding = PQparameterStatus(conn, "client_encoding");
+            bool utf8 = encoding && ((strcmp(encoding, "UTF8") == 0) || (strcmp(encoding, "UNICODE") == 0));
+
+            // the prefix only contains ascii characters
+            size_t pos = static_cast<size_t>(atol(statement_position));
+            linenumber_t error_line = LINE_NUMBER_NOT_AVAILABLE;
+            if (pos > prefix_length) {
+                error_line = chunk.lineAtPosition(pos - 1 - prefix_length, utf8);
+            }
+            if (error_line != LINE_NUMBER_NOT_AVAILABLE) {
+                chunk.diagnostics.error_line = error_line;
             }
             else {
-                log_error("PG_DIAG_STATEMENT_POSITION is beyond the length of sql string");
+                log_error("PG_DIAG_STATEMENT_POSITION is outside of the sql string");
             }
         }
         else {
@@ -192,18 +277,196 @@ Db::runChunk(Chunk & chunk)
 
     PQclear(pgres);
 
+    uint64_t release_start = monotonic_ns();
     if (chunk.diagnostics.status != Diagnostics::Ok) {
         executeSql("rollback to savepoint chunk;");
         failed_count++;
     }
-    else {
+    else if (!pipeline) {
         executeSql("release savepoint chunk;");
     }
+    chunk_times.ns[PHASE_RELEASE] += monotonic_ns() - release_start;
+    times.add(chunk_times);
+
+    if (account_resources) {
+        ResourceUsage resources_after;
+        readResources(resources_after);
+        chunk.diagnostics.resources.setDifference(resources_before, resources_after);
+        resources.add(chunk.diagnostics.resources);
+    }
 
     return (chunk.diagnostics.status == Diagnostics::Ok);
 }
 
 
+PGresult *
+Db::execTimed(const char * query, PhaseTimes & query_times)
+{
+    uint64_t start = monotonic_ns();
+    if (!PQsendQuery(conn, query)) {
+        return NULL;
+    }
+    uint64_t sent = monotonic_ns();
+
+    // the time spent waiting for data from the server is the execution,
+    // the remaining time receiving and parsing the results
+    uint64_t waiting = 0;
+    PGresult * last = NULL;
+    while (true) {
+        while (PQisBusy(conn)) {
+            struct pollfd pfd;
+            pfd.fd = PQsocket(conn);
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+
+            uint64_t wait_start = monotonic_ns();
+            int poll_rc = poll(&pfd, 1, -1);
+            waiting += monotonic_ns() - wait_start;
+
+            // PQgetResult reports a broken connection
+            if (((poll_rc < 0) && (errno != EINTR)) || (PQconsumeInput(conn) == 0)) {
+                break;
+            }
+        }
+
+        PGresult * result = PQgetResult(conn);
+        if (!result) {
+            break;
+        }
+
+        // like PQexec, return the last result or the first error
+        if (last && (PQresultStatus(last) == PGRES_FATAL_ERROR)) {
+            PQclear(result);
+        }
+        else {
+            PQclear(last);
+            last = result;
+        }
+
+        ExecStatusType status = PQresultStatus(last);
+        if ((status == PGRES_COPY_IN) || (status == PGRES_COPY_OUT)
+                    || (PQstatus(conn) == CONNECTION_BAD)) {
+            break;
+        }
+    }
+    uint64_t end = monotonic_ns();
+
+    query_times.ns[PHASE_SEND] += sent - start;
+    query_times.ns[PHASE_EXECUTE] += waiting;
+    query_times.ns[PHASE_FETCH] += (end - sent) - waiting;
+    return last;
+}
+
+
+void
+Db::setResourceAccounting(bool enable)
+{
+    account_resources = enable;
+    if (!enable) {
+        return;
+    }
+
+    // the wal position is shared by all sessions of the server
+    std::string wal_sql("pg_wal_lsn_diff(pg_current_wal_insert_lsn(), '0/0')::bigint");
+    if (PQserverVersion(conn) < 100000) {
+        wal_sql.assign("pg_xlog_location_diff(pg_current_xlog_insert_location(), '0/0')::bigint");
+    }
+    if (!canSelect(wal_sql)) {
+        log_debug("the wal position is not available");
+        wal_sql.assign("null");
+    }
+
+    // reading the memory contexts requires pg_read_all_stats
+    std::string memory_sql("(select sum(total_bytes) from pg_backend_memory_contexts)::bigint");
+    if ((PQserverVersion(conn) < 140000) || !canSelect(memory_sql)) {
+        log_debug("the memory contexts of the backend are not available");
+        memory_sql.assign("null");
+    }
+
+    // the counters of the current transaction, which are up to date while the
+    // statistics of the server are only updated after the transaction ended.
+    // reading pg_class for the query itself is not counted
+    resource_sql.assign("select ");
+    resource_sql.append(wal_sql);
+    resource_sql.append(" as wal_bytes, "
+        "coalesce(sum(case when c.relpersistence <> 't' "
+            "then pg_stat_get_xact_blocks_hit(c.oid) end), 0) as shared_hit, "
+        "coalesce(sum(case when c.relpersistence <> 't' "
+            "then pg_stat_get_xact_blocks_fetched(c.oid) - pg_stat_get_xact_blocks_hit(c.oid) end), 0) as shared_read, "
+        "coalesce(sum(case when c.relpersistence = 't' "
+            "then pg_stat_get_xact_blocks_hit(c.oid) end), 0) as local_hit, "
+        "coalesce(sum(case when c.relpersistence = 't' "
+            "then pg_stat_get_xact_blocks_fetched(c.oid) - pg_stat_get_xact_blocks_hit(c.oid) end), 0) as local_read, "
+        "coalesce(sum(pg_stat_get_xact_tuples_inserted(c.oid) + pg_stat_get_xact_tuples_updated(c.oid) "
+            "+ pg_stat_get_xact_tuples_deleted(c.oid)), 0) as rows_changed, ");
+    resource_sql.append(memory_sql);
+    resource_sql.append(" as memory_bytes from pg_catalog.pg_class c where c.oid <> 'pg_catalog.pg_class'::regclass;");
+}
+
+
+bool
+Db::canSelect(const std::string & expression)
+{
+    std::string sql = "select " + expression + ";";
+    try {
+        executeSql(sql.c_str(), true);
+    }
+    catch (DbException &e) {
+        return false;
+    }
+    return true;
+}
+
+
+void
+Db::readResources(ResourceUsage & usage)
+{
+    PGresult * pgres = PQexec(conn, resource_sql.c_str());
+    if (!pgres) {
+        log_error("PQExec failed");
+        DbException e("PQExec failed");
+        throw e;
+    }
+    if ((PQresultStatus(pgres) != PGRES_TUPLES_OK) || (PQntuples(pgres) != 1) || (PQnfields(pgres) != 7)) {
+        std::string msg("could not read the resource counters: ");
+        msg.append(PQresultErrorMessage(pgres));
+        PQclear(pgres);
+        DbException e(msg);
+        throw e;
+    }
+
+    int64_t * fields[] = {&usage.wal_bytes, &usage.shared_hit, &usage.shared_read,
+                &usage.local_hit, &usage.local_read, &usage.rows, &usage.memory_bytes};
+    for (int col = 0; col < 7; col++) {
+        if (PQgetisnull(pgres, 0, col)) {
+            *fields[col] = RESOURCE_NOT_AVAILABLE;
+        }
+        else {
+            *fields[col] = strtoll(PQgetvalue(pgres, 0, col), NULL, 10);
+        }
+    }
+    usage.measured = true;
+    PQclear(pgres);
+}
+
+
+void
+Db::setSavepoint(const std::string & name)
+{
+    begin();
+    std::string sql = "savepoint " + name + ";";
+    executeSql(sql.c_str());
+}
+
+
+void
+Db::rollbackToSavepoint(const std::string & name)
+{
+    std::string sql = "rollback to savepoint " + name + ";";
+    executeSql(sql.c_str());
+}
+
+
 void
 Db::finish()
 {
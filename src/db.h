@@ -6,6 +6,8 @@
 #include <libpq-fe.h>
 
 #include "chunk.h"
+#include "timing.h"
+#include "resources.h"
 
 namespace PsqlChunks
 {
@@ -34,15 +36,36 @@ namespace PsqlChunks
             unsigned int failed_count;
             bool in_transaction;
 
+            /** send the savepoint commands in the same query as the chunk */
+            bool pipeline;
+
+            /** the sum of the times of the chunks run on this connection */
+            PhaseTimes times;
+
+            /** read the counters of the server before and after each chunk */
+            bool account_resources;
+
+            /** the query reading the counters. see setResourceAccounting */
+            std::string resource_sql;
+
+            /** the sum of the resources used by the chunks run on this connection */
+            ResourceUsage resources;
+
             void commit();
             void rollback();
             void begin();
 
             /**
-             * silent: do not log on error
+             * PQexec, which adds the time spent sending the query, waiting for
+             * the server and reading the results to the times
              */
-            void executeSql(const char *, bool silent = false);
+            PGresult * execTimed(const char * query, PhaseTimes & query_times);
+
+            /** read the counters of the server. throws a DbException on failure */
+            void readResources(ResourceUsage & usage);
 
+            /** false when the expression can not be selected on this connection */
+            bool canSelect(const std::string & expression);
 
 
         private:
@@ -56,21 +79,91 @@ namespace PsqlChunks
             bool connect( const char * host, const char * db_name, const char * port, const char * user, const char * passwd);
             void disconnect();
 
+            /** close the connection without ending the transaction. the server discards it */
+            void abandon();
+
             std::string getErrorMessage();
             bool isConnected();
 
+            /**
+             * check if an idle connection has not been closed by the
+             * server in the meantime. does not send a query
+             */
+            bool isAlive();
+
+            /**
+             * execute sql outside of the transaction of the chunks. throws
+             * a DbException on failure.
+             * silent: do not log on error
+             */
+            void executeSql(const char *, bool silent = false);
+
+            /** quote a name for use as an identifier in sql */
+            std::string quoteIdentifier(const std::string & name);
+
             void inline setCommit(bool commit)
             {
                 do_commit = commit;
             }
 
+            /**
+             * run the begin, the savepoint, the sql of a chunk and the release
+             * of the savepoint as a single query. this saves two round trips
+             * per chunk, a failed chunk costs one more for the rollback.
+             */
+            void inline setPipeline(bool _pipeline)
+            {
+                pipeline = _pipeline;
+            }
+
             unsigned int inline getFailedCount()
             {
                 return failed_count;
             }
 
+            const PhaseTimes & getTimes() const
+            {
+                return times;
+            }
+
+            const ResourceUsage & getResources() const
+            {
+                return resources;
+            }
+
+            /** forget the times and resources of the chunks run so far */
+            void clearTotals()
+            {
+                times.clear();
+                resources.clear();
+            }
+
+            /**
+             * measure the wal written, the buffers used, the rows changed and
+             * the memory of the backend for each chunk. costs two more queries
+             * per chunk. counters the server does not provide or the user
+             * may not read are left out. has to be called outside of the
+             * transaction of the chunks.
+             */
+            void setResourceAccounting(bool enable);
+
             bool setEncoding(const char * enc_name);
 
+            /**
+             * a description of the server version and all settings
+             * which differ from the defaults. throws a DbException on failure
+             */
+            std::string getServerFingerprint();
+
+            /**
+             * set a savepoint in the transaction of the chunks, which gets
+             * started if needed. throws a DbException on failure
+             */
+            void setSavepoint(const std::string & name);
+
+            /** undo everything done after the savepoint. the savepoint is kept */
+            void rollbackToSavepoint(const std::string & name);
+
             bool runChunk(Chunk & chunk);
             void finish();
             bool cancel(std::string &);
@@ -0,0 +1,131 @@
+#include <cstdlib>
+#include <climits>
+#include <algorithm>
+
+#include <unistd.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+#include "filewatcher.h"
+#include "debug.h"
+
+// a file has been written or moved into the directory
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_MOVED_TO)
+
+using namespace PsqlChunks;
+
+
+FileWatcher::FileWatcher()
+    : inotify_fd(-1), directories(), files()
+{
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        log_error("could not initialize inotify");
+    }
+}
+
+
+FileWatcher::~FileWatcher()
+{
+    if (inotify_fd >= 0) {
+        close(inotify_fd);
+    }
+}
+
+
+bool
+FileWatcher::add(const char * filename)
+{
+    if (inotify_fd < 0) {
+        return false;
+    }
+
+    // symbolic links are followed, the target is the file which changes
+    char resolved[PATH_MAX];
+    if (realpath(filename, resolved) == NULL) {
+        return false;
+    }
+    std::string path(resolved);
+    std::string directory(dirname(resolved));
+
+    int wd = inotify_add_watch(inotify_fd, directory.c_str(), WATCH_EVENTS);
+    if (wd < 0) {
+        log_error("could not watch directory %s", directory.c_str());
+        return false;
+    }
+    directories[wd] = directory;
+    files[path] = filename;
+    return true;
+}
+
+
+bool
+FileWatcher::readEvents(std::vector<std::string> & changed)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t len = read(inotify_fd, buf, sizeof(buf));
+    if (len < 0) {
+        if (errno == EINTR) {
+            return true;
+        }
+        log_error("could not read inotify events");
+        return false;
+    }
+
+    for (char * p = buf; p < (buf + len); ) {
+        const struct inotify_event * event = reinterpret_cast<const struct inotify_event *>(p);
+        p += sizeof(struct inotify_event) + event->len;
+
+        std::map<int, std::string>::iterator dit = directories.find(event->wd);
+        if ((event->len == 0) || (dit == directories.end())) {
+            continue;
+        }
+
+        std::string path(dit->second);
+        if (path != "/") {
+            path.append("/");
+        }
+        path.append(event->name);
+
+        std::map<std::string, std::string>::iterator fit = files.find(path);
+        if ((fit != files.end())
+                    && (std::find(changed.begin(), changed.end(), fit->second) == changed.end())) {
+            log_debug("changed: %s", path.c_str());
+            changed.push_back(fit->second);
+        }
+    }
+    return true;
+}
+
+
+bool
+FileWatcher::wait(std::vector<std::string> & changed)
+{
+    changed.clear();
+
+    struct pollfd pfd;
+    pfd.fd = inotify_fd;
+    pfd.events = POLLIN;
+
+    // wait without a timeout for the first change of a file, then until
+    // no more events arrive
+    while (true) {
+        int timeout = changed.empty() ? -1 : FILE_WATCHER_SETTLE_MS;
+        int rc = poll(&pfd, 1, timeout);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("could not wait for inotify events");
+            return false;
+        }
+        if (rc == 0) {
+            return true;
+        }
+        if (!readEvents(changed)) {
+            return false;
+        }
+    }
+}
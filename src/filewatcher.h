@@ -0,0 +1,55 @@
+#ifndef __filewatcher_h__
+#define __filewatcher_h__
+
+#include <string>
+#include <vector>
+#include <map>
+
+// time in milliseconds without further changes before the changed
+// files are reported. editors write a file in several steps
+#define FILE_WATCHER_SETTLE_MS 100
+
+namespace PsqlChunks
+{
+
+    /**
+     * waits for changes of files using inotify.
+     *
+     * the directories of the files are watched instead of the files, so
+     * files which are replaced by renaming a new file over them, like many
+     * editors do, are still noticed.
+     */
+    class FileWatcher
+    {
+        private:
+            FileWatcher(const FileWatcher&);
+            FileWatcher& operator=(const FileWatcher&);
+
+            int inotify_fd;
+
+            /** directory of each watch descriptor */
+            std::map<int, std::string> directories;
+
+            /** the files as passed to add, by their real directory and name */
+            std::map<std::string, std::string> files;
+
+            /** read the pending events and add the changed files */
+            bool readEvents(std::vector<std::string> & changed);
+
+        public:
+            FileWatcher();
+            ~FileWatcher();
+
+            /** false when the file does not exist or inotify is not available */
+            bool add(const char * filename);
+
+            /**
+             * block until at least one of the files changed. the files are
+             * returned the way they were added. returns false on errors
+             */
+            bool wait(std::vector<std::string> & changed);
+    };
+
+};
+
+#endif /* __filewatcher_h__ */
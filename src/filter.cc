@@ -1,24 +1,170 @@
 #include <sstream>
 #include <cstdlib>
+#include <algorithm>
 
 #include "filter.h"
+#include "timing.h"
 #include "debug.h"
 
 
 using namespace PsqlChunks;
 
+
+// ### Filter ###########################################
+
+bool
+Filter::matchCounted(const Chunk& chunk)
+{
+    uint64_t call = __sync_fetch_and_add(&stats.calls, 1);
+    bool matched;
+
+    if ((call % FILTER_TIMING_INTERVAL) == 0) {
+        uint64_t start = monotonic_ns();
+        matched = match(chunk);
+        __sync_fetch_and_add(&stats.nanoseconds, monotonic_ns() - start);
+        __sync_fetch_and_add(&stats.timed_calls, 1);
+    }
+    else {
+        matched = match(chunk);
+    }
+
+    if (!matched) {
+        __sync_fetch_and_add(&stats.rejections, 1);
+    }
+    return matched;
+}
+
+
+// ### FilterChain ######################################
+
+FilterChain::FilterChain()
+    : order(0), match_calls(0), reorder_mutex(), filters(), regex_filters(),
+      description_regex(NULL), content_regex(NULL)
+{
+    pthread_mutex_init(&reorder_mutex, NULL);
+}
+
+
 void
 FilterChain::addFilter(Filter * filter)
 {
+    MergedRegexFilter ** merged = NULL;
+    bool content = false;
+    if (dynamic_cast<DescriptionRegexFilter *>(filter)) {
+        merged = &description_regex;
+    }
+    else if (dynamic_cast<ContentRegexFilter *>(filter)) {
+        merged = &content_regex;
+        content = true;
+    }
+
+    if (merged) {
+        if (!*merged) {
+            *merged = new MergedRegexFilter(content);
+            filters.push_back(*merged);
+        }
+
+        std::string errmsg;
+        if ((*merged)->setParams(static_cast<RegexFilter *>(filter)->getPattern().c_str(), errmsg)) {
+            regex_filters.push_back(filter);
+            reorder();
+            return;
+        }
+    }
     filters.push_back(filter);
+    reorder();
+}
+
+
+/**
+ * sort the filters by their cost per rejected chunk, so cheap filters
+ * rejecting many chunks come first
+ */
+void
+FilterChain::reorder()
+{
+    // some other thread is already at it
+    if (pthread_mutex_trylock(&reorder_mutex) != 0) {
+        return;
+    }
+
+    size_t ordered = std::min(filters.size(), static_cast<size_t>(FILTER_MAX_ORDERED));
+    std::vector<double> scores(ordered);
+    std::vector<size_t> indices;
+
+    for (size_t i = 0; i < ordered; i++) {
+        // the counters may change meanwhile, an estimate is good enough
+        const FilterStats & stats = filters[i]->getStats();
+        double cost = static_cast<double>(filters[i]->estimatedCost());
+        double rejected = 0.5;
+        if ((stats.calls >= FILTER_MIN_SAMPLES) && (stats.timed_calls > 0)) {
+            cost = static_cast<double>(stats.nanoseconds) / stats.timed_calls;
+            rejected = static_cast<double>(stats.rejections) / stats.calls;
+        }
+        scores[i] = cost / std::max(rejected, 0.001);
+
+        // insertion sort keeps the order of filters with the same score
+        std::vector<size_t>::iterator pos = indices.end();
+        while ((pos != indices.begin()) && (scores[*(pos - 1)] > scores[i])) {
+            --pos;
+        }
+        indices.insert(pos, i);
+    }
+
+    uint64_t new_order = 0;
+    for (size_t i = 0; i < ordered; i++) {
+        new_order |= static_cast<uint64_t>(indices[i]) << (4 * i);
+    }
+    if (new_order != order) {
+        log_debug("new filter order: %" PRIx64, new_order);
+        order = new_order;
+    }
+    pthread_mutex_unlock(&reorder_mutex);
 }
 
 
 bool
 FilterChain::match(const Chunk &chunk)
 {
-    for (std::vector<Filter*>::const_iterator filterit = filters.begin(); filterit != filters.end(); ++filterit) {
-        if (!(*filterit)->match(chunk)) {
+    return matchStage(chunk, ALL_FILTERS);
+}
+
+
+bool
+FilterChain::matchHeader(const Chunk &chunk)
+{
+    return matchStage(chunk, HEADER_FILTERS);
+}
+
+
+bool
+FilterChain::matchBody(const Chunk &chunk)
+{
+    return matchStage(chunk, BODY_FILTERS);
+}
+
+
+bool
+FilterChain::matchStage(const Chunk &chunk, Stage stage)
+{
+    if ((stage != HEADER_FILTERS)
+                && ((__sync_add_and_fetch(&match_calls, 1) % FILTER_REORDER_INTERVAL) == 0)) {
+        reorder();
+    }
+
+    // read the order once, other threads may change it
+    uint64_t current_order = order;
+    for (size_t i = 0; i < filters.size(); i++) {
+        Filter * filter = filters[i];
+        if (i < FILTER_MAX_ORDERED) {
+            filter = filters[(current_order >> (4 * i)) & 0xf];
+        }
+
+        if (((stage == HEADER_FILTERS) && !filter->matchesHeader())
+                    || ((stage == BODY_FILTERS) && filter->matchesHeader())) {
+            continue;
+        }
+        if (!filter->matchCounted(chunk)) {
             return false;
         }
     }
@@ -26,14 +172,90 @@ FilterChain::match(const Chunk &chunk)
 }
 
 
+bool
+FilterChain::needsSql() const
+{
+    for (std::vector<Filter*>::const_iterator filterit = filters.begin(); filterit != filters.end(); ++filterit) {
+        if ((*filterit)->needsSql()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+linenumber_t
+FilterChain::firstLine() const
+{
+    // a chunk has to match all filters
+    linenumber_t first = LINE_NUMBER_NOT_AVAILABLE;
+    for (std::vector<Filter*>::const_iterator filterit = filters.begin(); filterit != filters.end(); ++filterit) {
+        first = std::max(first, (*filterit)->firstLine());
+    }
+    return first;
+}
+
+
+linenumber_t
+FilterChain::lastLine() const
+{
+    linenumber_t last = LINE_NUMBER_NOT_AVAILABLE;
+    for (std::vector<Filter*>::const_iterator filterit = filters.begin(); filterit != filters.end(); ++filterit) {
+        linenumber_t filter_last = (*filterit)->lastLine();
+        if ((filter_last != LINE_NUMBER_NOT_AVAILABLE)
+                    && ((last == LINE_NUMBER_NOT_AVAILABLE) || (filter_last < last))) {
+            last = filter_last;
+        }
+    }
+    return last;
+}
+
+
+linenumber_t
+FilterChain::nextLine(linenumber_t first_line) const
+{
+    // a chunk has to reach the lines of all filters
+    linenumber_t next = LINE_NUMBER_NOT_AVAILABLE;
+    for (std::vector<Filter*>::const_iterator filterit = filters.begin(); filterit != filters.end(); ++filterit) {
+        next = std::max(next, (*filterit)->nextLine(first_line));
+    }
+    return next;
+}
+
+
+void
+FilterChain::printStats(FILE * out) const
+{
+    fprintf(out, "Filter statistics (in the order of evaluation):\n");
+
+    uint64_t current_order = order;
+    for (size_t i = 0; i < filters.size(); i++) {
+        const Filter * filter = filters[i];
+        if (i < FILTER_MAX_ORDERED) {
+            filter = filters[(current_order >> (4 * i)) & 0xf];
+        }
+        const FilterStats & stats = filter->getStats();
+        fprintf(out, "  %-40s %12" PRIu64 " calls %12" PRIu64 " rejected %12.3f ms\n",
+                    filter->describe().c_str(), stats.calls, stats.rejections,
+                    stats.totalNanoseconds() / 1e6);
+    }
+}
+
+
 FilterChain::~FilterChain()
 {
     for (std::vector<Filter*>::iterator filterit = filters.begin(); filterit != filters.end(); ++filterit) {
         delete (*filterit);
     }
+    for (std::vector<Filter*>::iterator filterit = regex_filters.begin(); filterit != regex_filters.end(); ++filterit) {
+        delete (*filterit);
+    }
+    pthread_mutex_destroy(&reorder_mutex);
 }
 
 
+// ### LineFilter #######################################
+
 bool 
 LineFilter::setParams(const char * params, std::string &errmsg)
 {
@@ -65,27 +287,55 @@ LineFilter::setParams(const char * params, std::string &errmsg)
         errmsg = "No linenumbers given.";
     }
 
+    std::sort(linenumbers.begin(), linenumbers.end());
+    linenumbers.erase(std::unique(linenumbers.begin(), linenumbers.end()), linenumbers.end());
+
     return !linenumbers.empty();
 }
 
 
-bool
-LineFilter::match(const Chunk& chunk)
+std::string
+LineFilter::describe() const
 {
-    for(std::vector<linenumber_t>::const_iterator number = linenumbers.begin(); number != linenumbers.end(); ++number) {
-        if ((chunk.start_line <= *number) && (chunk.end_line >= *number)) {
-            return true;
+    std::stringstream desc;
+    desc << "-L ";
+    for (std::vector<linenumber_t>::const_iterator number = linenumbers.begin(); number != linenumbers.end(); ++number) {
+        if (number != linenumbers.begin()) {
+            desc << ",";
         }
+        desc << *number;
     }
-    return false;
+    return desc.str();
 }
 
 
 bool
-RegexFilter::matchString(std::string &str) 
+LineFilter::match(const Chunk& chunk)
+{
+    // the first line which is not before the chunk
+    std::vector<linenumber_t>::const_iterator number = std::lower_bound(linenumbers.begin(),
+                linenumbers.end(), chunk.start_line);
+    return (number != linenumbers.end()) && (*number <= chunk.end_line);
+}
+
+
+linenumber_t
+LineFilter::nextLine(linenumber_t first_line) const
+{
+    // chunks starting after the last line are rejected by lastLine
+    std::vector<linenumber_t>::const_iterator number = std::lower_bound(linenumbers.begin(),
+                linenumbers.end(), first_line);
+    return (number != linenumbers.end()) ? *number : LINE_NUMBER_NOT_AVAILABLE;
+}
+
+
+// ### RegexFilter ######################################
+
+bool
+RegexFilter::matchString(const std::string &str)
 {
     if (re) {
-        return (regexec(re, str.c_str(), 0, NULL, 0) == 0);
+        return re->matchAll(str);
     }
     
     return false;
@@ -94,39 +344,21 @@ RegexFilter::matchString(std::string &str)
 bool 
 RegexFilter::setParams(const char * params, std::string &errmsg)
 {
-    if (!re) {
-        re = new regex_t;
-    }
-    else {
-        regfree(re);
-    }
-    int errcode = regcomp(re, params, REG_EXTENDED | REG_ICASE);
-    if (errcode != 0) {
-        size_t len = regerror(errcode, re, NULL, 0);
-        char * buff = new char[len];
-        if(buff) {
-            regerror(errcode, re, buff, len);
-            errmsg = buff;
-            delete[] buff;
-        }
-        else {
-            errmsg = "Invalid regex";
-        }
-        regfree(re);
+    delete re;
+    re = new MultiRegex();
+    if (!re->addPattern(params, errmsg)) {
         delete re;
         re = NULL;
-
+        pattern.clear();
         return false;
     }
+    pattern = params;
     return true;
 }
 
 RegexFilter::~RegexFilter()
 {
-    if (re) {
-        regfree(re);
-        delete re;
-    }
+    delete re;
 }
 
 bool
@@ -140,6 +372,46 @@ DescriptionRegexFilter::match(const Chunk& chunk)
 bool
 ContentRegexFilter::match(const Chunk& chunk)
 {
-    std::string sql = chunk.getSql();
-    return matchString(sql);
+    return matchString(chunk.getSql());
+}
+
+
+// ### MergedRegexFilter ################################
+
+bool
+MergedRegexFilter::setParams(const char * params, std::string &errmsg)
+{
+    if (!regex.addPattern(params, errmsg)) {
+        return false;
+    }
+    if (!description.empty()) {
+        description += " ";
+    }
+    description += content ? "-S " : "-I ";
+    description += params;
+    return true;
+}
+
+
+bool
+MergedRegexFilter::match(const Chunk& chunk)
+{
+    if (content) {
+        // matching the lines saves building the sql of rejected chunks
+        if (!chunk.hasBuiltSql() && regex.matchesLines()) {
+            const linevector_t & lines = chunk.getSqlLines();
+            return regex.matchAllLines(lines.begin(), lines.end());
+        }
+        return regex.matchAll(chunk.getSql());
+    }
+    return regex.matchAll(chunk.getDescription());
 }
+
+
+uint64_t
+MergedRegexFilter::estimatedCost() const
+{
+    // building the sql of a chunk costs more than matching
+    return content ? 2000 : 200;
+}
+
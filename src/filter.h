@@ -3,22 +3,64 @@
 
 #include <vector>
 #include <string>
+#include <cstdio>
 
-#include <regex.h>
+#include <pthread.h>
 
 #include "chunk.h"
+#include "multiregex.h"
+
+// only every n-th call of a filter gets timed, the clock is about as
+// expensive as a line filter
+#define FILTER_TIMING_INTERVAL      8
+
+// the filter chain reorders its filters every n chunks
+#define FILTER_REORDER_INTERVAL     256
+
+// number of calls after which the measured cost and selectivity of a filter
+// replace the estimates
+#define FILTER_MIN_SAMPLES          64
+
+// the order of at most this many filters is adapted, further filters
+// are evaluated after them in the order they were added
+#define FILTER_MAX_ORDERED          16
 
 namespace PsqlChunks
 {
 
+    /**
+     * runtime counters of a filter
+     */
+    struct FilterStats
+    {
+        uint64_t calls;
+        uint64_t rejections;
+
+        /** time spent in the timed calls */
+        uint64_t nanoseconds;
+        uint64_t timed_calls;
+
+        FilterStats() : calls(0), rejections(0), nanoseconds(0), timed_calls(0) {};
+
+        /** estimated time spent in all calls */
+        uint64_t totalNanoseconds() const
+        {
+            return timed_calls > 0 ? (nanoseconds / timed_calls) * calls : 0;
+        }
+    };
+
+
     class Filter
     {
         private:
             Filter(const Filter&);
             Filter& operator=(const Filter&);
 
+        protected:
+            FilterStats stats;
+
         public:
-            Filter() {};
+            Filter() : stats() {};
             virtual ~Filter() {};
 
             /**
@@ -27,7 +69,101 @@ namespace PsqlChunks
              */
             virtual bool setParams(const char * params, std::string &errmsg) = 0;
             virtual bool match(const Chunk& chunk) = 0;
-            
+
+            /** the filter as given on the command line */
+            virtual std::string describe() const = 0;
+
+            /** true when the filter needs to access the sql of the chunk */
+            virtual bool needsSql() const
+            {
+                return false;
+            }
+
+            /**
+             * true when the filter only uses the start comment of a chunk. the start
+             * comment is complete once the first line of sql has been scanned, so
+             * the scanner can reject the chunk before reading the rest of it.
+             */
+            virtual bool matchesHeader() const
+            {
+                return false;
+            }
+
+            /** estimated time of a call in nanoseconds, until it has been measured */
+            virtual uint64_t estimatedCost() const = 0;
+
+            /**
+             * chunks ending before the first line or starting after the last
+             * line can not match. LINE_NUMBER_NOT_AVAILABLE if the filter does not
+             * limit the lines
+             */
+            virtual linenumber_t firstLine() const
+            {
+                return LINE_NUMBER_NOT_AVAILABLE;
+            }
+
+            virtual linenumber_t lastLine() const
+            {
+                return LINE_NUMBER_NOT_AVAILABLE;
+            }
+
+            /**
+             * the first line at or after the given first line of a chunk the
+             * chunk has to span to match. LINE_NUMBER_NOT_AVAILABLE if the
+             * filter does not require any line
+             */
+            virtual linenumber_t nextLine(linenumber_t) const
+            {
+                return LINE_NUMBER_NOT_AVAILABLE;
+            }
+
+            /** match and update the counters. may be called from multiple threads */
+            bool matchCounted(const Chunk& chunk);
+
+            const FilterStats & getStats() const
+            {
+                return stats;
+            }
+    };
+
+
+    /**
+     * matches the patterns of multiple regex filters of the same kind
+     * in a single pass. see MultiRegex
+     */
+    class MergedRegexFilter : public Filter
+    {
+        private:
+            MultiRegex regex;
+            bool content;
+            std::string description;
+
+        public:
+            /** with content set the sql is matched, otherwise the description */
+            MergedRegexFilter(bool _content)
+                : Filter(), regex(), content(_content), description() {};
+            ~MergedRegexFilter() {};
+
+            /** add a pattern of a filter. params is the pattern */
+            bool setParams(const char * params, std::string &errmsg);
+            bool match(const Chunk& chunk);
+
+            std::string describe() const
+            {
+                return description;
+            }
+
+            bool needsSql() const
+            {
+                return content;
+            }
+
+            bool matchesHeader() const
+            {
+                return !content;
+            }
+
+            uint64_t estimatedCost() const;
     };
 
 
@@ -36,6 +172,13 @@ namespace PsqlChunks
      *
      * this class takes ownership of the added filters and will destroy them
      * on destruction
+     *
+     * the patterns of all regex filters of a kind are matched together in
+     * a single pass over the description or the sql of the chunk.
+     *
+     * the filters are evaluated in the order of their cost per rejected
+     * chunk, which is taken from the counters of the filters once they
+     * have been called often enough.
      */
     class FilterChain
     {
@@ -43,17 +186,56 @@ namespace PsqlChunks
             FilterChain(const FilterChain&);
             FilterChain& operator=(const FilterChain&);
 
+            /** the order of the first FILTER_MAX_ORDERED filters, 4 bits per filter */
+            volatile uint64_t order;
+            uint64_t match_calls;
+            pthread_mutex_t reorder_mutex;
+
+            enum Stage {
+                ALL_FILTERS,
+                HEADER_FILTERS,
+                BODY_FILTERS
+            };
+
+            void reorder();
+            bool matchStage(const Chunk& chunk, Stage stage);
+
         protected:
             std::vector<Filter*> filters;
 
+            /** regex filters merged into description_regex and content_regex */
+            std::vector<Filter*> regex_filters;
+            MergedRegexFilter * description_regex;
+            MergedRegexFilter * content_regex;
+
         public:
-            FilterChain() : filters() {};
+            FilterChain();
             ~FilterChain();
 
             void addFilter(Filter * filter);
 
             /** returns true when the chunk matches all filters */
             bool match(const Chunk& chunk);
+
+            /**
+             * only match the filters which use the start comment of the chunk,
+             * see Filter::matchesHeader. matchBody matches all other filters.
+             */
+            bool matchHeader(const Chunk& chunk);
+            bool matchBody(const Chunk& chunk);
+
+            /** true when any of the filters needs to access the sql of the chunks */
+            bool needsSql() const;
+
+            /** the lines matching chunks may span. see Filter::firstLine */
+            linenumber_t firstLine() const;
+            linenumber_t lastLine() const;
+
+            /** the line a chunk starting at the given line has to reach. see Filter::nextLine */
+            linenumber_t nextLine(linenumber_t first_line) const;
+
+            /** print the counters of the filters in the order they are evaluated */
+            void printStats(FILE * out) const;
     };
 
 
@@ -63,6 +245,7 @@ namespace PsqlChunks
     class LineFilter : public Filter
     {
         protected:
+            /** sorted, without duplicates */
             std::vector<linenumber_t> linenumbers;
 
         public:
@@ -75,51 +258,103 @@ namespace PsqlChunks
              */
             bool setParams(const char * params, std::string &errmsg);
             bool match(const Chunk& chunk);
+            std::string describe() const;
 
+            uint64_t estimatedCost() const
+            {
+                return 10;
+            }
 
+            linenumber_t firstLine() const
+            {
+                return linenumbers.front();
+            }
+
+            linenumber_t lastLine() const
+            {
+                return linenumbers.back();
+            }
+
+            linenumber_t nextLine(linenumber_t first_line) const;
     };
 
-    
+
     /**
      * baseclass for all regex based filters
      */
     class RegexFilter : public Filter
     {
         private:
-            regex_t * re;
+            MultiRegex * re;
+            std::string pattern;
 
             RegexFilter(const RegexFilter&);
             RegexFilter& operator=(const RegexFilter&);
 
         protected:
-            bool matchString(std::string &str);
+            bool matchString(const std::string &str);
 
         public:
 
-            RegexFilter() : Filter(), re(NULL) {}; 
+            RegexFilter() : Filter(), re(NULL), pattern() {};
             ~RegexFilter();
 
             bool setParams(const char * params, std::string &errmsg);
+
+            const std::string & getPattern() const
+            {
+                return pattern;
+            }
     };
 
 
-    /** 
+    /**
      * matches a regex against the start and end-comments of a chunk
      */
     class DescriptionRegexFilter : public RegexFilter
     {
         public:
             bool match(const Chunk& chunk);
+
+            bool matchesHeader() const
+            {
+                return true;
+            }
+
+            std::string describe() const
+            {
+                return "-I " + getPattern();
+            }
+
+            uint64_t estimatedCost() const
+            {
+                return 200;
+            }
     };
 
 
-    /** 
+    /**
      * matches a regex against the sql content of a chunk
      */
     class ContentRegexFilter : public RegexFilter
     {
         public:
             bool match(const Chunk& chunk);
+
+            std::string describe() const
+            {
+                return "-S " + getPattern();
+            }
+
+            bool needsSql() const
+            {
+                return true;
+            }
+
+            uint64_t estimatedCost() const
+            {
+                return 2000;
+            }
     };
 
 
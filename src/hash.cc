@@ -0,0 +1,128 @@
+#include <cstring>
+#include <cstdio>
+
+#include "hash.h"
+
+using namespace PsqlChunks;
+
+// constants of the XXH64 algorithm
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+
+uint64_t inline static
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+
+uint64_t inline static
+read64(const unsigned char * p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+uint32_t inline static
+read32(const unsigned char * p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+
+uint64_t inline static
+round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    acc *= PRIME64_1;
+    return acc;
+}
+
+
+uint64_t inline static
+merge_round64(uint64_t acc, uint64_t val)
+{
+    val = round64(0, val);
+    acc ^= val;
+    acc = acc * PRIME64_1 + PRIME64_4;
+    return acc;
+}
+
+
+hash_t
+PsqlChunks::hash_bytes(const void * data, size_t length, hash_t seed)
+{
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+    const unsigned char * end = p + length;
+    uint64_t h64;
+
+    if (length >= 32) {
+        const unsigned char * limit = end - 32;
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+
+        do {
+            v1 = round64(v1, read64(p)); p += 8;
+            v2 = round64(v2, read64(p)); p += 8;
+            v3 = round64(v3, read64(p)); p += 8;
+            v4 = round64(v4, read64(p)); p += 8;
+        } while (p <= limit);
+
+        h64 = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h64 = merge_round64(h64, v1);
+        h64 = merge_round64(h64, v2);
+        h64 = merge_round64(h64, v3);
+        h64 = merge_round64(h64, v4);
+    }
+    else {
+        h64 = seed + PRIME64_5;
+    }
+
+    h64 += static_cast<uint64_t>(length);
+
+    while ((p + 8) <= end) {
+        h64 ^= round64(0, read64(p));
+        h64 = rotl64(h64, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if ((p + 4) <= end) {
+        h64 ^= static_cast<uint64_t>(read32(p)) * PRIME64_1;
+        h64 = rotl64(h64, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h64 ^= (*p) * PRIME64_5;
+        h64 = rotl64(h64, 11) * PRIME64_1;
+        p++;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= PRIME64_3;
+    h64 ^= h64 >> 32;
+
+    return h64;
+}
+
+
+std::string
+PsqlChunks::hash_to_hex(hash_t hash)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(hash));
+    return std::string(buf);
+}
@@ -0,0 +1,30 @@
+#ifndef __hash_h__
+#define __hash_h__
+
+#include <cstddef>
+#include <string>
+
+#include <stdint.h>
+
+namespace PsqlChunks
+{
+
+    typedef uint64_t hash_t;
+
+    /**
+     * 64bit non-cryptographic hash of a block of memory (XXH64).
+     * fast enough to hash complete input files.
+     */
+    hash_t hash_bytes(const void * data, size_t length, hash_t seed = 0);
+
+    inline hash_t hash_string(const std::string & str, hash_t seed = 0)
+    {
+        return hash_bytes(str.data(), str.size(), seed);
+    }
+
+    /** hexadecimal representation of a hash. always 16 characters long */
+    std::string hash_to_hex(hash_t hash);
+
+};
+
+#endif /* __hash_h__ */
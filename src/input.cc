@@ -0,0 +1,320 @@
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "input.h"
+#include "compressedinput.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+static const char * s_empty = "";
+
+
+// ### Input ############################################
+
+Input::Input()
+    : searched(0), finished(false), buf(s_empty), buf_pos(s_empty),
+      buf_end(s_empty), buf_offset(0)
+{
+}
+
+
+bool
+Input::nextLine(LineRef &line)
+{
+    if (finished) {
+        return false;
+    }
+
+    while (true) {
+        const char * nl = static_cast<const char *>(
+                memchr(buf_pos + searched, '\n', (buf_end - buf_pos) - searched));
+        if (nl) {
+            line.data = buf_pos;
+            line.length = nl - buf_pos;
+            line.offset = buf_offset + (buf_pos - buf);
+            buf_pos = nl + 1;
+            searched = 0;
+            return true;
+        }
+        searched = buf_end - buf_pos;
+
+        if (!fill()) {
+            // the remaining data is the last line - like std::getline
+            // this may be an empty line
+            line.data = buf_pos;
+            line.length = buf_end - buf_pos;
+            line.offset = buf_offset + (buf_pos - buf);
+            buf_pos = buf_end;
+            searched = 0;
+            finished = true;
+            return true;
+        }
+    }
+}
+
+
+bool
+Input::seek(byteoffset_t offset)
+{
+    // the data of stable inputs is never moved or discarded
+    if (!isStable() || (offset < buf_offset)
+                || (offset > (buf_offset + (buf_end - buf)))) {
+        return false;
+    }
+    buf_pos = buf + (offset - buf_offset);
+    searched = 0;
+    finished = false;
+    return true;
+}
+
+
+Input *
+Input::open(const char * filename)
+{
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        char magic[COMPRESSION_MAGIC_LEN];
+        ssize_t nmagic = pread(fd, magic, sizeof(magic), 0);
+        Compression compression = detect_compression(magic, nmagic > 0 ? nmagic : 0);
+        if (compression != COMPRESSION_NONE) {
+            if (!compression_supported(compression)) {
+                log_error("%s: zstd compressed input is not supported by this build", filename);
+                close(fd);
+                errno = ENOTSUP;
+                return NULL;
+            }
+            return new CompressedInput(fd, true, compression, "");
+        }
+
+        MappedInput * minput = new MappedInput();
+        if (minput->map_fd(fd)) {
+            // the mapping stays valid after closing the descriptor
+            close(fd);
+            return minput;
+        }
+        log_debug("could not mmap %s - falling back to reading blocks", filename);
+        delete minput;
+        return new FdInput(fd, true);
+    }
+
+    Input * input = openFd(fd, true);
+    if (!input) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    return input;
+}
+
+
+Input *
+Input::openFd(int fd, bool close_fd)
+{
+    // the magic bytes can not be peeked at, so they get handed
+    // to the input
+    char magic[COMPRESSION_MAGIC_LEN];
+    size_t nmagic = 0;
+    while (nmagic < sizeof(magic)) {
+        ssize_t nread = read(fd, magic + nmagic, sizeof(magic) - nmagic);
+        if (nread == 0) {
+            break;
+        }
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+        nmagic += static_cast<size_t>(nread);
+    }
+    std::string pending(magic, nmagic);
+
+    Compression compression = detect_compression(magic, nmagic);
+    if (compression != COMPRESSION_NONE) {
+        if (!compression_supported(compression)) {
+            log_error("zstd compressed input is not supported by this build");
+            errno = ENOTSUP;
+            return NULL;
+        }
+        return new CompressedInput(fd, close_fd, compression, pending);
+    }
+    return new FdInput(fd, close_fd, pending);
+}
+
+
+// ### MappedInput ######################################
+
+MappedInput::MappedInput()
+    : Input(), map(NULL), map_size(0)
+{
+}
+
+
+bool
+MappedInput::map_fd(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+
+    if (st.st_size == 0) {
+        // empty files can not be mapped, but there is nothing to read anyways
+        return true;
+    }
+
+    map_size = static_cast<size_t>(st.st_size);
+    map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        map_size = 0;
+        return false;
+    }
+    posix_madvise(map, map_size, POSIX_MADV_SEQUENTIAL);
+
+    buf = static_cast<const char *>(map);
+    buf_pos = buf;
+    buf_end = buf + map_size;
+    return true;
+}
+
+
+MappedInput::~MappedInput()
+{
+    if (map) {
+        munmap(map, map_size);
+    }
+}
+
+
+// ### MemoryInput ######################################
+
+MemoryInput::MemoryInput(const char * data, size_t size, byteoffset_t offset)
+    : Input()
+{
+    buf = data;
+    buf_pos = data;
+    buf_end = data + size;
+    buf_offset = offset;
+}
+
+
+// ### BufferedInput ####################################
+
+BufferedInput::BufferedInput()
+    : Input(), block(NULL), block_size(0), at_end(false)
+{
+}
+
+
+BufferedInput::~BufferedInput()
+{
+    free(block);
+}
+
+
+bool
+BufferedInput::fill()
+{
+    if (at_end) {
+        return false;
+    }
+
+    // move the remaining data to the start of the block
+    size_t remaining = buf_end - buf_pos;
+    buf_offset += buf_pos - buf;
+    if ((remaining > 0) && (buf_pos != block)) {
+        memmove(block, buf_pos, remaining);
+    }
+
+    // grow the block if a single line does not fit into it
+    if ((block_size - remaining) < (INPUT_BLOCK_SIZE / 2)) {
+        size_t new_size = block_size == 0 ? INPUT_BLOCK_SIZE : block_size * 2;
+        char * new_block = static_cast<char *>(realloc(block, new_size));
+        if (!new_block) {
+            log_error("could not allocate input buffer of %lu bytes",
+                    static_cast<unsigned long>(new_size));
+            abort();
+        }
+        block = new_block;
+        block_size = new_size;
+    }
+
+    buf = block;
+    buf_pos = block;
+    buf_end = block + remaining;
+
+    size_t nread = readBlock(block + remaining, block_size - remaining);
+    if (nread == 0) {
+        at_end = true;
+        return false;
+    }
+    buf_end += nread;
+    return true;
+}
+
+
+// ### FdInput ##########################################
+
+size_t
+FdInput::readBlock(char * target, size_t len)
+{
+    if (!pending.empty()) {
+        size_t n = std::min(len, pending.size());
+        memcpy(target, pending.data(), n);
+        pending.erase(0, n);
+        return n;
+    }
+
+    while (true) {
+        ssize_t nread = read(fd, target, len);
+        if (nread >= 0) {
+            return static_cast<size_t>(nread);
+        }
+        if (errno != EINTR) {
+            log_error("could not read input");
+            return 0;
+        }
+    }
+}
+
+
+FdInput::~FdInput()
+{
+    if (close_fd) {
+        close(fd);
+    }
+}
+
+
+// ### StreamInput ######################################
+
+size_t
+StreamInput::readBlock(char * target, size_t len)
+{
+    if (!strm.good()) {
+        return 0;
+    }
+    strm.read(target, len);
+    return static_cast<size_t>(strm.gcount());
+}
@@ -0,0 +1,256 @@
+#ifndef __input_h__
+#define __input_h__
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+#include "chunk.h"
+
+// size of the blocks read from non-mappable inputs like pipes
+#define INPUT_BLOCK_SIZE    (1024*1024)
+
+namespace PsqlChunks
+{
+
+    /**
+     * a single line of the input. the line does not include the
+     * linebreak and points directly into the buffer of the input
+     */
+    struct LineRef
+    {
+        const char * data;
+        size_t length;
+
+        /** byte offset of the line from the start of the input */
+        byteoffset_t offset;
+    };
+
+
+    /**
+     * baseclass for all sources of sql input.
+     *
+     * the input is split into lines the same way std::getline would do it:
+     * the data after the last linebreak is always returned as a last line,
+     * even if it is empty.
+     */
+    class Input
+    {
+        private:
+            Input(const Input&);
+            Input& operator=(const Input&);
+
+            /** number of bytes after buf_pos known to contain no linebreak */
+            size_t searched;
+
+            /** the last line has already been returned */
+            bool finished;
+
+        protected:
+            /** start of the buffer */
+            const char * buf;
+
+            /** start of the data not yet returned */
+            const char * buf_pos;
+
+            /** end of the valid data in the buffer */
+            const char * buf_end;
+
+            /** byte offset of buf from the start of the input */
+            byteoffset_t buf_offset;
+
+            /**
+             * make more data available after buf_end. implementations
+             * may move the data starting at buf_pos to a different location
+             * but have to update buf, buf_pos, buf_end and buf_offset accordingly.
+             *
+             * returns false when the end of the input is reached
+             */
+            virtual bool fill() = 0;
+
+        public:
+            Input();
+            virtual ~Input() {};
+
+            /**
+             * fetch the next line.
+             * returns false when there are no more lines
+             *
+             * the data of the line stays valid until the next call of
+             * nextLine, or - in case isStable() returns true - for the
+             * lifetime of the input.
+             */
+            bool nextLine(LineRef &line);
+
+            /** true when the data of returned lines stays valid for the lifetime of the input */
+            virtual bool isStable() const
+            {
+                return false;
+            }
+
+            bool eof() const
+            {
+                return finished;
+            }
+
+            /** byte offset of the next line */
+            byteoffset_t position() const
+            {
+                return buf_offset + (buf_pos - buf);
+            }
+
+            /**
+             * continue reading at the start of a line which has been returned
+             * before. only stable inputs support this, returns false otherwise.
+             */
+            bool seek(byteoffset_t offset);
+
+            /**
+             * open the file with the given name. regular files will get mapped into
+             * memory, everything else will be read in blocks. gzip and zstd
+             * compressed files get decompressed.
+             *
+             * returns NULL on failure and sets errno.
+             */
+            static Input * open(const char * filename);
+
+            /**
+             * read from a file descriptor which can not be mapped, like stdin.
+             * gzip and zstd compressed data gets decompressed.
+             *
+             * returns NULL on failure and sets errno.
+             */
+            static Input * openFd(int fd, bool close_fd);
+    };
+
+
+    /**
+     * a regular file which is mapped into memory
+     */
+    class MappedInput : public Input
+    {
+        private:
+            void * map;
+            size_t map_size;
+
+        protected:
+            bool fill()
+            {
+                return false;
+            }
+
+        public:
+            MappedInput();
+            ~MappedInput();
+
+            /** returns false on failure and sets errno */
+            bool map_fd(int fd);
+
+            bool isStable() const
+            {
+                return true;
+            }
+
+            /** start of the mapped file */
+            const char * data() const
+            {
+                return buf;
+            }
+
+            size_t size() const
+            {
+                return map_size;
+            }
+    };
+
+
+    /**
+     * a part of a buffer owned by someone else, for example a range of
+     * a MappedInput. the buffer has to stay valid for the lifetime of
+     * the input.
+     */
+    class MemoryInput : public Input
+    {
+        protected:
+            bool fill()
+            {
+                return false;
+            }
+
+        public:
+            /** offset is the byte offset of data from the start of the file */
+            MemoryInput(const char * data, size_t size, byteoffset_t offset);
+
+            bool isStable() const
+            {
+                return true;
+            }
+    };
+
+
+    /**
+     * baseclass for inputs which have to be read block by block
+     */
+    class BufferedInput : public Input
+    {
+        private:
+            char * block;
+            size_t block_size;
+            bool at_end;
+
+        protected:
+            bool fill();
+
+            /**
+             * read up to len bytes into target.
+             * returns the number of bytes read, 0 at the end of the input
+             */
+            virtual size_t readBlock(char * target, size_t len) = 0;
+
+        public:
+            BufferedInput();
+            ~BufferedInput();
+    };
+
+
+    /**
+     * reads from a file descriptor. used for pipes and stdin
+     */
+    class FdInput : public BufferedInput
+    {
+        private:
+            int fd;
+            bool close_fd;
+
+            /** data already read from fd, returned before reading further */
+            std::string pending;
+
+        protected:
+            size_t readBlock(char * target, size_t len);
+
+        public:
+            FdInput(int _fd, bool _close_fd = false, const std::string & _pending = "")
+                : BufferedInput(), fd(_fd), close_fd(_close_fd), pending(_pending) {};
+            ~FdInput();
+    };
+
+
+    /**
+     * reads from a std::istream
+     */
+    class StreamInput : public BufferedInput
+    {
+        private:
+            std::istream & strm;
+
+        protected:
+            size_t readBlock(char * target, size_t len);
+
+        public:
+            StreamInput(std::istream & _strm)
+                : BufferedInput(), strm(_strm) {};
+    };
+
+};
+
+#endif /* __input_h__ */
@@ -0,0 +1,137 @@
+#include <cstring>
+
+#include "inputsplit.h"
+#include "scanner.h"
+#include "workerpool.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+
+/* prototypes */
+byteoffset_t static find_split_point(const MappedInput & input, byteoffset_t from);
+
+
+/**
+ * counts the linebreaks of a range
+ */
+class LineCountTask : public Task
+{
+    public:
+        const char * data;
+        size_t size;
+        linenumber_t count;
+
+        LineCountTask(const char * _data, size_t _size)
+            : Task(), data(_data), size(_size), count(0)
+        {
+        };
+
+        void run(unsigned int worker_id)
+        {
+            UNUSED_PARAMETER(worker_id);
+
+            const char * pos = data;
+            const char * end = data + size;
+            while ((pos = static_cast<const char *>(memchr(pos, '\n', end - pos))) != NULL) {
+                count++;
+                pos++;
+            }
+        }
+};
+
+
+/**
+ * find the first split point in a line starting at or after from.
+ * returns the offset of the line or 0 if there is none.
+ */
+byteoffset_t static
+find_split_point(const MappedInput & input, byteoffset_t from)
+{
+    // start at the beginning of the next line. from is never 0, so the
+    // byte order mark does not need to be handled here
+    const char * nl = static_cast<const char *>(
+            memchr(input.data() + from - 1, '\n', input.size() - (from - 1)));
+    if (!nl) {
+        return 0;
+    }
+    byteoffset_t start = (nl + 1) - input.data();
+    MemoryInput lines(nl + 1, input.size() - start, start);
+
+    LineRef window[4];
+    unsigned int filled = 0;
+    LineRef line;
+    while (lines.nextLine(line)) {
+        if (filled < 4) {
+            window[filled++] = line;
+        }
+        else {
+            memmove(window, window + 1, 3 * sizeof(LineRef));
+            window[3] = line;
+        }
+
+        if ((filled == 4) && ChunkScanner::isSplitPoint(window)) {
+            return window[2].offset;
+        }
+    }
+    return 0;
+}
+
+
+void
+PsqlChunks::split_input(const MappedInput & input, size_t range_size, unsigned int nthreads,
+            std::vector<InputRange> & ranges)
+{
+    ranges.clear();
+
+    InputRange range;
+    range.start = 0;
+    range.first_line = 1;
+
+    // do not create a tiny last range
+    byteoffset_t target = range_size;
+    while ((target + (range_size / 2)) < input.size()) {
+        byteoffset_t split = find_split_point(input, target);
+        if (split == 0) {
+            break;
+        }
+
+        // the linebreak before the split point belongs to no range
+        range.end = split - 1;
+        ranges.push_back(range);
+        range.start = split;
+        target = split + range_size;
+    }
+    range.end = input.size();
+    ranges.push_back(range);
+
+    if (ranges.size() == 1) {
+        return;
+    }
+    log_debug("split input into %lu ranges", static_cast<unsigned long>(ranges.size()));
+
+    // the line numbers of the ranges
+    std::vector<Task*> tasks;
+    for (std::vector<InputRange>::iterator rit = ranges.begin(); rit != ranges.end(); ++rit) {
+        tasks.push_back(new LineCountTask(input.data() + rit->start, rit->end - rit->start));
+    }
+
+    WorkerPool pool(nthreads);
+    pool.start(tasks);
+
+    size_t i = 0;
+    Task * task;
+    while ((task = pool.next()) != NULL) {
+        if ((i + 1) < ranges.size()) {
+            // the range ends without the linebreak of its last line
+            ranges[i + 1].first_line = ranges[i].first_line
+                        + static_cast<LineCountTask *>(task)->count + 1;
+        }
+        i++;
+    }
+    pool.join();
+
+    for (std::vector<Task*>::iterator tit = tasks.begin(); tit != tasks.end(); ++tit) {
+        delete *tit;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __inputsplit_h__
+#define __inputsplit_h__
+
+#include <vector>
+
+#include "chunk.h"
+#include "input.h"
+
+// approximate size of the ranges a large file gets split into. files smaller
+// than twice this size are not split at all
+#define SPLIT_RANGE_SIZE    (8*1024*1024)
+
+namespace PsqlChunks
+{
+
+    /**
+     * a part of a file which can be scanned independently
+     */
+    struct InputRange
+    {
+        /** byte range of the lines. end points to the linebreak before the next range */
+        byteoffset_t start;
+        byteoffset_t end;
+
+        /** line number of the first line of the range */
+        linenumber_t first_line;
+    };
+
+
+    /**
+     * split a mapped file into ranges of about range_size bytes. every range
+     * but the first starts at a split point of the scanner, so scanning the
+     * ranges one after the other yields the same chunks as scanning the
+     * whole file. the lines of the ranges are counted on nthreads threads.
+     *
+     * returns a single range for the complete file if it can not be split.
+     */
+    void split_input(const MappedInput & input, size_t range_size, unsigned int nthreads,
+                std::vector<InputRange> & ranges);
+
+};
+
+#endif /* __inputsplit_h__ */
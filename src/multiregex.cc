@@ -0,0 +1,1067 @@
+#include <cstring>
+#include <cctype>
+#include <map>
+#include <algorithm>
+
+#include "multiregex.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+
+namespace PsqlChunks
+{
+
+    /**
+     * a node of the syntax tree of a pattern
+     */
+    struct RegexNode
+    {
+        enum Type {
+            SET,        // a single byte out of set
+            EMPTY,      // matches the empty string
+            CONCAT,
+            ALTERNATE,
+            REPEAT,     // children[0] repeated min to max times. max -1 is unbounded
+            BOL,        // ^
+            EOL         // $
+        };
+
+        Type type;
+        std::bitset<256> set;
+        std::vector<RegexNode*> children;
+        int min;
+        int max;
+
+        RegexNode(Type _type) : type(_type), set(), children(), min(0), max(0) {};
+    };
+
+};
+
+
+/**
+ * parses a POSIX extended regular expression. everything the automaton
+ * can not handle makes the parser fail, those patterns are left to regexec.
+ * the pattern has to be validated with regcomp first.
+ */
+class RegexParser
+{
+    private:
+        RegexParser(const RegexParser&);
+        RegexParser& operator=(const RegexParser&);
+
+        const char * pattern;
+        size_t len;
+        size_t pos;
+        int depth;
+
+        /** all nodes created by the parser */
+        std::vector<RegexNode*> nodes;
+
+        RegexNode * newNode(RegexNode::Type type)
+        {
+            RegexNode * node = new RegexNode(type);
+            nodes.push_back(node);
+            return node;
+        }
+
+        RegexNode * parseAlternation();
+        RegexNode * parseConcatenation();
+        RegexNode * parseAtom();
+        bool parseBracket(std::bitset<256> & set);
+        bool parseInterval(int & min, int & max);
+
+    public:
+        RegexParser(const char * _pattern)
+            : pattern(_pattern), len(strlen(_pattern)), pos(0), depth(0), nodes()
+        {
+        };
+
+        ~RegexParser()
+        {
+            for (std::vector<RegexNode*>::iterator nit = nodes.begin(); nit != nodes.end(); ++nit) {
+                delete *nit;
+            }
+        }
+
+        /** returns NULL if the pattern is not supported */
+        RegexNode * parse()
+        {
+            RegexNode * root = parseAlternation();
+            if (pos != len) {
+                return NULL;
+            }
+            return root;
+        }
+};
+
+
+/* prototypes */
+unsigned char inline static fold(unsigned char c);
+void static fold_set(std::bitset<256> & set);
+bool static add_class(std::bitset<256> & set, const std::string & name);
+bool static literal_byte(const std::bitset<256> & set, char & c);
+std::string static required_literal(const RegexNode * node);
+uint64_t static nfa_size(const RegexNode * node);
+bool static contains_folded(const char * text, size_t len, const std::string & literal);
+
+
+// ### helpers ##########################################
+
+/** ascii lowercase. REG_ICASE in the C locale only folds ascii letters */
+unsigned char inline static
+fold(unsigned char c)
+{
+    return ((c >= 'A') && (c <= 'Z')) ? (c | 0x20) : c;
+}
+
+
+/** add the other case of all letters in the set */
+void static
+fold_set(std::bitset<256> & set)
+{
+    for (int c = 'a'; c <= 'z'; c++) {
+        if (set.test(c) || set.test(c - 0x20)) {
+            set.set(c);
+            set.set(c - 0x20);
+        }
+    }
+}
+
+
+/** add a character class of the C locale like [:alpha:] */
+bool static
+add_class(std::bitset<256> & set, const std::string & name)
+{
+    int (*predicate)(int) = NULL;
+    if (name == "alpha")        predicate = isalpha;
+    else if (name == "digit")   predicate = isdigit;
+    else if (name == "alnum")   predicate = isalnum;
+    else if (name == "upper")   predicate = isupper;
+    else if (name == "lower")   predicate = islower;
+    else if (name == "space")   predicate = isspace;
+    else if (name == "blank")   predicate = isblank;
+    else if (name == "punct")   predicate = ispunct;
+    else if (name == "print")   predicate = isprint;
+    else if (name == "graph")   predicate = isgraph;
+    else if (name == "cntrl")   predicate = iscntrl;
+    else if (name == "xdigit")  predicate = isxdigit;
+    else {
+        return false;
+    }
+
+    // only ascii characters belong to a class in the C locale
+    for (int c = 0; c < 128; c++) {
+        if (predicate(c)) {
+            set.set(c);
+        }
+    }
+    return true;
+}
+
+
+/**
+ * check if a set matches exactly one character, ignoring the case.
+ * c is set to the lowercase character
+ */
+bool static
+literal_byte(const std::bitset<256> & set, char & c)
+{
+    size_t count = set.count();
+    if ((count != 1) && (count != 2)) {
+        return false;
+    }
+
+    int first = -1;
+    for (int b = 0; b < 256; b++) {
+        if (set.test(b)) {
+            first = b;
+            break;
+        }
+    }
+    if (count == 2) {
+        // the two cases of a letter
+        if ((first < 'A') || (first > 'Z') || !set.test(first | 0x20)) {
+            return false;
+        }
+    }
+    c = static_cast<char>(fold(static_cast<unsigned char>(first)));
+    return true;
+}
+
+
+/**
+ * a lowercase literal every text matching the node has to contain.
+ * returns the longest one found or an empty string
+ */
+std::string static
+required_literal(const RegexNode * node)
+{
+    char c;
+    switch (node->type) {
+        case RegexNode::SET:
+            return literal_byte(node->set, c) ? std::string(1, c) : std::string();
+        case RegexNode::REPEAT:
+            return (node->min > 0) ? required_literal(node->children[0]) : std::string();
+        case RegexNode::CONCAT:
+            {
+                std::string best;
+                std::string run;
+                for (size_t i = 0; i < node->children.size(); i++) {
+                    const RegexNode * child = node->children[i];
+                    if ((child->type == RegexNode::SET) && literal_byte(child->set, c)) {
+                        run.push_back(c);
+                        continue;
+                    }
+                    // assertions do not consume characters
+                    if ((child->type == RegexNode::EMPTY) || (child->type == RegexNode::BOL)
+                            || (child->type == RegexNode::EOL)) {
+                        continue;
+                    }
+                    if (run.size() > best.size()) {
+                        best = run;
+                    }
+                    run.clear();
+
+                    std::string inner = required_literal(child);
+                    if (inner.size() > best.size()) {
+                        best = inner;
+                    }
+                }
+                return run.size() > best.size() ? run : best;
+            }
+        default:
+            return std::string();
+    }
+}
+
+
+/** the number of NFA states compileNode creates for the node */
+uint64_t static
+nfa_size(const RegexNode * node)
+{
+    uint64_t size = 0;
+    switch (node->type) {
+        case RegexNode::SET:
+        case RegexNode::BOL:
+        case RegexNode::EOL:
+            return 1;
+        case RegexNode::EMPTY:
+            return 0;
+        case RegexNode::CONCAT:
+        case RegexNode::ALTERNATE:
+            for (size_t i = 0; i < node->children.size(); i++) {
+                size += nfa_size(node->children[i]);
+            }
+            return size + node->children.size();
+        case RegexNode::REPEAT:
+            size = nfa_size(node->children[0]) + 1;
+            if (node->max < 0) {
+                return size * (node->min + 1);
+            }
+            return size * node->max;
+    }
+    return size;
+}
+
+
+/** case insensitive search for a lowercase literal */
+bool static
+contains_folded(const char * text, size_t len, const std::string & literal)
+{
+    size_t lit_len = literal.size();
+    if (lit_len > len) {
+        return false;
+    }
+
+    const char * end = text + len;
+    const char * last = end - lit_len;
+    unsigned char lower = static_cast<unsigned char>(literal[0]);
+    unsigned char upper = ((lower >= 'a') && (lower <= 'z')) ? (lower & ~0x20) : lower;
+
+    // the next occurrences of both cases of the first character
+    const char * next_lower = NULL;
+    const char * next_upper = (lower == upper) ? end : NULL;
+    const char * pos = text;
+
+    while (pos <= last) {
+        if ((next_lower != end) && ((next_lower == NULL) || (next_lower < pos))) {
+            next_lower = static_cast<const char *>(memchr(pos, lower, end - pos));
+            if (!next_lower) {
+                next_lower = end;
+            }
+        }
+        if ((next_upper != end) && ((next_upper == NULL) || (next_upper < pos))) {
+            next_upper = static_cast<const char *>(memchr(pos, upper, end - pos));
+            if (!next_upper) {
+                next_upper = end;
+            }
+        }
+
+        const char * candidate = std::min(next_lower, next_upper);
+        if (candidate > last) {
+            return false;
+        }
+
+        size_t i = 1;
+        while ((i < lit_len) && (fold(static_cast<unsigned char>(candidate[i]))
+                    == static_cast<unsigned char>(literal[i]))) {
+            i++;
+        }
+        if (i == lit_len) {
+            return true;
+        }
+        pos = candidate + 1;
+    }
+    return false;
+}
+
+
+// ### RegexParser ######################################
+
+RegexNode *
+RegexParser::parseAlternation()
+{
+    RegexNode * branch = parseConcatenation();
+    if (!branch || (pos >= len) || (pattern[pos] != '|')) {
+        return branch;
+    }
+
+    RegexNode * alternation = newNode(RegexNode::ALTERNATE);
+    alternation->children.push_back(branch);
+    while ((pos < len) && (pattern[pos] == '|')) {
+        pos++;
+        branch = parseConcatenation();
+        if (!branch) {
+            return NULL;
+        }
+        alternation->children.push_back(branch);
+    }
+    return alternation;
+}
+
+
+RegexNode *
+RegexParser::parseConcatenation()
+{
+    RegexNode * concat = newNode(RegexNode::CONCAT);
+
+    while (pos < len) {
+        char c = pattern[pos];
+        if (c == '|') {
+            break;
+        }
+        if (c == ')') {
+            if (depth > 0) {
+                break;
+            }
+            // an unmatched parenthesis is an ordinary character for glibc
+            return NULL;
+        }
+
+        RegexNode * atom = parseAtom();
+        if (!atom) {
+            return NULL;
+        }
+
+        // quantifiers
+        while ((pos < len) && (strchr("*+?{", pattern[pos]) != NULL)) {
+            if ((atom->type == RegexNode::BOL) || (atom->type == RegexNode::EOL)) {
+                return NULL;
+            }
+
+            int min = 0;
+            int max = -1;
+            switch (pattern[pos]) {
+                case '*':
+                    pos++;
+                    break;
+                case '+':
+                    min = 1;
+                    pos++;
+                    break;
+                case '?':
+                    max = 1;
+                    pos++;
+                    break;
+                default:
+                    if (!parseInterval(min, max)) {
+                        return NULL;
+                    }
+            }
+
+            RegexNode * repeat = newNode(RegexNode::REPEAT);
+            repeat->children.push_back(atom);
+            repeat->min = min;
+            repeat->max = max;
+            atom = repeat;
+        }
+        concat->children.push_back(atom);
+    }
+
+    if (concat->children.empty()) {
+        concat->type = RegexNode::EMPTY;
+    }
+    return concat;
+}
+
+
+RegexNode *
+RegexParser::parseAtom()
+{
+    RegexNode * node = NULL;
+    unsigned char c = static_cast<unsigned char>(pattern[pos++]);
+
+    switch (c) {
+        case '(':
+            depth++;
+            node = parseAlternation();
+            if (!node || (pos >= len) || (pattern[pos] != ')')) {
+                return NULL;
+            }
+            pos++;
+            depth--;
+            return node;
+        case '.':
+            node = newNode(RegexNode::SET);
+            node->set.set();
+            return node;
+        case '[':
+            node = newNode(RegexNode::SET);
+            return parseBracket(node->set) ? node : NULL;
+        case '^':
+            // glibc lets anchors inside of a pattern match at newlines
+            if (pos != 1) {
+                return NULL;
+            }
+            return newNode(RegexNode::BOL);
+        case '$':
+            if (pos != len) {
+                return NULL;
+            }
+            return newNode(RegexNode::EOL);
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            return NULL;
+        case '\\':
+            if (pos >= len) {
+                return NULL;
+            }
+            c = static_cast<unsigned char>(pattern[pos++]);
+            // back references and GNU extensions like \w
+            if (isalnum(c)) {
+                return NULL;
+            }
+            break;
+        default:
+            break;
+    }
+
+    node = newNode(RegexNode::SET);
+    node->set.set(c);
+    fold_set(node->set);
+    return node;
+}
+
+
+bool
+RegexParser::parseBracket(std::bitset<256> & set)
+{
+    bool negate = false;
+    if ((pos < len) && (pattern[pos] == '^')) {
+        negate = true;
+        pos++;
+    }
+
+    bool first = true;
+    while (true) {
+        if (pos >= len) {
+            return false;
+        }
+        unsigned char c = static_cast<unsigned char>(pattern[pos]);
+        if ((c == ']') && !first) {
+            pos++;
+            break;
+        }
+        first = false;
+
+        if ((c == '[') && ((pos + 1) < len)) {
+            char next = pattern[pos + 1];
+            // collating elements and equivalence classes
+            if ((next == '.') || (next == '=')) {
+                return false;
+            }
+            if (next == ':') {
+                const char * class_end = strstr(pattern + pos + 2, ":]");
+                if (!class_end) {
+                    return false;
+                }
+                std::string name(pattern + pos + 2, class_end - (pattern + pos + 2));
+                if (!add_class(set, name)) {
+                    return false;
+                }
+                pos = (class_end - pattern) + 2;
+
+                // a class can not start a range
+                if (((pos + 1) < len) && (pattern[pos] == '-') && (pattern[pos + 1] != ']')) {
+                    return false;
+                }
+                continue;
+            }
+        }
+
+        pos++;
+        unsigned char last = c;
+        if (((pos + 1) < len) && (pattern[pos] == '-') && (pattern[pos + 1] != ']')) {
+            last = static_cast<unsigned char>(pattern[pos + 1]);
+            if ((last == '[') && ((pos + 2) < len) && (strchr(".=:", pattern[pos + 2]) != NULL)) {
+                return false;
+            }
+            if (last < c) {
+                return false;
+            }
+            pos += 2;
+        }
+        for (int b = c; b <= last; b++) {
+            set.set(b);
+        }
+    }
+
+    fold_set(set);
+    if (negate) {
+        set.flip();
+    }
+    return true;
+}
+
+
+bool
+RegexParser::parseInterval(int & min, int & max)
+{
+    // skip {
+    pos++;
+
+    bool have_min = false;
+    min = 0;
+    while ((pos < len) && isdigit(static_cast<unsigned char>(pattern[pos]))) {
+        min = (min * 10) + (pattern[pos] - '0');
+        have_min = true;
+        pos++;
+        if (min > 255) {
+            return false;
+        }
+    }
+
+    max = min;
+    if ((pos < len) && (pattern[pos] == ',')) {
+        pos++;
+        max = -1;
+        if ((pos < len) && isdigit(static_cast<unsigned char>(pattern[pos]))) {
+            max = 0;
+            while ((pos < len) && isdigit(static_cast<unsigned char>(pattern[pos]))) {
+                max = (max * 10) + (pattern[pos] - '0');
+                pos++;
+                if (max > 255) {
+                    return false;
+                }
+            }
+        }
+    }
+    else if (!have_min) {
+        return false;
+    }
+
+    if ((pos >= len) || (pattern[pos] != '}')) {
+        return false;
+    }
+    pos++;
+    return (max < 0) || (max >= min);
+}
+
+
+// ### MultiRegex #######################################
+
+MultiRegex::MultiRegex()
+    : patterns(), fallbacks(), literals(), line_literals(0), nfa(), charsets(), nfa_starts(),
+      class_count(0), dfa(), dfa_accept(), dfa_accept_end(), simulate(false),
+      all_patterns(0)
+{
+    memset(byte_class, 0, sizeof(byte_class));
+}
+
+
+MultiRegex::~MultiRegex()
+{
+    for (std::vector<regex_t*>::iterator fit = fallbacks.begin(); fit != fallbacks.end(); ++fit) {
+        regfree(*fit);
+        delete *fit;
+    }
+}
+
+
+bool
+MultiRegex::addPattern(const char * pattern, std::string & errmsg)
+{
+    // regcomp decides which patterns are valid. no REG_NOSUB, it changes
+    // how glibc handles anchors
+    regex_t * re = new regex_t;
+    int errcode = regcomp(re, pattern, REG_EXTENDED | REG_ICASE);
+    if (errcode != 0) {
+        size_t len = regerror(errcode, re, NULL, 0);
+        std::vector<char> buff(len);
+        regerror(errcode, re, &buff[0], len);
+        errmsg = &buff[0];
+        delete re;
+        return false;
+    }
+
+    RegexParser parser(pattern);
+    RegexNode * root = parser.parse();
+    if (!root || (nfa_size(root) > MULTIREGEX_MAX_NFA_STATES)
+            || (patterns.size() >= MULTIREGEX_MAX_PATTERNS)) {
+        log_debug("matching pattern \"%s\" with regexec", pattern);
+        fallbacks.push_back(re);
+        return true;
+    }
+    regfree(re);
+    delete re;
+
+    patterns.push_back(pattern);
+    compile();
+    return true;
+}
+
+
+int
+MultiRegex::addNfaState(NfaState::Type type, int out, int out2, int charset, unsigned int pattern)
+{
+    NfaState state;
+    state.type = type;
+    state.out = out;
+    state.out2 = out2;
+    state.charset = charset;
+    state.pattern = pattern;
+    nfa.push_back(state);
+    return static_cast<int>(nfa.size()) - 1;
+}
+
+
+/**
+ * thompson construction, back to front. returns the first state of
+ * the node, which continues with next
+ */
+int
+MultiRegex::compileNode(const RegexNode * node, int next)
+{
+    int state;
+    switch (node->type) {
+        case RegexNode::SET:
+            charsets.push_back(node->set);
+            return addNfaState(NfaState::CHAR, next, -1, static_cast<int>(charsets.size()) - 1, 0);
+        case RegexNode::EMPTY:
+            return next;
+        case RegexNode::BOL:
+            return addNfaState(NfaState::BOL, next, -1, -1, 0);
+        case RegexNode::EOL:
+            return addNfaState(NfaState::EOL, next, -1, -1, 0);
+        case RegexNode::CONCAT:
+            for (size_t i = node->children.size(); i > 0; i--) {
+                next = compileNode(node->children[i-1], next);
+            }
+            return next;
+        case RegexNode::ALTERNATE:
+            state = compileNode(node->children.back(), next);
+            for (size_t i = node->children.size() - 1; i > 0; i--) {
+                int branch = compileNode(node->children[i-1], next);
+                state = addNfaState(NfaState::SPLIT, branch, state, -1, 0);
+            }
+            return state;
+        case RegexNode::REPEAT:
+            {
+                const RegexNode * child = node->children[0];
+                int optional = node->max - node->min;
+                state = next;
+                if (node->max < 0) {
+                    // loop back to the split after each repetition
+                    int loop = addNfaState(NfaState::SPLIT, -1, next, -1, 0);
+                    int body = compileNode(child, loop);
+                    nfa[loop].out = body;
+                    state = loop;
+                }
+                else {
+                    // nested optional repetitions: (x(x)?)?
+                    for (int i = 0; i < optional; i++) {
+                        int body = compileNode(child, state);
+                        state = addNfaState(NfaState::SPLIT, body, next, -1, 0);
+                    }
+                }
+                for (int i = 0; i < node->min; i++) {
+                    state = compileNode(child, state);
+                }
+                return state;
+            }
+    }
+    return next;
+}
+
+
+void
+MultiRegex::compile()
+{
+    nfa.clear();
+    charsets.clear();
+    nfa_starts.clear();
+    literals.clear();
+    line_literals = 0;
+
+    for (size_t i = 0; i < patterns.size(); i++) {
+        RegexParser parser(patterns[i].c_str());
+        RegexNode * root = parser.parse();
+
+        int match = addNfaState(NfaState::MATCH, -1, -1, -1, static_cast<unsigned int>(i));
+        nfa_starts.push_back(compileNode(root, match));
+        literals.push_back(required_literal(root));
+
+        // single bytes are not worth searching for
+        if ((literals.back().size() > 1) && (literals.back().find('\n') == std::string::npos)) {
+            line_literals |= static_cast<uint64_t>(1) << i;
+        }
+    }
+
+    all_patterns = (patterns.size() == 64) ? ~static_cast<uint64_t>(0)
+                : ((static_cast<uint64_t>(1) << patterns.size()) - 1);
+
+    buildByteClasses();
+    simulate = !buildDfa();
+    if (simulate) {
+        log_debug("too many DFA states - simulating the NFA");
+    }
+}
+
+
+/**
+ * group the bytes which are not distinguished by any charset, so the
+ * transition table only needs a column per group
+ */
+void
+MultiRegex::buildByteClasses()
+{
+    std::map<std::string, int> signatures;
+    std::string signature(charsets.size(), '0');
+
+    class_count = 0;
+    for (int b = 0; b < 256; b++) {
+        for (size_t i = 0; i < charsets.size(); i++) {
+            signature[i] = charsets[i].test(b) ? '1' : '0';
+        }
+        std::map<std::string, int>::iterator sit = signatures.find(signature);
+        if (sit == signatures.end()) {
+            signatures[signature] = class_count;
+            byte_class[b] = class_count;
+            class_count++;
+        }
+        else {
+            byte_class[b] = sit->second;
+        }
+    }
+}
+
+
+/**
+ * expand the states by following epsilon transitions. only the
+ * states consuming input, matching states and EOL assertions which
+ * could not be followed are kept. the result is sorted.
+ */
+void
+MultiRegex::closure(std::vector<int> & states, std::vector<char> & seen,
+            bool at_start, bool at_end) const
+{
+    std::vector<int> stack(states);
+    std::vector<int> visited;
+    states.clear();
+
+    while (!stack.empty()) {
+        int s = stack.back();
+        stack.pop_back();
+        if (seen[s]) {
+            continue;
+        }
+        seen[s] = 1;
+        visited.push_back(s);
+
+        const NfaState & state = nfa[s];
+        switch (state.type) {
+            case NfaState::CHAR:
+            case NfaState::MATCH:
+                states.push_back(s);
+                break;
+            case NfaState::SPLIT:
+                stack.push_back(state.out2);
+                stack.push_back(state.out);
+                break;
+            case NfaState::BOL:
+                if (at_start) {
+                    stack.push_back(state.out);
+                }
+                break;
+            case NfaState::EOL:
+                if (at_end) {
+                    stack.push_back(state.out);
+                }
+                else {
+                    states.push_back(s);
+                }
+                break;
+        }
+    }
+
+    for (std::vector<int>::iterator vit = visited.begin(); vit != visited.end(); ++vit) {
+        seen[*vit] = 0;
+    }
+    std::sort(states.begin(), states.end());
+}
+
+
+uint64_t
+MultiRegex::acceptMask(const std::vector<int> & states) const
+{
+    uint64_t mask = 0;
+    for (std::vector<int>::const_iterator sit = states.begin(); sit != states.end(); ++sit) {
+        if (nfa[*sit].type == NfaState::MATCH) {
+            mask |= static_cast<uint64_t>(1) << nfa[*sit].pattern;
+        }
+    }
+    return mask;
+}
+
+
+/** the patterns matching when the text ends in the given states */
+uint64_t
+MultiRegex::acceptEndMask(const std::vector<int> & states, bool at_start) const
+{
+    std::vector<int> end_states(states);
+    std::vector<char> seen(nfa.size(), 0);
+    closure(end_states, seen, at_start, true);
+    return acceptMask(end_states);
+}
+
+
+/**
+ * the states after consuming c. restart contains the start states of
+ * the patterns, as they may start matching at every position
+ */
+void
+MultiRegex::step(const std::vector<int> & states, unsigned char c, const std::vector<int> & restart,
+            std::vector<int> & next, std::vector<char> & seen) const
+{
+    next.assign(restart.begin(), restart.end());
+    for (std::vector<int>::const_iterator sit = states.begin(); sit != states.end(); ++sit) {
+        const NfaState & state = nfa[*sit];
+        if ((state.type == NfaState::CHAR) && charsets[state.charset].test(c)) {
+            next.push_back(state.out);
+        }
+    }
+    closure(next, seen, false, false);
+}
+
+
+/**
+ * subset construction. returns false when the DFA would
+ * get too large.
+ */
+bool
+MultiRegex::buildDfa()
+{
+    dfa.clear();
+    dfa_accept.clear();
+    dfa_accept_end.clear();
+
+    std::vector<char> seen(nfa.size(), 0);
+
+    // a representative byte of each class
+    std::vector<unsigned char> class_byte(class_count, 0);
+    for (int b = 255; b >= 0; b--) {
+        class_byte[byte_class[b]] = static_cast<unsigned char>(b);
+    }
+
+    std::vector<int> restart(nfa_starts);
+    closure(restart, seen, false, false);
+
+    // the initial state is the only one where ^ matches, so it is
+    // never shared with another state
+    std::vector< std::vector<int> > sets;
+    std::map<std::vector<int>, int> index;
+    sets.push_back(nfa_starts);
+    closure(sets[0], seen, true, false);
+
+    std::vector<int> next;
+    for (size_t s = 0; s < sets.size(); s++) {
+        dfa.resize((s + 1) * class_count);
+        dfa_accept.push_back(acceptMask(sets[s]));
+        dfa_accept_end.push_back(acceptEndMask(sets[s], s == 0));
+
+        for (int k = 0; k < class_count; k++) {
+            step(sets[s], class_byte[k], restart, next, seen);
+
+            std::map<std::vector<int>, int>::iterator iit = index.find(next);
+            int target;
+            if (iit == index.end()) {
+                if (sets.size() >= MULTIREGEX_MAX_DFA_STATES) {
+                    dfa.clear();
+                    dfa_accept.clear();
+                    dfa_accept_end.clear();
+                    return false;
+                }
+                target = static_cast<int>(sets.size());
+                index[next] = target;
+                sets.push_back(next);
+            }
+            else {
+                target = iit->second;
+            }
+            dfa[(s * class_count) + k] = target;
+        }
+    }
+
+    // store the row of the target state, negated when a pattern matches in
+    // the target state. this saves the lookup of the accept mask per byte
+    for (std::vector<int>::iterator dit = dfa.begin(); dit != dfa.end(); ++dit) {
+        int row = *dit * class_count;
+        *dit = (dfa_accept[*dit] != 0) ? -row - 1 : row;
+    }
+    return true;
+}
+
+
+void
+MultiRegex::beginMatch(MatchState & state) const
+{
+    state.row = 0;
+    state.matched = dfa_accept[0];
+}
+
+
+/** returns true as soon as all patterns matched */
+bool
+MultiRegex::continueMatch(MatchState & state, const char * text, size_t len) const
+{
+    if (state.matched == all_patterns) {
+        return true;
+    }
+
+    const unsigned char * pos = reinterpret_cast<const unsigned char *>(text);
+    const unsigned char * end = pos + len;
+    const int * transitions = &dfa[0];
+    int row = state.row;
+
+    while (pos < end) {
+        row = transitions[row + byte_class[*pos++]];
+        if (row < 0) {
+            row = -row - 1;
+            state.matched |= dfa_accept[row / class_count];
+            if (state.matched == all_patterns) {
+                return true;
+            }
+        }
+    }
+    state.row = row;
+    return false;
+}
+
+
+bool
+MultiRegex::endMatch(const MatchState & state) const
+{
+    return (state.matched | dfa_accept_end[state.row / class_count]) == all_patterns;
+}
+
+
+/** clears the bits of the literals found in the text */
+uint64_t
+MultiRegex::findLiterals(uint64_t missing, const char * text, size_t len) const
+{
+    for (size_t i = 0; i < literals.size(); i++) {
+        uint64_t bit = static_cast<uint64_t>(1) << i;
+        if ((missing & bit) && contains_folded(text, len, literals[i])) {
+            missing &= ~bit;
+        }
+    }
+    return missing;
+}
+
+
+bool
+MultiRegex::matchAutomaton(const char * text, size_t len) const
+{
+    MatchState state;
+    beginMatch(state);
+    return continueMatch(state, text, len) || endMatch(state);
+}
+
+
+bool
+MultiRegex::matchSimulated(const char * text, size_t len) const
+{
+    std::vector<char> seen(nfa.size(), 0);
+    std::vector<int> restart(nfa_starts);
+    closure(restart, seen, false, false);
+
+    std::vector<int> states(nfa_starts);
+    closure(states, seen, true, false);
+    std::vector<int> next;
+
+    uint64_t matched = acceptMask(states);
+    for (size_t i = 0; (i < len) && (matched != all_patterns); i++) {
+        step(states, static_cast<unsigned char>(text[i]), restart, next, seen);
+        states.swap(next);
+        matched |= acceptMask(states);
+    }
+    matched |= acceptEndMask(states, len == 0);
+    return matched == all_patterns;
+}
+
+
+bool
+MultiRegex::matchAll(const char * text, size_t len) const
+{
+    textEnds(text, len);
+
+    // reject the text when a required literal is missing
+    for (std::vector<std::string>::const_iterator lit = literals.begin(); lit != literals.end(); ++lit) {
+        if ((lit->size() > 1) && !contains_folded(text, len, *lit)) {
+            return false;
+        }
+    }
+
+    if (!patterns.empty()) {
+        bool matched = simulate ? matchSimulated(text, len) : matchAutomaton(text, len);
+        if (!matched) {
+            return false;
+        }
+    }
+
+    for (std::vector<regex_t*>::const_iterator fit = fallbacks.begin(); fit != fallbacks.end(); ++fit) {
+        regmatch_t range;
+        range.rm_so = 0;
+        range.rm_eo = static_cast<regoff_t>(len);
+        if (regexec(*fit, text, 1, &range, REG_STARTEND) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool
+MultiRegex::textEnds(const char * text, size_t & len)
+{
+    // regexec stops at the end of the string
+    const char * nul = static_cast<const char *>(memchr(text, '\0', len));
+    if (nul) {
+        len = nul - text;
+        return true;
+    }
+    return false;
+}
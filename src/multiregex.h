@@ -0,0 +1,213 @@
+#ifndef __multiregex_h__
+#define __multiregex_h__
+
+#include <string>
+#include <vector>
+#include <bitset>
+
+#include <regex.h>
+#include <stdint.h>
+
+// maximum number of states of the DFA. when more states are needed, the
+// NFA is simulated instead, which is slower but still linear
+#define MULTIREGEX_MAX_DFA_STATES   2048
+
+// maximum number of NFA states of a single pattern. larger patterns (large
+// counted repetitions) are matched with regexec
+#define MULTIREGEX_MAX_NFA_STATES   4096
+
+// maximum number of patterns matched in a single pass. further patterns
+// are matched with regexec
+#define MULTIREGEX_MAX_PATTERNS     64
+
+namespace PsqlChunks
+{
+
+    struct RegexNode;
+
+    /**
+     * matches a set of POSIX extended regular expressions case insensitive
+     * in a single pass over a text, like regexec with REG_EXTENDED | REG_ICASE
+     * in the C locale does for each of them.
+     *
+     * the patterns are compiled into one NFA and from there into a DFA, so
+     * matching takes linear time. patterns using features not supported
+     * by the DFA (back references, GNU extensions, collating elements)
+     * are matched with regexec.
+     *
+     * before running the DFA the text is searched for a literal each
+     * pattern requires, which rejects most texts without running the DFA.
+     *
+     * a compiled MultiRegex may be used by multiple threads.
+     */
+    class MultiRegex
+    {
+        private:
+            MultiRegex(const MultiRegex&);
+            MultiRegex& operator=(const MultiRegex&);
+
+            struct NfaState
+            {
+                enum Type {
+                    CHAR,       // consumes a byte of charset
+                    SPLIT,      // epsilon transitions to out and out2
+                    BOL,        // only at the start of the text
+                    EOL,        // only at the end of the text
+                    MATCH       // pattern matched
+                };
+
+                Type type;
+                int out;
+                int out2;
+                int charset;
+                unsigned int pattern;
+            };
+
+            /** the patterns matched by the automaton */
+            std::vector<std::string> patterns;
+
+            /** patterns matched with regexec */
+            std::vector<regex_t*> fallbacks;
+
+            /** literals required by the patterns, lowercase */
+            std::vector<std::string> literals;
+
+            /** bits of the literals which can be searched for line by line */
+            uint64_t line_literals;
+
+            std::vector<NfaState> nfa;
+            std::vector< std::bitset<256> > charsets;
+            std::vector<int> nfa_starts;
+
+            /** byte -> equivalence class of bytes no charset distinguishes */
+            int byte_class[256];
+            int class_count;
+
+            /**
+             * transitions of the DFA, indexed by state * class_count + class. the
+             * values are the row of the next state, -row - 1 if it matches a pattern
+             */
+            std::vector<int> dfa;
+
+            /** patterns matched when reaching a state / at the end of the text in a state */
+            std::vector<uint64_t> dfa_accept;
+            std::vector<uint64_t> dfa_accept_end;
+
+            /** the DFA could not be built, the NFA gets simulated */
+            bool simulate;
+
+            uint64_t all_patterns;
+
+            void compile();
+            void buildByteClasses();
+            bool buildDfa();
+            void closure(std::vector<int> & states, std::vector<char> & seen,
+                        bool at_start, bool at_end) const;
+            uint64_t acceptMask(const std::vector<int> & states) const;
+            uint64_t acceptEndMask(const std::vector<int> & states, bool at_start) const;
+            void step(const std::vector<int> & states, unsigned char c,
+                        const std::vector<int> & restart, std::vector<int> & next,
+                        std::vector<char> & seen) const;
+
+            /** position of the DFA in an incremental match */
+            struct MatchState
+            {
+                int row;
+                uint64_t matched;
+            };
+
+            void beginMatch(MatchState & state) const;
+            bool continueMatch(MatchState & state, const char * text, size_t len) const;
+            bool endMatch(const MatchState & state) const;
+            uint64_t findLiterals(uint64_t missing, const char * text, size_t len) const;
+
+            /** like regexec the text ends at a NUL byte. shortens len to it */
+            static bool textEnds(const char * text, size_t & len);
+
+            bool matchAutomaton(const char * text, size_t len) const;
+            bool matchSimulated(const char * text, size_t len) const;
+
+            int addNfaState(NfaState::Type type, int out, int out2, int charset,
+                        unsigned int pattern);
+            int compileNode(const RegexNode * node, int next);
+
+        public:
+            MultiRegex();
+            ~MultiRegex();
+
+            /**
+             * add a pattern. returns false and sets errmsg when the
+             * pattern is not a valid regular expression.
+             */
+            bool addPattern(const char * pattern, std::string & errmsg);
+
+            /** number of patterns */
+            size_t size() const
+            {
+                return patterns.size() + fallbacks.size();
+            }
+
+            /**
+             * true when all patterns match the text. like regexec the
+             * text ends at the first NUL byte.
+             */
+            bool matchAll(const char * text, size_t len) const;
+
+            bool matchAll(const std::string & text) const
+            {
+                return matchAll(text.data(), text.size());
+            }
+
+            /**
+             * true when matchAllLines can be used. patterns matched with regexec
+             * or by simulating the NFA need the whole text.
+             */
+            bool matchesLines() const
+            {
+                return !patterns.empty() && fallbacks.empty() && !simulate;
+            }
+
+            /**
+             * like matchAll on the lines joined by linebreaks, with a linebreak
+             * after the last line, but without joining the lines. the elements
+             * of the range need the data and length members of a Line.
+             */
+            template <typename LineIterator>
+            bool matchAllLines(LineIterator first, LineIterator last) const
+            {
+                // the lines without the required literals are rejected first
+                uint64_t missing = line_literals;
+                for (LineIterator line = first; (line != last) && (missing != 0); ++line) {
+                    size_t len = line->length;
+                    bool text_ends = textEnds(line->data, len);
+                    missing = findLiterals(missing, line->data, len);
+                    if (text_ends) {
+                        break;
+                    }
+                }
+                if (missing != 0) {
+                    return false;
+                }
+
+                MatchState state;
+                beginMatch(state);
+                for (LineIterator line = first; line != last; ++line) {
+                    size_t len = line->length;
+                    bool text_ends = textEnds(line->data, len);
+                    if (continueMatch(state, line->data, len)) {
+                        return true;
+                    }
+                    if (text_ends) {
+                        break;
+                    }
+                    if (continueMatch(state, "\n", 1)) {
+                        return true;
+                    }
+                }
+                return endMatch(state);
+            }
+    };
+
+};
+
+#endif /* __multiregex_h__ */
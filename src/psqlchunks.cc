@@ -2,16 +2,35 @@
 #include <sstream>
 #include <string>
 #include <unistd.h>
+#include <getopt.h>
 #include <cstdlib>
 #include <cstring>
+#include <cstdarg>
+#include <cmath>
 #include <iomanip>
 #include <cstring>
 #include <termios.h>
 #include <signal.h>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "scanner.h"
+#include "chunkindex.h"
+#include "inputsplit.h"
+#include "resultcache.h"
+#include "chunkqueue.h"
+#include "templatedb.h"
+#include "server.h"
+#include "report.h"
+#include "baseline.h"
+#include "filewatcher.h"
 #include "db.h"
 #include "filter.h"
+#include "workerpool.h"
 #include "debug.h"
 
 using namespace std;
@@ -33,11 +52,24 @@ using namespace PsqlChunks;
 #define RC_E_SQL        2
 #define RC_E_DB         3
 #define RC_E_OTHER      4
+#define RC_E_REGRESSION 5
+
+// default number of files processed in parallel
+#define DEFAULT_JOBS 1
 
 // number of lines before and after the failing line
 // to print when outputing sql after an error
 #define DEFAULT_CONTEXT_LINES 2
 
+// files the report is written to without --report-file
+#define DEFAULT_REPORT_JSON     "psqlchunks-report.json"
+#define DEFAULT_REPORT_JUNIT    "psqlchunks-report.xml"
+
+// a chunk got slower than its baseline when its query time exceeds the
+// time of the baseline by both the factor and the milliseconds
+#define DEFAULT_MAX_SLOWDOWN        2.0
+#define DEFAULT_MAX_SLOWDOWN_MS     100
+
 // these two macros convert macro values to strings
 #define STRINGIFY2(x)   #x
 #define STRINGIFY(x)    STRINGIFY2(x)
@@ -53,7 +85,28 @@ static const char * s_fail_sep = "----------------------------------------------
 enum Command {
     PRINT,
     LIST,
-    RUN
+    RUN,
+    WATCH,
+    SERVE
+};
+
+// options without a short form
+enum LongOption {
+    OPT_INDEX = 256,
+    OPT_INDEX_DIR,
+    OPT_RESULT_CACHE,
+    OPT_CACHE_VERIFY,
+    OPT_FILTER_STATS,
+    OPT_PIPELINE,
+    OPT_TEMPLATE,
+    OPT_SOCKET,
+    OPT_RESOURCES,
+    OPT_REPORT,
+    OPT_REPORT_FILE,
+    OPT_BASELINE,
+    OPT_UPDATE_BASELINE,
+    OPT_MAX_SLOWDOWN,
+    OPT_MAX_SLOWDOWN_MS
 };
 
 enum CommandRc {
@@ -62,6 +115,21 @@ enum CommandRc {
 };
 
 
+/**
+ * thrown by quit while the server handles a request
+ */
+class UsageError : public std::runtime_error
+{
+    public:
+        UsageError(const char * msg)
+            :  std::runtime_error(msg)
+        {
+        }
+
+        virtual ~UsageError() throw() {};
+};
+
+
 struct Settings {
     public:
         const char * db_port;
@@ -71,13 +139,62 @@ struct Settings {
         bool ask_pass;
         bool commit_sql;
         bool abort_after_failed;
+        bool pipeline;
+        bool account_resources;
+        const char * template_db;
         Command command;
         bool is_terminal;
         unsigned int context_lines;
         bool print_filenames;
         const char * client_encoding;
+        unsigned int jobs;
+        bool use_index;
+        const char * index_dir;
+        const char * result_cache_dir;
+        double cache_verify_ratio;
+
+        /** only set while running chunks with the result cache enabled */
+        ResultCache * result_cache;
+
+        /** the report is written with --report. see Report */
+        bool write_report;
+        ReportFormat report_format;
+        const char * report_path;
+
+        /** only set while running chunks with a report */
+        Report * report;
+
+        /** the query times are compared with the baseline. see Baseline */
+        const char * baseline_path;
+        bool update_baseline;
+        double max_slowdown;
+        unsigned int max_slowdown_ms;
+
+        /** only set while running chunks with a baseline */
+        Baseline * baseline;
+
+        /** only set while the files of the run command are scanned. see RunProducer */
+        ChunkQueue * run_queue;
+
+        /** only set while the watch command scans a file. receives copies of the chunks */
+        std::vector<Chunk*> * watch_chunks;
 
         FilterChain filterchain;
+        bool filter_stats;
+
+        /** set when no further files may be started by RunTasks */
+        volatile bool abort_run;
+
+        /** the socket of the server. see forward_to_server */
+        const char * socket_path;
+
+        /** only set while the server handles a request */
+        ConnectionPool * connection_pool;
+        IndexCache * index_cache;
+
+        /** set when the client of the server got interrupted. no further chunks are scanned */
+        volatile bool interrupted;
+        int interrupt_rc;
 
         Settings() :
             db_port(0),
@@ -87,12 +204,39 @@ struct Settings {
             ask_pass(false),
             commit_sql(false),
             abort_after_failed(false),
+            pipeline(false),
+            account_resources(false),
+            template_db(0),
             command(LIST),
             is_terminal(false),
             context_lines(DEFAULT_CONTEXT_LINES),
             print_filenames(true),
             client_encoding(0),
-            filterchain()
+            jobs(DEFAULT_JOBS),
+            use_index(false),
+            index_dir(0),
+            result_cache_dir(0),
+            cache_verify_ratio(0.0),
+            result_cache(0),
+            write_report(false),
+            report_format(REPORT_JSON),
+            report_path(0),
+            report(0),
+            baseline_path(0),
+            update_baseline(false),
+            max_slowdown(DEFAULT_MAX_SLOWDOWN),
+            max_slowdown_ms(DEFAULT_MAX_SLOWDOWN_MS),
+            baseline(0),
+            run_queue(0),
+            watch_chunks(0),
+            filterchain(),
+            filter_stats(false),
+            abort_run(false),
+            socket_path(0),
+            connection_pool(0),
+            index_cache(0),
+            interrupted(false),
+            interrupt_rc(RC_OK)
         {};
 
     private:
@@ -102,10 +246,48 @@ struct Settings {
 
 };
 
-// allow signal handler to access db
-static Db * db_ptr = NULL;
+// allow signal handler to access the database connections. the mutex is
+// not used by the signal handler, only by the server
+static std::vector<Db*> db_ptrs;
+static pthread_mutex_t db_ptrs_mutex = PTHREAD_MUTEX_INITIALIZER;
 static Settings * settings_ptr = NULL;
 
+// set while the server handles requests. the server must not exit on
+// invalid arguments of a client, see quit
+static bool s_serving = false;
+
+// set by SIGINT and SIGTERM to end the server
+static volatile sig_atomic_t s_stop_server = 0;
+
+
+/**
+ * the chunks of a file run by the watch command
+ */
+struct WatchedFile
+{
+    const char * filename;
+    std::vector<Chunk*> chunks;
+
+    WatchedFile(const char * _filename) : filename(_filename), chunks() {};
+
+    ~WatchedFile()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        for (std::vector<Chunk*>::iterator cit = chunks.begin(); cit != chunks.end(); ++cit) {
+            delete *cit;
+        }
+        chunks.clear();
+    }
+
+    private:
+        WatchedFile(const WatchedFile&);
+        WatchedFile& operator=(const WatchedFile&);
+};
+
 
 /* prototypes */
 void quit(const char * message);
@@ -113,13 +295,64 @@ void print_help();
 void print_version();
 const char * ansi_code(const char * color);
 std::string read_password();
+int parse_args(Settings & settings, int argc, char * argv[]);
+int run_command(Settings & settings, char * files[], int nufiles);
+int run_with_report(Settings & settings, char * files[], int nufiles);
+int run_with_baseline(Settings & settings, char * files[], int nufiles);
+int serve(const char * socket_path);
+int handle_request(ServerRequest & request, ConnectionPool & connection_pool,
+            IndexCache & index_cache);
+void interrupt_request(void * arg);
 int handle_files(Settings & settings, char * files[], int nufiles);
-CommandRc cmd_list(Chunk & chunk);
-CommandRc cmd_print(const Chunk & chunk);
-void cmd_run_print_diagnostics(Settings & settings, Chunk & chunk);
-CommandRc cmd_run(Chunk & chunk, Db & db);
-CommandRc scan(Settings & settings, ChunkScanner & scanner, Db & db);
-extern void handle_sigint(int sig);
+int handle_files_parallel(Settings & settings, char * files[], int nufiles);
+int handle_files_run_parallel(Settings & settings, char * files[], int nufiles);
+void set_db_ptrs(const std::vector<Db*> & dbs);
+int cancel_queries();
+std::string connection_key(Settings & settings);
+Db * take_db(Settings & settings);
+void release_db(Settings & settings, Db * db);
+int connect_db(Settings & settings, Db & db, const char * db_name, const char * password);
+int connect_run_db(Settings & settings, Db & db, TemplateClones * clones, size_t clone_index,
+            const char * password);
+int start_clones(Settings & settings, TemplateClones & clones, size_t count, const char * password);
+void drop_clones(TemplateClones & clones);
+int print_run_summary(Settings & settings, unsigned int failed_count, const PhaseTimes & times,
+            const ResourceUsage & resources);
+void print_totals(const PhaseTimes & times, const ResourceUsage & resources);
+std::string format_bytes(int64_t bytes);
+std::string format_resources(const ResourceUsage & resources);
+bool split_file(Settings & settings, const char * filename, std::vector<Task*> & tasks,
+            std::vector<Input*> & inputs);
+CommandRc cmd_list(std::ostream & out, Chunk & chunk);
+CommandRc cmd_print(std::ostream & out, const Chunk & chunk);
+void cmd_run_print_diagnostics(Settings & settings, std::ostream & out, Chunk & chunk);
+CommandRc cmd_run(Settings & settings, std::ostream & out, Chunk & chunk, Db & db);
+CommandRc cmd_run_replay_cached(Settings & settings, std::ostream & out, Db & db);
+void cmd_run_print_cached(std::ostream & out, DeferredChunk & dchunk);
+void cmd_run_print_deferred(Settings & settings, std::ostream & out);
+void cmd_run_drop_deferred(Settings & settings, std::ostream & out);
+void cmd_run_print_status(std::ostream & out, Chunk & chunk, bool run_ok, const char * note);
+void out_printf(std::ostream & out, const char * format, ...)
+            __attribute__((format(printf, 2, 3)));
+void print_header(Settings & settings, std::ostream & out, const char * filename);
+CommandRc scan(Settings & settings, ChunkSource & source, const char * filename, Db & db,
+            std::ostream & out, ChunkIndex * record_index);
+CommandRc scan_indexed(Settings & settings, const char * filename, MappedInput & input, Db & db,
+            std::ostream & out);
+CommandRc scan_index(Settings & settings, const ChunkIndex & index, MappedInput & input,
+            const char * filename, Db & db, std::ostream & out, bool with_sql);
+bool process_file(Settings & settings, const char * filename, Db & db, std::ostream & out,
+            CommandRc & crc);
+int run_files(Settings & settings, char * files[], int nufiles, Db & db);
+int watch_files(Settings & settings, char * files[], int nufiles);
+bool watch_scan(Settings & settings, WatchedFile & file);
+CommandRc watch_run(Settings & settings, Db & db, std::vector<WatchedFile*> & files, size_t start,
+            std::vector<char> & failed, PhaseTimes & times, ResourceUsage & resources);
+std::string watch_savepoint(size_t position);
+void print_watch_summary(const std::vector<char> & failed, const PhaseTimes & times,
+            const ResourceUsage & resources);
+extern void handle_stop_server(int sig);
+void * interrupt_main(void * arg);
 
 
 const char *
@@ -134,33 +367,87 @@ ansi_code(const char * color)
 }
 
 
+/**
+ * printf to a stream. the output of the run command goes to a buffer when
+ * files are run in parallel
+ */
+void
+out_printf(std::ostream & out, const char * format, ...)
+{
+    char buf[512];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (len < 0) {
+        return;
+    }
+
+    if (static_cast<size_t>(len) < sizeof(buf)) {
+        out.write(buf, len);
+    }
+    else {
+        std::vector<char> large(len + 1);
+        va_start(args, format);
+        vsnprintf(&large[0], large.size(), format, args);
+        va_end(args);
+        out.write(&large[0], len);
+    }
+}
+
+
 void
 quit(const char * message)
 {
     printf("%s\nCall with \"help\" for help.\n", message);
+    if (s_serving) {
+        throw UsageError(message);
+    }
     exit(RC_E_USAGE);
 }
 
 extern void
-handle_sigint(int sig) {
-    log_debug("Caught signal %d", sig);
-    if (sig == SIGINT) {
-        int rc = RC_OK;
-        printf("\nReceived SIGINT\n");
-
-        if (db_ptr) {
-            std::string errmsg;
-
-            printf("%sCanceling running queries%s\n", ansi_code(ANSI_YELLOW),
-                    ansi_code(ANSI_RESET));
-            if (!db_ptr->cancel(errmsg)) {
-                printf("Canceling failed: %s\n", errmsg.c_str());
-                rc = RC_E_DB;
-            }
-            db_ptr->setCommit(false);
+handle_stop_server(int sig) {
+    UNUSED_PARAMETER(sig);
+    s_stop_server = 1;
+}
+
+
+void
+set_db_ptrs(const std::vector<Db*> & dbs)
+{
+    pthread_mutex_lock(&db_ptrs_mutex);
+    db_ptrs = dbs;
+    pthread_mutex_unlock(&db_ptrs_mutex);
+}
+
+
+/**
+ * cancel the running queries after SIGINT. the transactions of the
+ * connections will not be commited anymore
+ */
+int
+cancel_queries()
+{
+    int rc = RC_OK;
+    printf("\nReceived SIGINT\n");
+
+    pthread_mutex_lock(&db_ptrs_mutex);
+    if (!db_ptrs.empty()) {
+        printf("%sCanceling running queries%s\n", ansi_code(ANSI_YELLOW),
+                ansi_code(ANSI_RESET));
+    }
+    for (std::vector<Db*>::iterator dit = db_ptrs.begin(); dit != db_ptrs.end(); ++dit) {
+        std::string errmsg;
+        if (!(*dit)->cancel(errmsg)) {
+            printf("Canceling failed: %s\n", errmsg.c_str());
+            rc = RC_E_DB;
         }
-        exit(rc);
+        (*dit)->setCommit(false);
     }
+    pthread_mutex_unlock(&db_ptrs_mutex);
+    return rc;
 }
 
 
@@ -179,7 +466,8 @@ print_help()
         "psqlchunks command [options] files\n"
         "version: " VERSION_FULL "\n"
         "\n"
-        "use - as filename to read from stdin.\n"
+        "use - as filename to read from stdin. gzip and zstd compressed input is\n"
+        "decompressed automatically.\n"
         "Definition of a chunk of SQL:\n"
         "  A chunk of SQL is block of SQL statements to be executed together,\n"
         "  and is delimited by the following markers:\n"
@@ -211,19 +499,65 @@ print_help()
         "               COMMIT statements from the SQL files. Should there be any\n"
         "               in the files, the SQL WILL BE COMMITED and this tool will\n"
         "               terminate.\n"
+        "  watch        run SQL chunks like run, then wait for changes of the files\n"
+        "               and run the changed chunks again. The transaction stays open,\n"
+        "               a savepoint is set before each chunk. After a change the\n"
+        "               transaction is rolled back to the savepoint of the first\n"
+        "               changed chunk and the chunks are run from there on. The\n"
+        "               chunks before it are not run again. Ends with SIGINT, which\n"
+        "               rolls back the transaction.\n"
+        "  serve        wait for the run and list commands of other calls of\n"
+        "               psqlchunks on the socket given with --socket and run them.\n"
+        "               Database connections are kept open and the chunks of\n"
+        "               unchanged files are not scanned again between the commands.\n"
+        "               The commands are handled one after the other. Ends with\n"
+        "               SIGINT or SIGTERM.\n"
         "  version      print the version number and exit.\n"
         "\n"
         "General:\n"
         "  -F           hide filenames from output\n"
+        "  --index      store the chunk boundaries of each file in an index file\n"
+        "               next to it (file name + \"" INDEX_SIDECAR_EXTENSION "\") and use it\n"
+        "               instead of scanning the file when it did not change.\n"
+        "  --index-dir [directory]\n"
+        "               like --index, but keep the index files in the given directory.\n"
+        "  -j [jobs]    number of files to scan in parallel. Large files are split\n"
+        "               and their parts get scanned in parallel as well. The output\n"
+        "               does not differ from the sequential run. (default: " STRINGIFY(DEFAULT_JOBS) ")\n"
+        "               The run command opens a database connection per job and\n"
+        "               runs each file on one of them, so the files must not depend\n"
+        "               on each other. Each file runs in its own transaction,\n"
+        "               which is rolled back. With -C the files run on a\n"
+        "               connection share its transaction and are not isolated\n"
+        "               from each other, all connections commit only when all\n"
+        "               chunks passed. With -a no further files are started after\n"
+        "               a chunk failed, files already running are completed.\n"
+        "               SIGINT cancels the running chunks and ends the run like\n"
+        "               a failed chunk with -a.\n"
+        "  --socket [path]\n"
+        "               let the server listening on the unix domain socket handle\n"
+        "               the run and list commands (see serve). The output does not differ. The\n"
+        "               command runs with the environment and the permissions of the\n"
+        "               server. Without a server the command runs as usual.\n"
         "\n"
         "Filters:\n"
         "  -L [lines]   use only chunks which span the given lines.\n"
         "               lines is a commaseperated list of line numbers. Example:\n"
         "               1,78,345\n"
+        "               The file is only scanned up to the last given line. With\n"
+        "               an index the chunks before the first line are skipped.\n"
         "  -I [regex]   match description comments with a regular expression.\n"
         "               (POSIX extended regular expression, case insensitive)\n"
         "  -S [regex]   SQL has to match this POSIX extended regular expression,\n"
         "               also case insensitive.\n"
+        "               -I and -S may be given multiple times, a chunk has to\n"
+        "               match all of them. The expressions are matched in a\n"
+        "               single pass over the chunk.\n"
+        "  --filter-stats\n"
+        "               print how often each filter was called, how many chunks\n"
+        "               it rejected and the time spent in it to stderr at exit.\n"
+        "               Filters are evaluated in the order of their cost per\n"
+        "               rejected chunk.\n"
         "\n"
         "SQL Handling:\n"
         "  -C           commit SQL to the database. Default is performing a rollback\n"
@@ -235,6 +569,60 @@ print_help()
         "  -E           set the client_encoding of the database connection. This\n"
         "               setting is useful when the encoding of sql file differs\n"
         "               from the default client_encoding of the database server.\n"
+        "  --template [database]\n"
+        "               run the chunks in a new database created from the given\n"
+        "               template database, which is dropped afterwards. Runs in\n"
+        "               parallel (-j) create a database per connection. The\n"
+        "               databases are created from the database given with -d\n"
+        "               on a separate connection while the run starts. Not\n"
+        "               available together with -C.\n"
+        "  --pipeline   send the savepoint commands around each chunk in the same\n"
+        "               query as the chunk. Saves two round trips to the server per\n"
+        "               chunk, which matters for many small chunks and a remote\n"
+        "               server. Requires chunks to end outside of a block comment.\n"
+        "  --report [format]\n"
+        "               write a report of the run in the given format, json or\n"
+        "               junit. It lists the file, lines, description, status,\n"
+        "               sql state and the times of every chunk, followed by the\n"
+        "               percentiles and a histogram of the query times and the\n"
+        "               slowest chunks. The report is written while the chunks\n"
+        "               run and stays a valid document when the run is killed.\n"
+        "  --report-file [file]\n"
+        "               the file the report is written to.\n"
+        "               (default: " DEFAULT_REPORT_JSON " or " DEFAULT_REPORT_JUNIT ")\n"
+        "  --baseline [file]\n"
+        "               compare the query time of each chunk which passed with\n"
+        "               the time of the same chunk in the baseline. Chunks are\n"
+        "               matched by their file, their SQL and how often it occurred\n"
+        "               before in the file, changed chunks by their description.\n"
+        "               Chunks which got slower are marked and\n"
+        "               the run ends with return code " STRINGIFY(RC_E_REGRESSION) ".\n"
+        "  --update-baseline\n"
+        "               write the query times of the chunks which passed to the\n"
+        "               baseline after the run. Chunks which were not run are\n"
+        "               kept. Creates the baseline when it does not exist.\n"
+        "  --max-slowdown [factor]\n"
+        "               a chunk got slower when its query time exceeds the\n"
+        "               time of the baseline by this factor and by the\n"
+        "               milliseconds of --max-slowdown-ms.\n"
+        "               (default: " STRINGIFY(DEFAULT_MAX_SLOWDOWN) ")\n"
+        "  --max-slowdown-ms [milliseconds]\n"
+        "               (default: " STRINGIFY(DEFAULT_MAX_SLOWDOWN_MS) ")\n"
+        "  --resources  show the wal written, the shared and local buffers hit and\n"
+        "               read, the rows inserted, updated and deleted and the memory\n"
+        "               of the server process for each chunk. The wal is written\n"
+        "               by all sessions of the server, so concurrent work and\n"
+        "               parallel runs (-j) are included. Costs two queries per\n"
+        "               chunk. Blocks of pg_class are not counted.\n"
+        "  --result-cache [directory]\n"
+        "               remember passed chunks in the given directory and skip them\n"
+        "               in later runs. A chunk is only skipped when it and all chunks\n"
+        "               run before it are unchanged and the server version and\n"
+        "               settings are the same. Not available together with -C\n"
+        "               or when running files in parallel.\n"
+        "  --cache-verify [fraction]\n"
+        "               execute this fraction (0.0 - 1.0) of the cached chunks\n"
+        "               anyways to detect stale results. (default: 0.0)\n"
         "\n"
         "Connection parameters:\n"
         "  -d [database name]\n"
@@ -247,6 +635,7 @@ print_help()
         "  " STRINGIFY(RC_E_USAGE)  "            invalid usage of this program\n"
         "  " STRINGIFY(RC_E_SQL)    "            the SQL contains errors\n"
         "  " STRINGIFY(RC_E_DB)     "            (internal) database error\n"
+        "  " STRINGIFY(RC_E_REGRESSION) "            chunks got slower than the baseline\n"
         "\n"
     );
 }
@@ -278,25 +667,27 @@ read_password()
 /****** COMMAND Functions *****/
 
 inline CommandRc
-cmd_list(Chunk & chunk)
+cmd_list(std::ostream & out, Chunk & chunk)
 {
-    printf("%8d-%8d: %s\n", chunk.start_line, chunk.end_line, chunk.getDescription().c_str());
+    char range[64];
+    snprintf(range, sizeof(range), "%8" PRIu64 "-%8" PRIu64 ": ", chunk.start_line, chunk.end_line);
+    out << range << chunk.getDescription() << "\n";
     return OK;
 }
 
 
 inline CommandRc
-cmd_print(const Chunk & chunk)
+cmd_print(std::ostream & out, const Chunk & chunk)
 {
-    std::cout << chunk << std::endl;
+    out << chunk << std::endl;
     return OK;
 }
 
 
 inline void
-cmd_run_print_diagnostics(Settings & settings, Chunk & chunk) {
+cmd_run_print_diagnostics(Settings & settings, std::ostream & out, Chunk & chunk) {
     if (chunk.failed()) {
-        printf( "%s\n"
+        out_printf(out, "%s\n"
                 "%s> description    : %s\n"
                 "> sql state      : %s\n",
                 s_fail_sep,
@@ -305,99 +696,270 @@ cmd_run_print_diagnostics(Settings & settings, Chunk & chunk) {
                 chunk.diagnostics.sqlstate.c_str()
         );
         if (chunk.diagnostics.error_line != LINE_NUMBER_NOT_AVAILABLE) {
-            printf("> line           : %d\n", chunk.diagnostics.error_line);
+            out_printf(out, "> line           : %" PRIu64 "\n", chunk.diagnostics.error_line);
         }
         else {
-            printf("> line           : not available [chunk %d-%d]\n",
+            out_printf(out, "> line           : not available [chunk %" PRIu64 "-%" PRIu64 "]\n",
                         chunk.start_line, chunk.end_line);
         }
 
 
         if (!chunk.diagnostics.msg_detail.empty()) {
-            printf("> details        : %s\n", chunk.diagnostics.msg_detail.c_str());
+            out_printf(out, "> details        : %s\n", chunk.diagnostics.msg_detail.c_str());
         }
         if (!chunk.diagnostics.msg_hint.empty()) {
-            printf("> hint           : %s\n", chunk.diagnostics.msg_hint.c_str());
+            out_printf(out, "> hint           : %s\n", chunk.diagnostics.msg_hint.c_str());
         }
         if (!chunk.diagnostics.msg_context.empty()) {
-            printf("> context        : %s\n\n", chunk.diagnostics.msg_context.c_str());
+            out_printf(out, "> context        : %s\n\n", chunk.diagnostics.msg_context.c_str());
         }
         if (!chunk.diagnostics.msg_internal_query.empty()) {
-            printf("> internal query : %s\n\n", chunk.diagnostics.msg_internal_query.c_str());
+            out_printf(out, "> internal query : %s\n\n", chunk.diagnostics.msg_internal_query.c_str());
         }
 
         // print sql fragment
         if (chunk.diagnostics.error_line != LINE_NUMBER_NOT_AVAILABLE) {
-            printf("> SQL            :%s\n\n", ansi_code(ANSI_RESET));
+            out_printf(out, "> SQL            :%s\n\n", ansi_code(ANSI_RESET));
 
             // calculate the size of the fragment
-            size_t out_start = chunk.start_line;
-            size_t out_end = chunk.end_line;
+            linenumber_t out_start = chunk.start_line;
+            linenumber_t out_end = chunk.end_line;
             if (settings.context_lines < (chunk.diagnostics.error_line - chunk.start_line)) {
                 out_start = chunk.diagnostics.error_line - settings.context_lines;
             }
             if (settings.context_lines < (chunk.end_line - chunk.diagnostics.error_line)) {
                 out_end = chunk.diagnostics.error_line + settings.context_lines;
             }
-            log_debug("out_start: %lu, out_end: %lu", out_start, out_end);
+            log_debug("out_start: %" PRIu64 ", out_end: %" PRIu64, out_start, out_end);
 
             // output sql
-            linevector_t sql_lines = chunk.getSqlLines();
-            for (linevector_t::iterator lit = sql_lines.begin(); lit != sql_lines.end(); ++lit) {
-                if (((*lit)->number >= out_start) &&
-                    ((*lit)->number <= out_end)) {
-
-                    if ((*lit)->number == chunk.diagnostics.error_line) {
-                        printf("%s", ansi_code(ANSI_RED));
+            const linevector_t & sql_lines = chunk.getSqlLines();
+            linevector_t::const_iterator lit_start = sql_lines.begin() + chunk.findLine(out_start);
+            for (linevector_t::const_iterator lit = lit_start; lit != sql_lines.end(); ++lit) {
+                if ((lit->number >= out_start) &&
+                    (lit->number <= out_end)) {
+
+                    if (lit->number == chunk.diagnostics.error_line) {
+                        out_printf(out, "%s", ansi_code(ANSI_RED));
                     }
-                    printf("%s\n", (*lit)->contents.c_str());
-                    if ((*lit)->number == chunk.diagnostics.error_line) {
-                        printf("%s", ansi_code(ANSI_RESET));
+                    out.write(lit->data, lit->length);
+                    out_printf(out, "\n");
+                    if (lit->number == chunk.diagnostics.error_line) {
+                        out_printf(out, "%s", ansi_code(ANSI_RESET));
                     }
                 }
 
-                if ((*lit)->number >= out_end) {
+                if (lit->number >= out_end) {
                     break;
                 }
             }
-            printf("\n");
+            out_printf(out, "\n");
+        }
+        else {
+            out_printf(out, "%s", ansi_code(ANSI_RESET));
+        }
+        out_printf(out, "%s\n", s_fail_sep);
+    }
+
+}
+
+/**
+ * print the result line of an executed chunk
+ */
+void
+cmd_run_print_status(std::ostream & out, Chunk & chunk, bool run_ok, const char * note)
+{
+    if (run_ok) {
+        out_printf(out, "%sOK%s  ", ansi_code(ANSI_GREEN), ansi_code(ANSI_RESET));
+    }
+    else {
+        out_printf(out, "%sFAIL%s", ansi_code(ANSI_RED), ansi_code(ANSI_RESET));
+    }
+    uint64_t query_ns = chunk.diagnostics.times.queryNs();
+    std::string resources;
+    if (chunk.diagnostics.resources.measured) {
+        resources = " [" + format_resources(chunk.diagnostics.resources) + "]";
+    }
+    out_printf(out, "  [%" PRIu64 "-%" PRIu64 "] [%" PRIu64 ".%03" PRIu64 "s]%s %s%s\n", chunk.start_line,
+                chunk.end_line,
+                query_ns / 1000000000,
+                (query_ns / 1000000) % 1000,
+                resources.c_str(),
+                chunk.getDescription().c_str(),
+                note);
+}
+
+
+/**
+ * execute the chunks which have been skipped because of the result cache.
+ * their result lines are printed now, unless an earlier file already
+ * printed them as passed.
+ */
+CommandRc
+cmd_run_replay_cached(Settings & settings, std::ostream & out, Db & db)
+{
+    CommandRc crc = OK;
+    std::vector<DeferredChunk> deferred;
+    settings.result_cache->takeDeferred(deferred);
+
+    for (std::vector<DeferredChunk>::iterator dit = deferred.begin(); dit != deferred.end(); ++dit) {
+        // the chunks following a failed one are not run with -a
+        if ((crc != OK) && !dit->printed) {
+            delete dit->chunk;
+            continue;
+        }
+
+        if ((crc == OK) && !db.runChunk(*dit->chunk)) {
+            settings.result_cache->remove(dit->key);
+
+            std::string note = " (cached result was stale)";
+            if (dit->printed) {
+                note = std::string(" (cached result of ") + dit->chunk->filename + " was stale)";
+            }
+            cmd_run_print_status(out, *dit->chunk, false, note.c_str());
+            if (settings.report) {
+                settings.report->add(*dit->chunk, false);
+            }
+            cmd_run_print_diagnostics(settings, out, *dit->chunk);
+            if (settings.abort_after_failed) {
+                out_printf(out, "Chunk failed. Aborting.\n");
+                crc = BREAK;
+            }
         }
         else {
-            printf("%s", ansi_code(ANSI_RESET));
+            cmd_run_print_cached(out, *dit);
+            settings.result_cache->countHit();
+            if (settings.report) {
+                settings.report->add(*dit->chunk, true);
+            }
         }
-        printf("%s\n", s_fail_sep);
+        delete dit->chunk;
     }
+    return crc;
+}
+
+
+/**
+ * print the result line of a chunk skipped because of the result cache
+ */
+void
+cmd_run_print_cached(std::ostream & out, DeferredChunk & dchunk)
+{
+    if (dchunk.printed) {
+        return;
+    }
+    out_printf(out, "%sOK%s    [%" PRIu64 "-%" PRIu64 "] [cached] %s\n",
+                ansi_code(ANSI_GREEN), ansi_code(ANSI_RESET),
+                dchunk.chunk->start_line, dchunk.chunk->end_line,
+                dchunk.chunk->getDescription().c_str());
+    dchunk.printed = true;
+}
 
+
+/**
+ * print the result lines of the skipped chunks at the end of their file.
+ * the chunks stay deferred, as the following files may depend on them
+ */
+void
+cmd_run_print_deferred(Settings & settings, std::ostream & out)
+{
+    std::vector<DeferredChunk> & deferred = settings.result_cache->getDeferred();
+    for (std::vector<DeferredChunk>::iterator dit = deferred.begin(); dit != deferred.end(); ++dit) {
+        cmd_run_print_cached(out, *dit);
+    }
+}
+
+
+/**
+ * the chunks still skipped at the end of the run passed according to
+ * the result cache
+ */
+void
+cmd_run_drop_deferred(Settings & settings, std::ostream & out)
+{
+    std::vector<DeferredChunk> deferred;
+    settings.result_cache->takeDeferred(deferred);
+
+    for (std::vector<DeferredChunk>::iterator dit = deferred.begin(); dit != deferred.end(); ++dit) {
+        cmd_run_print_cached(out, *dit);
+        settings.result_cache->countHit();
+        if (settings.report) {
+            settings.report->add(*dit->chunk, true);
+        }
+        delete dit->chunk;
+    }
 }
 
+
 inline CommandRc
-cmd_run(Settings & settings, Chunk & chunk, Db & db)
+cmd_run(Settings & settings, std::ostream & out, Chunk & chunk, Db & db)
 {
-    if (settings.is_terminal) {
-        printf("RUN   [%d-%d] %s", chunk.start_line, chunk.end_line, chunk.getDescription().c_str());
+    ResultCache * cache = settings.result_cache;
+    hash_t cache_key = 0;
+    bool cached = false;
+
+    BaselineKey baseline_key;
+    if (settings.baseline) {
+        baseline_key = settings.baseline->nextKey(chunk);
+    }
+
+    if (cache) {
+        cache_key = cache->nextKey(chunk);
+        cached = cache->contains(cache_key);
+
+        if (cached && !cache->sampleForVerification()
+                && (cache->deferredBytes() < RESULT_CACHE_MAX_DEFERRED_BYTES)) {
+            // reported once it has been replayed or the file ended
+            cache->defer(chunk, cache_key);
+            return OK;
+        }
+
+        // this chunk may depend on the skipped ones
+        if (cmd_run_replay_cached(settings, out, db) != OK) {
+            return BREAK;
+        }
+    }
+
+    // the progress line is only useful when the output is not buffered
+    bool show_progress = settings.is_terminal && (settings.jobs == 1);
+    if (show_progress) {
+        out_printf(out, "RUN   [%" PRIu64 "-%" PRIu64 "] %s", chunk.start_line, chunk.end_line, chunk.getDescription().c_str());
+        // stdout of the server is buffered even when the client writes to a terminal
+        out.flush();
     }
 
     bool run_ok = db.runChunk(chunk);
-    if (settings.is_terminal) {
-        printf("\r");
+    if (show_progress) {
+        out_printf(out, "\r");
     }
 
-    if (run_ok) {
-        printf("%sOK%s  ", ansi_code(ANSI_GREEN), ansi_code(ANSI_RESET));
+    std::string note;
+    if (cache) {
+        if (run_ok) {
+            cache->store(cache_key);
+        }
+        else if (cached) {
+            cache->remove(cache_key);
+            note = " (cached result was stale)";
+        }
     }
-    else {
-        printf("%sFAIL%s", ansi_code(ANSI_RED), ansi_code(ANSI_RESET));
+
+    uint64_t baseline_ns;
+    if (settings.baseline && run_ok && settings.baseline->compare(chunk, baseline_key, baseline_ns)) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), " (slower than the baseline of %" PRIu64 ".%03" PRIu64 "s)",
+                    baseline_ns / 1000000000, (baseline_ns / 1000000) % 1000);
+        note.append(buf);
+    }
+    cmd_run_print_status(out, chunk, run_ok, note.c_str());
+    if (settings.report) {
+        settings.report->add(chunk, false);
     }
-    printf("  [%d-%d] [%ld.%03lds] %s\n", chunk.start_line,
-                chunk.end_line,
-                chunk.diagnostics.runtime.tv_sec,
-                chunk.diagnostics.runtime.tv_usec / 1000,
-                chunk.getDescription().c_str());
 
     if (!run_ok) {
-        cmd_run_print_diagnostics(settings, chunk);
+        cmd_run_print_diagnostics(settings, out, chunk);
         if (settings.abort_after_failed) {
-            printf("Chunk failed. Aborting.\n");
+            out_printf(out, "Chunk failed. Aborting.\n");
             return BREAK;
         }
     }
@@ -407,192 +969,1347 @@ cmd_run(Settings & settings, Chunk & chunk, Db & db)
 
 
 void
-print_header(Settings & settings, const char * filename)
+print_header(Settings & settings, std::ostream & out, const char * filename)
 {
     if (settings.print_filenames) {
-        printf("\n----[ File: %s%s%s\n", ansi_code(ANSI_GREEN), filename,
-                ansi_code(ANSI_RESET));
+        out << "\n----[ File: " << ansi_code(ANSI_GREEN) << filename
+            << ansi_code(ANSI_RESET) << "\n";
     }
 }
 
 
 CommandRc
-scan(Settings & settings, ChunkScanner & scanner, Db & db)
+scan(Settings & settings, ChunkSource & source, const char * filename, Db & db,
+            std::ostream & out, ChunkIndex * record_index)
 {
     Chunk chunk;
     CommandRc crc = OK;
 
-    while (scanner.nextChunk(chunk)) {
+    // no chunk after the last line can match the filters. the index
+    // needs all chunks of the file
+    linenumber_t last_line = record_index ? LINE_NUMBER_NOT_AVAILABLE
+                : settings.filterchain.lastLine();
+
+    // let the scanner reject chunks before it stores their sql
+    ChunkScanner * scanner = dynamic_cast<ChunkScanner *>(&source);
+    bool filtered_by_source = scanner && !record_index;
+
+    // the times are only shown by the commands running the chunks
+    bool timed = (settings.command == RUN) || (settings.command == WATCH);
+    if (filtered_by_source) {
+        scanner->setFilterChain(&settings.filterchain);
+        scanner->setTimed(timed);
+    }
+
+    // the time spent on rejected chunks is added to the next matching chunk
+    uint64_t scan_start = timed ? monotonic_ns() : 0;
+    uint64_t filter_ns = 0;
+
+    while (source.nextChunk(chunk)) {
+
+        if (settings.interrupted) {
+            crc = BREAK;
+            break;
+        }
+
+        if (record_index) {
+            record_index->addChunk(chunk);
+        }
+        bool passed_last_line = (last_line != LINE_NUMBER_NOT_AVAILABLE)
+                    && (chunk.end_line >= last_line);
 
         // skip non-matching chunks
-        if (!settings.filterchain.match(chunk)) {
-            continue;
+        if (!filtered_by_source) {
+            uint64_t filter_start = timed ? monotonic_ns() : 0;
+            bool matched = settings.filterchain.match(chunk);
+            if (timed) {
+                filter_ns += monotonic_ns() - filter_start;
+            }
+            if (!matched) {
+                if (passed_last_line) {
+                    break;
+                }
+                continue;
+            }
+            if (timed) {
+                chunk.diagnostics.times.ns[PHASE_FILTER] = filter_ns;
+                chunk.diagnostics.times.ns[PHASE_SCAN] = (monotonic_ns() - scan_start) - filter_ns;
+            }
         }
+        chunk.filename = filename;
 
         switch (settings.command) {
             case PRINT:
-                crc = cmd_print(chunk);
+                crc = cmd_print(out, chunk);
                 break;
             case LIST:
-                crc = cmd_list(chunk);
+                crc = cmd_list(out, chunk);
                 break;
             case RUN:
-                crc = cmd_run(settings, chunk, db);
+                // the chunk gets executed on the thread consuming the queue
+                if (settings.run_queue) {
+                    crc = settings.run_queue->push(chunk) ? OK : BREAK;
+                }
+                else {
+                    crc = cmd_run(settings, out, chunk, db);
+                }
+                break;
+            case WATCH:
+                // executed by watch_files once the file is scanned
+                settings.watch_chunks->push_back(new Chunk());
+                settings.watch_chunks->back()->copyOwned(chunk);
+                break;
+            case SERVE:
+                // does not scan files
                 break;
         }
 
-        if (crc != OK) {
+        if ((crc != OK) || passed_last_line) {
             break;
         }
+        if (timed) {
+            scan_start = monotonic_ns();
+            filter_ns = 0;
+        }
     }
     return crc;
 }
 
 
-int
-handle_files(Settings &settings, char * files[], int nufiles)
+/**
+ * scan a single file and execute the command on its chunks.
+ *
+ * returns false if the file could not be opened.
+ */
+bool
+process_file(Settings & settings, const char * filename, Db & db, std::ostream & out,
+            CommandRc & crc)
 {
-    CommandRc crc = OK;
-    int rc = RC_OK;
-    Db db;
+    if (strcmp(filename, "-") == 0) {
+        // read from stdin
+        print_header(settings, out, "stdin");
+        std::auto_ptr<Input> input(Input::openFd(STDIN_FILENO, false));
+        if (!input.get()) {
+            return false;
+        }
+        ChunkScanner chunkscanner(*input);
+        crc = scan(settings, chunkscanner, "stdin", db, out, NULL);
+    }
+    else {
+        print_header(settings, out, filename);
 
-    // allow signal handlers to access db
-    db_ptr = &db;
+        // open the file
+        std::auto_ptr<Input> input(Input::open(filename));
+        if (!input.get()) {
+            return false;
+        }
 
-    try {
-        // setup the database connection if the command
-        // requires one
-        if (settings.command == RUN) {
-            const char * password = NULL;
-            std::string prompt_passwd;
+        MappedInput * mapped = dynamic_cast<MappedInput *>(input.get());
+        if ((settings.use_index || settings.index_cache) && mapped) {
+            crc = scan_indexed(settings, filename, *mapped, db, out);
+        }
+        else {
+            ChunkScanner chunkscanner(*input);
+            crc = scan(settings, chunkscanner, filename, db, out, NULL);
+        }
+    }
 
-            if (settings.ask_pass) {
-                printf("Password: ");
-                prompt_passwd = read_password();
-                password = prompt_passwd.c_str();
-            }
+    // the chunks may still be queued, the thread running them prints the
+    // skipped ones once it reaches the end of the file
+    if ((settings.command == RUN) && (settings.result_cache != NULL)) {
+        if (settings.run_queue) {
+            settings.run_queue->pushFileEnd();
+        }
+        else {
+            cmd_run_print_deferred(settings, out);
+        }
+    }
+    return true;
+}
 
-            bool connected = db.connect(settings.db_host, settings.db_name,
-                                        settings.db_port, settings.db_user, password);
-            if (!connected) {
-                fprintf(stderr, "%s\n", db.getErrorMessage().c_str());
-                rc = RC_E_USAGE;
-            }
-            else {
-                if (settings.client_encoding != NULL) {
-                    if (!db.setEncoding(settings.client_encoding)) {
-                        fprintf(stderr, "Could not set encoding to %s.\n", settings.client_encoding);
-                        rc = RC_E_USAGE;
-                    }
-                }
-            }
 
-            db.setCommit(settings.commit_sql);
+/**
+ * use the index of the file when it is up to date, otherwise scan
+ * the file and write a new index. the server keeps the indexes in
+ * memory, the files are only written with --index.
+ */
+CommandRc
+scan_indexed(Settings & settings, const char * filename, MappedInput & input, Db & db,
+            std::ostream & out)
+{
+    IndexCache * cache = settings.index_cache;
+
+    // the sql is only read from the file when it is needed
+    bool with_sql = (settings.command != LIST) || settings.filterchain.needsSql();
+
+    if (cache) {
+        const ChunkIndex * cached = cache->find(filename, input);
+        if (cached) {
+            log_debug("using cached index of %s", filename);
+            return scan_index(settings, *cached, input, filename, db, out, with_sql);
         }
 
-        if (rc == RC_OK) {
-            for( int i = 0; ((i < nufiles) && (crc == OK)); i++ ) {
-                if (strcmp(files[i], "-") == 0) {
-                    // read from stdin
-                    print_header(settings, "stdin");
-                    ChunkScanner chunkscanner(std::cin);
-                    crc = scan(settings, chunkscanner, db);
-                }
-                else {
-                    print_header(settings, files[i]);
+        // later commands may need the sql
+        with_sql = true;
+    }
 
-                    // open the file
-                    std::ifstream is;
-                    is.open(files[i]);
+    std::string index_path;
+    if (settings.use_index) {
+        index_path = ChunkIndex::pathFor(filename, settings.index_dir);
+        std::auto_ptr<ChunkIndex> index(new ChunkIndex());
+        bool updated;
 
-                    if (is.fail()) {
-                        fprintf(stderr, "Could not open file \"%s\".\n", files[i]);
-                        rc = RC_E_USAGE;
-                        break;
-                    }
-                    ChunkScanner chunkscanner(is);
-                    crc = scan(settings, chunkscanner, db);
-                }
+        if (index->load(index_path, with_sql) && index->isValidFor(filename, input, updated)) {
+            log_debug("using index %s", index_path.c_str());
+            if (updated) {
+                index->saveMtime(index_path);
+            }
+
+            CommandRc crc = scan_index(settings, *index, input, filename, db, out, with_sql);
+            if (cache) {
+                cache->add(filename, index.release());
             }
+            return crc;
         }
-    }
-    catch (DbException &e) {
-        printf("Fatal error: %s\n", e.what());
-        rc = RC_E_DB;
+        log_debug("rebuilding index %s", index_path.c_str());
     }
 
-    // end message
-    if ((rc == RC_OK) && (settings.command == RUN)) {
-        if (db.getFailedCount() == 0) {
-            printf("\nAll chunks passed.\n");
-            if (settings.commit_sql) {
-                printf("%sCommit%s\n", ansi_code(ANSI_YELLOW), ansi_code(ANSI_RESET));
-            }
-            else {
-                printf("%sRollback%s\n", ansi_code(ANSI_YELLOW), ansi_code(ANSI_RESET));
-            }
+    std::auto_ptr<ChunkIndex> new_index(new ChunkIndex());
+    ChunkScanner chunkscanner(input);
+    CommandRc crc = scan(settings, chunkscanner, filename, db, out, new_index.get());
+
+    // an index of a partially scanned file is useless
+    if (chunkscanner.eof() && new_index->setFile(filename, input)) {
+        if (settings.use_index) {
+            new_index->save(index_path);
         }
-        else {
-            printf("\n%d chunks failed.\n", db.getFailedCount());
-            rc = RC_E_SQL;
-            printf("%sRollback%s\n", ansi_code(ANSI_YELLOW), ansi_code(ANSI_RESET));
+        if (cache) {
+            cache->add(filename, new_index.release());
         }
     }
-
-    db_ptr = NULL;
-    return rc;
+    return crc;
 }
 
 
-template <class T>
-void
-add_filter(FilterChain &filterchain, const char * params)
+CommandRc
+scan_index(Settings & settings, const ChunkIndex & index, MappedInput & input,
+            const char * filename, Db & db, std::ostream & out, bool with_sql)
 {
-    T * filter = new T();
-    std::string errmsg;
-    if (!filter->setParams(params, errmsg)) {
-        delete filter;
-        quit(errmsg.c_str());
+    IndexReader reader(index, input, with_sql);
+    linenumber_t first_line = settings.filterchain.firstLine();
+    if (first_line != LINE_NUMBER_NOT_AVAILABLE) {
+        reader.seekLine(first_line);
     }
-    filterchain.addFilter(filter);
+    return scan(settings, reader, filename, db, out, NULL);
 }
 
 
-int
-main(int argc, char * argv[] )
+/**
+ * scans a file on a thread of the WorkerPool and buffers the output
+ */
+class ScanTask : public Task
 {
-    Settings settings;
-    settings_ptr = &settings;
+    public:
+        Settings & settings;
+        const char * filename;
+        std::ostringstream output;
+        CommandRc crc;
+        bool opened;
+
+        ScanTask(Settings & _settings, const char * _filename)
+            : Task(), settings(_settings), filename(_filename), output(),
+              crc(OK), opened(false)
+        {
+        };
+
+        void run(unsigned int worker_id)
+        {
+            UNUSED_PARAMETER(worker_id);
+
+            // list and print do not use the database
+            Db db;
+            opened = process_file(settings, filename, db, output, crc);
+        }
+};
 
-    // register signal handler
-    struct sigaction sigint_act, o_sigint_act;
-    sigint_act.sa_handler = handle_sigint;
-    sigemptyset(&sigint_act.sa_mask);
-    sigint_act.sa_flags = 0;
-    if (sigaction(SIGINT, &sigint_act, &o_sigint_act) != 0) {
-        log_error("could not register sigint handler");
-        return RC_E_OTHER;
-    }
 
-    // use is_terminal output if run in a shell
-    if (isatty(fileno(stdout)) == 1) {
-        settings.is_terminal = true;
-        // disable output buffering
-        setvbuf(stdout, NULL, _IONBF, BUFSIZ);
-    };
+/**
+ * scans a range of a large file. see split_input
+ */
+class RangeScanTask : public ScanTask
+{
+    public:
+        const MappedInput & input;
+        InputRange range;
+
+        RangeScanTask(Settings & _settings, const char * _filename, const MappedInput & _input,
+                    const InputRange & _range)
+            : ScanTask(_settings, _filename), input(_input), range(_range)
+        {
+            opened = true;
+        };
+
+        void run(unsigned int worker_id)
+        {
+            UNUSED_PARAMETER(worker_id);
+
+            if (range.start == 0) {
+                print_header(settings, output, filename);
+            }
 
-    // read options
-    char opt;
-    while ( (opt = getopt(argc, argv, "l:p:U:d:h:WCaFE:L:S:I:")) != -1) {
-        switch (opt) {
-            case 'p': /* port */
-                settings.db_port = optarg;
-                break;
-            case 'U': /* username */
-                settings.db_user = optarg;
-                break;
-            case 'd':
-                settings.db_name = optarg;
+            MemoryInput range_input(input.data() + range.start, range.end - range.start,
+                        range.start);
+            ChunkScanner chunkscanner(range_input);
+            if (range.start != 0) {
+                chunkscanner.startAtSplitPoint(range.first_line);
+            }
+
+            Db db;
+            crc = scan(settings, chunkscanner, filename, db, output, NULL);
+        }
+};
+
+
+/**
+ * the database connections of a parallel run, one per worker thread. with
+ * a template the connection of a worker is opened with its first file, so
+ * it does not wait for the databases of the other workers.
+ */
+struct RunConnections
+{
+    std::vector<Db*> dbs;
+
+    /** one flag per worker, only accessed by the worker */
+    std::vector<char> connected;
+
+    const char * password;
+    TemplateClones * clones;
+
+    RunConnections() : dbs(), connected(), password(NULL), clones(NULL) {};
+};
+
+
+/**
+ * runs a file on the database connection of the worker thread and
+ * buffers the output
+ */
+class RunTask : public ScanTask
+{
+    public:
+        RunConnections & connections;
+
+        /** false when the task was skipped because an other file failed */
+        bool started;
+        std::string fatal_error;
+        int connect_rc;
+        unsigned int failed_count;
+
+        RunTask(Settings & _settings, const char * _filename, RunConnections & _connections)
+            : ScanTask(_settings, _filename), connections(_connections), started(false),
+              fatal_error(), connect_rc(RC_OK), failed_count(0)
+        {
+        };
+
+        void run(unsigned int worker_id)
+        {
+            if (settings.abort_run || settings.interrupted) {
+                return;
+            }
+            started = true;
+
+            Db & db = *connections.dbs[worker_id];
+            if (!connections.connected[worker_id]) {
+                connect_rc = connect_run_db(settings, db, connections.clones, worker_id,
+                            connections.password);
+                if (connect_rc != RC_OK) {
+                    settings.abort_run = true;
+                    return;
+                }
+                connections.connected[worker_id] = 1;
+            }
+
+            try {
+                unsigned int failed_before = db.getFailedCount();
+                opened = process_file(settings, filename, db, output, crc);
+                failed_count = db.getFailedCount() - failed_before;
+
+                // without commit each file gets its own transaction. the
+                // files of a connection share it when they get committed
+                if (!settings.commit_sql) {
+                    db.finish();
+                }
+            }
+            catch (DbException &e) {
+                fatal_error = e.what();
+            }
+
+            // the files which are already running are completed, so
+            // the output only contains complete files
+            if (!opened || (crc != OK) || !fatal_error.empty()) {
+                settings.abort_run = true;
+            }
+        }
+};
+
+
+/**
+ * split a large file into ranges which can be scanned in parallel.
+ * returns false if the file is not split.
+ */
+bool
+split_file(Settings & settings, const char * filename, std::vector<Task*> & tasks,
+            std::vector<Input*> & inputs)
+{
+    // the index already avoids scanning the file
+    if (settings.use_index || settings.index_cache || (strcmp(filename, "-") == 0)) {
+        return false;
+    }
+
+    struct stat st;
+    if ((stat(filename, &st) != 0) || !S_ISREG(st.st_mode)
+                || (static_cast<uint64_t>(st.st_size) < (2 * SPLIT_RANGE_SIZE))) {
+        return false;
+    }
+
+    std::auto_ptr<Input> input(Input::open(filename));
+    MappedInput * mapped = dynamic_cast<MappedInput *>(input.get());
+    if (!mapped) {
+        return false;
+    }
+
+    std::vector<InputRange> ranges;
+    split_input(*mapped, SPLIT_RANGE_SIZE, settings.jobs, ranges);
+    if (ranges.size() < 2) {
+        return false;
+    }
+
+    // ranges without lines the filters ask for are not scanned. the
+    // first range prints the header of the file
+    linenumber_t first_line = settings.filterchain.firstLine();
+    linenumber_t last_line = settings.filterchain.lastLine();
+    for (size_t r = 0; r < ranges.size(); r++) {
+        bool ends_before = ((r + 1) < ranges.size()) && (ranges[r + 1].first_line <= first_line);
+        bool starts_after = (last_line != LINE_NUMBER_NOT_AVAILABLE)
+                    && (ranges[r].first_line > last_line);
+        if ((r > 0) && (ends_before || starts_after)) {
+            continue;
+        }
+        tasks.push_back(new RangeScanTask(settings, filename, *mapped, ranges[r]));
+    }
+    inputs.push_back(input.release());
+    return true;
+}
+
+
+/**
+ * handle the files on multiple threads. the output is written in the
+ * order of the files, so it does not differ from handle_files.
+ * only usable for commands which do not access the database.
+ */
+int
+handle_files_parallel(Settings &settings, char * files[], int nufiles)
+{
+    int rc = RC_OK;
+
+    std::vector<Task*> tasks;
+    std::vector<Input*> inputs;
+    for (int i = 0; i < nufiles; i++) {
+        if (!split_file(settings, files[i], tasks, inputs)) {
+            tasks.push_back(new ScanTask(settings, files[i]));
+        }
+    }
+
+    WorkerPool pool(settings.jobs);
+    pool.start(tasks);
+
+    Task * task;
+    while ((task = pool.next()) != NULL) {
+        ScanTask * stask = static_cast<ScanTask *>(task);
+
+        std::string output = stask->output.str();
+        fwrite(output.data(), 1, output.size(), stdout);
+
+        if (!stask->opened) {
+            fprintf(stderr, "Could not open file \"%s\".\n", stask->filename);
+            rc = RC_E_USAGE;
+        }
+        if ((rc != RC_OK) || (stask->crc != OK)) {
+            pool.cancel();
+            break;
+        }
+    }
+    pool.join();
+    fflush(stdout);
+
+    for (std::vector<Task*>::iterator tit = tasks.begin(); tit != tasks.end(); ++tit) {
+        delete *tit;
+    }
+    for (std::vector<Input*>::iterator iit = inputs.begin(); iit != inputs.end(); ++iit) {
+        delete *iit;
+    }
+    return rc;
+}
+
+
+/**
+ * scans the files of the run command on a separate thread and hands the
+ * matching chunks to the thread executing them, so the next chunks get
+ * scanned while the database is busy. the scanning continues with the next
+ * file while the chunks of the current one are executed.
+ */
+class RunProducer
+{
+    private:
+        RunProducer(const RunProducer&);
+        RunProducer& operator=(const RunProducer&);
+
+        Settings & settings;
+        char ** files;
+        int nufiles;
+        pthread_t thread;
+        bool started;
+
+        static void * threadMain(void * arg)
+        {
+            static_cast<RunProducer *>(arg)->produce();
+            return NULL;
+        }
+
+        void produce()
+        {
+            // only used to run chunks, which the queue does instead
+            Db db;
+
+            for (int i = 0; i < nufiles; i++) {
+                CommandRc crc = OK;
+                if (!process_file(settings, files[i], db, queue.output(), crc)) {
+                    failed_file = files[i];
+                    break;
+                }
+                if (crc != OK) {
+                    break;
+                }
+            }
+            queue.close();
+        }
+
+    public:
+        ChunkQueue queue;
+
+        /** the file which could not be opened */
+        const char * failed_file;
+
+        RunProducer(Settings & _settings, char * _files[], int _nufiles)
+            : settings(_settings), files(_files), nufiles(_nufiles), thread(),
+              started(false), queue(), failed_file(NULL)
+        {
+        };
+
+        ~RunProducer()
+        {
+            stop();
+        }
+
+        void start()
+        {
+            settings.run_queue = &queue;
+            if (pthread_create(&thread, NULL, threadMain, this) != 0) {
+                log_error("could not create scanning thread");
+                abort();
+            }
+            started = true;
+        }
+
+        /** wait for the scanning thread. it gets canceled when it is not done */
+        void stop()
+        {
+            if (started) {
+                queue.cancel();
+                pthread_join(thread, NULL);
+                started = false;
+            }
+            settings.run_queue = NULL;
+        }
+};
+
+
+/**
+ * execute the chunks of the files while the files are scanned on an other
+ * thread. see RunProducer
+ */
+int
+run_files(Settings & settings, char * files[], int nufiles, Db & db)
+{
+    RunProducer producer(settings, files, nufiles);
+    producer.start();
+
+    CommandRc crc = OK;
+    std::string output;
+    Chunk * chunk;
+    while ((crc == OK) && !settings.interrupted && producer.queue.pop(output, chunk)) {
+        std::auto_ptr<Chunk> owned_chunk(chunk);
+
+        std::cout << output;
+        if (chunk) {
+            crc = cmd_run(settings, std::cout, *chunk, db);
+        }
+        else if (settings.result_cache != NULL) {
+            // the end of a file
+            cmd_run_print_deferred(settings, std::cout);
+        }
+    }
+    producer.stop();
+
+    if ((crc == OK) && producer.failed_file) {
+        fprintf(stderr, "Could not open file \"%s\".\n", producer.failed_file);
+        return RC_E_USAGE;
+    }
+    return RC_OK;
+}
+
+
+/**
+ * run the files, then run the changed chunks again whenever the files
+ * change. only returns on errors, the watching ends with SIGINT.
+ */
+int
+watch_files(Settings & settings, char * files[], int nufiles)
+{
+    int rc = RC_OK;
+    FileWatcher watcher;
+    std::vector<WatchedFile*> watched;
+    for (int i = 0; (i < nufiles) && (rc == RC_OK); i++) {
+        watched.push_back(new WatchedFile(files[i]));
+        if (!watcher.add(files[i]) || !watch_scan(settings, *watched.back())) {
+            fprintf(stderr, "Could not watch file \"%s\".\n", files[i]);
+            rc = RC_E_USAGE;
+        }
+    }
+
+    Db db;
+    set_db_ptrs(std::vector<Db*>(1, &db));
+
+    if (rc == RC_OK) {
+        std::string prompt_passwd;
+        const char * password = NULL;
+        if (settings.ask_pass) {
+            printf("Password: ");
+            prompt_passwd = read_password();
+            password = prompt_passwd.c_str();
+        }
+        rc = connect_run_db(settings, db, NULL, 0, password);
+    }
+
+    try {
+        // one flag per executed chunk, in the order they were run
+        std::vector<char> failed;
+        CommandRc crc = OK;
+        if (rc == RC_OK) {
+            PhaseTimes times;
+            ResourceUsage resources;
+            crc = watch_run(settings, db, watched, 0, failed, times, resources);
+            print_watch_summary(failed, times, resources);
+        }
+
+        std::vector<std::string> changed;
+        while ((rc == RC_OK) && watcher.wait(changed)) {
+            // the position of the first chunk which differs from the last run
+            size_t start = SIZE_MAX;
+            size_t position = 0;
+            for (std::vector<WatchedFile*>::iterator wit = watched.begin(); wit != watched.end(); ++wit) {
+                WatchedFile & file = **wit;
+                if (std::find(changed.begin(), changed.end(), file.filename) != changed.end()) {
+                    std::vector<hash_t> old_hashes;
+                    for (size_t c = 0; c < file.chunks.size(); c++) {
+                        old_hashes.push_back(file.chunks[c]->getSqlHash());
+                    }
+
+                    // the file may be replaced in the meantime, the next change follows
+                    if (!watch_scan(settings, file)) {
+                        fprintf(stderr, "Could not open file \"%s\".\n", file.filename);
+                    }
+
+                    size_t c = 0;
+                    while ((c < file.chunks.size()) && (c < old_hashes.size())
+                                && (file.chunks[c]->getSqlHash() == old_hashes[c])) {
+                        c++;
+                    }
+                    if ((c < file.chunks.size()) || (c < old_hashes.size())) {
+                        start = std::min(start, position + c);
+                    }
+                }
+                position += file.chunks.size();
+            }
+
+            out_printf(std::cout, "\n%sChanged:", ansi_code(ANSI_YELLOW));
+            for (std::vector<std::string>::iterator cit = changed.begin(); cit != changed.end(); ++cit) {
+                out_printf(std::cout, " %s", cit->c_str());
+            }
+            out_printf(std::cout, "%s\n", ansi_code(ANSI_RESET));
+
+            // with -a nothing after the failed chunk has been run
+            size_t executed = failed.size();
+            if ((start == SIZE_MAX) || ((crc != OK) && (start >= executed))) {
+                out_printf(std::cout, "No chunks to run again.\n");
+                continue;
+            }
+            if (start < executed) {
+                db.rollbackToSavepoint(watch_savepoint(start));
+            }
+            if (start > 0) {
+                out_printf(std::cout, "Skipping %lu unchanged chunks.\n",
+                            static_cast<unsigned long>(start));
+            }
+            PhaseTimes times;
+            ResourceUsage resources;
+            crc = watch_run(settings, db, watched, start, failed, times, resources);
+            print_watch_summary(failed, times, resources);
+        }
+        if (rc == RC_OK) {
+            rc = RC_E_OTHER;
+        }
+    }
+    catch (DbException &e) {
+        printf("Fatal error: %s\n", e.what());
+        rc = RC_E_DB;
+    }
+
+    set_db_ptrs(std::vector<Db*>());
+    for (std::vector<WatchedFile*>::iterator wit = watched.begin(); wit != watched.end(); ++wit) {
+        delete *wit;
+    }
+    return rc;
+}
+
+
+/**
+ * scan the file and replace its chunks. the chunks are kept when
+ * the file can not be opened
+ */
+bool
+watch_scan(Settings & settings, WatchedFile & file)
+{
+    std::vector<Chunk*> chunks;
+    settings.watch_chunks = &chunks;
+
+    // the header gets printed when the chunks are run
+    std::ostringstream header;
+    Db db;
+    CommandRc crc = OK;
+    bool opened = process_file(settings, file.filename, db, header, crc);
+    settings.watch_chunks = NULL;
+
+    if (opened) {
+        file.clear();
+        file.chunks.swap(chunks);
+    }
+    for (std::vector<Chunk*>::iterator cit = chunks.begin(); cit != chunks.end(); ++cit) {
+        delete *cit;
+    }
+    return opened;
+}
+
+
+/**
+ * run the chunks of the files starting with the chunk at the given
+ * position, counted over all files. failed gets a flag for every chunk run,
+ * times and resources the totals of them.
+ */
+CommandRc
+watch_run(Settings & settings, Db & db, std::vector<WatchedFile*> & files, size_t start,
+            std::vector<char> & failed, PhaseTimes & times, ResourceUsage & resources)
+{
+    CommandRc crc = OK;
+    size_t position = 0;
+
+    // the savepoint of the start is kept by rolling back to it
+    bool start_savepoint_kept = (start < failed.size());
+    failed.resize(start);
+
+    for (std::vector<WatchedFile*>::iterator wit = files.begin(); (wit != files.end()) && (crc == OK); ++wit) {
+        std::vector<Chunk*> & chunks = (*wit)->chunks;
+
+        // files before the start are skipped completely
+        if ((position < start) && ((position + chunks.size()) <= start)) {
+            position += chunks.size();
+            continue;
+        }
+
+        print_header(settings, std::cout, (*wit)->filename);
+        size_t c = (start > position) ? (start - position) : 0;
+        for (; (c < chunks.size()) && (crc == OK); c++) {
+            // a later change rolls back to the state before this chunk
+            if (!start_savepoint_kept || ((position + c) != start)) {
+                db.setSavepoint(watch_savepoint(position + c));
+            }
+            crc = cmd_run(settings, std::cout, *chunks[c], db);
+            failed.push_back(chunks[c]->diagnostics.status != Diagnostics::Ok);
+            times.add(chunks[c]->diagnostics.times);
+            resources.add(chunks[c]->diagnostics.resources);
+        }
+        position += chunks.size();
+    }
+    return crc;
+}
+
+
+std::string
+watch_savepoint(size_t position)
+{
+    std::stringstream name;
+    name << "psqlchunks_watch_" << position;
+    return name.str();
+}
+
+
+void
+print_watch_summary(const std::vector<char> & failed, const PhaseTimes & times,
+            const ResourceUsage & resources)
+{
+    size_t failed_count = std::count(failed.begin(), failed.end(), 1);
+    if (failed_count == 0) {
+        printf("\nAll chunks passed.\n");
+    }
+    else {
+        printf("\n%lu chunks failed.\n", static_cast<unsigned long>(failed_count));
+    }
+    print_totals(times, resources);
+    printf("%sWaiting for changes.%s\n", ansi_code(ANSI_YELLOW), ansi_code(ANSI_RESET));
+}
+
+
+/**
+ * run the files on multiple database connections. each file runs in its
+ * own transaction, which is rolled back. with commit the files of a worker
+ * thread share the transaction of its connection, which is only commited
+ * when all chunks of all files passed. the output of each file is printed
+ * as one block in the order of the files.
+ */
+int
+handle_files_run_parallel(Settings &settings, char * files[], int nufiles)
+{
+    int rc = RC_OK;
+    unsigned int failed_count = 0;
+    PhaseTimes times;
+    ResourceUsage resources;
+    unsigned int nconnections = std::min(settings.jobs, static_cast<unsigned int>(nufiles));
+
+    RunConnections connections;
+    std::vector<Db*> & dbs = connections.dbs;
+    for (unsigned int i = 0; i < nconnections; i++) {
+        dbs.push_back(take_db(settings));
+    }
+    connections.connected.assign(nconnections, 0);
+
+    // allow signal handlers to access the connections
+    set_db_ptrs(dbs);
+
+    std::string prompt_passwd;
+    if (settings.ask_pass) {
+        printf("Password: ");
+        prompt_passwd = read_password();
+        connections.password = prompt_passwd.c_str();
+    }
+
+    // the workers connect to their databases once they are created
+    std::auto_ptr<TemplateClones> clones;
+    if (settings.template_db != NULL) {
+        clones.reset(new TemplateClones(settings.template_db));
+        rc = start_clones(settings, *clones, nconnections, connections.password);
+        connections.clones = clones.get();
+    }
+    else {
+        for (unsigned int i = 0; (i < nconnections) && (rc == RC_OK); i++) {
+            rc = connect_run_db(settings, *dbs[i], NULL, i, connections.password);
+            connections.connected[i] = (rc == RC_OK);
+        }
+    }
+
+    if (rc == RC_OK) {
+        std::vector<Task*> tasks;
+        for (int i = 0; i < nufiles; i++) {
+            tasks.push_back(new RunTask(settings, files[i], connections));
+        }
+
+        // the output is buffered, so no file has to wait for the ones before it
+        WorkerPool pool(nconnections, tasks.size());
+        pool.start(tasks);
+
+        Task * task;
+        while ((task = pool.next()) != NULL) {
+            RunTask * rtask = static_cast<RunTask *>(task);
+
+            std::string output = rtask->output.str();
+            fwrite(output.data(), 1, output.size(), stdout);
+
+            if (!rtask->started) {
+                continue;
+            }
+            failed_count += rtask->failed_count;
+            if (rtask->connect_rc != RC_OK) {
+                rc = rtask->connect_rc;
+            }
+            else if (!rtask->fatal_error.empty()) {
+                printf("Fatal error: %s\n", rtask->fatal_error.c_str());
+                rc = RC_E_DB;
+            }
+            else if (!rtask->opened) {
+                fprintf(stderr, "Could not open file \"%s\".\n", rtask->filename);
+                rc = RC_E_USAGE;
+            }
+        }
+        pool.join();
+        fflush(stdout);
+
+        for (std::vector<Task*>::iterator tit = tasks.begin(); tit != tasks.end(); ++tit) {
+            delete *tit;
+        }
+
+        for (std::vector<Db*>::iterator dit = dbs.begin(); dit != dbs.end(); ++dit) {
+            times.add((*dit)->getTimes());
+            resources.add((*dit)->getResources());
+        }
+
+        // commit only when every worker succeeded
+        bool commit = settings.commit_sql && (rc == RC_OK) && (failed_count == 0)
+                    && !settings.interrupted;
+        try {
+            for (std::vector<Db*>::iterator dit = dbs.begin(); (dit != dbs.end()) && !clones.get(); ++dit) {
+                (*dit)->setCommit(commit);
+                (*dit)->finish();
+            }
+        }
+        catch (DbException &e) {
+            printf("Fatal error: %s\n", e.what());
+            rc = RC_E_DB;
+        }
+    }
+
+    if (rc == RC_OK) {
+        rc = print_run_summary(settings, failed_count, times, resources);
+    }
+
+    set_db_ptrs(std::vector<Db*>());
+    for (std::vector<Db*>::iterator dit = dbs.begin(); dit != dbs.end(); ++dit) {
+        // the changes get dropped with the database
+        if (clones.get()) {
+            (*dit)->abandon();
+        }
+        release_db(settings, *dit);
+    }
+    if (clones.get()) {
+        drop_clones(*clones);
+    }
+    return rc;
+}
+
+
+int
+handle_files(Settings &settings, char * files[], int nufiles)
+{
+    CommandRc crc = OK;
+    int rc = RC_OK;
+    Db * db = (settings.command == RUN) ? take_db(settings) : new Db();
+    std::auto_ptr<ResultCache> result_cache;
+    std::auto_ptr<TemplateClones> clones;
+
+    // allow signal handlers to access db
+    set_db_ptrs(std::vector<Db*>(1, db));
+
+    try {
+        // setup the database connection if the command
+        // requires one
+        if (settings.command == RUN) {
+            const char * password = NULL;
+            std::string prompt_passwd;
+
+            if (settings.ask_pass) {
+                printf("Password: ");
+                prompt_passwd = read_password();
+                password = prompt_passwd.c_str();
+            }
+
+            if (settings.template_db != NULL) {
+                clones.reset(new TemplateClones(settings.template_db));
+                rc = start_clones(settings, *clones, 1, password);
+            }
+            if (rc == RC_OK) {
+                rc = connect_run_db(settings, *db, clones.get(), 0, password);
+            }
+
+            if ((rc == RC_OK) && (settings.result_cache_dir != NULL)) {
+                result_cache.reset(new ResultCache(settings.result_cache_dir,
+                                    settings.cache_verify_ratio));
+                if (!result_cache->init(db->getServerFingerprint())) {
+                    fprintf(stderr, "Could not use the result cache in \"%s\".\n",
+                                settings.result_cache_dir);
+                    rc = RC_E_USAGE;
+                }
+                settings.result_cache = result_cache.get();
+            }
+        }
+
+        if ((rc == RC_OK) && (settings.command == RUN)) {
+            rc = run_files(settings, files, nufiles, *db);
+        }
+        else if (rc == RC_OK) {
+            for( int i = 0; ((i < nufiles) && (crc == OK)); i++ ) {
+                if (!process_file(settings, files[i], *db, std::cout, crc)) {
+                    fprintf(stderr, "Could not open file \"%s\".\n", files[i]);
+                    rc = RC_E_USAGE;
+                    break;
+                }
+            }
+        }
+    }
+    catch (DbException &e) {
+        printf("Fatal error: %s\n", e.what());
+        rc = RC_E_DB;
+    }
+
+    if (settings.result_cache != NULL) {
+        cmd_run_drop_deferred(settings, std::cout);
+    }
+
+    // end message
+    if ((rc == RC_OK) && (settings.command == RUN)) {
+        rc = print_run_summary(settings, db->getFailedCount(), db->getTimes(),
+                        db->getResources());
+    }
+
+    settings.result_cache = NULL;
+    set_db_ptrs(std::vector<Db*>());
+
+    // the changes get dropped with the database
+    if (clones.get()) {
+        db->abandon();
+        drop_clones(*clones);
+    }
+    release_db(settings, db);
+    return rc;
+}
+
+
+/**
+ * connect to the database and set the client encoding. returns
+ * RC_OK on success
+ */
+int
+connect_db(Settings & settings, Db & db, const char * db_name, const char * password)
+{
+    // the connections of the server are already connected
+    if (!db.isConnected()) {
+        bool connected = db.connect(settings.db_host, db_name,
+                                    settings.db_port, settings.db_user, password);
+        if (!connected) {
+            fprintf(stderr, "%s\n", db.getErrorMessage().c_str());
+            return RC_E_USAGE;
+        }
+    }
+
+    if (settings.client_encoding != NULL) {
+        if (!db.setEncoding(settings.client_encoding)) {
+            fprintf(stderr, "Could not set encoding to %s.\n", settings.client_encoding);
+            return RC_E_USAGE;
+        }
+    }
+    return RC_OK;
+}
+
+
+/**
+ * the connection parameters of the settings. the server only reuses
+ * connections with the same key
+ */
+std::string
+connection_key(Settings & settings)
+{
+    const char * params[] = {settings.db_host, settings.db_port, settings.db_user,
+                settings.db_name, settings.client_encoding};
+    std::string key;
+    for (size_t i = 0; i < (sizeof(params) / sizeof(params[0])); i++) {
+        if (params[i]) {
+            key.append(params[i]);
+        }
+        key.push_back('\0');
+    }
+    return key;
+}
+
+
+/**
+ * a connection for running chunks. the server hands out an idle connection
+ * when it has one
+ */
+Db *
+take_db(Settings & settings)
+{
+    Db * db = NULL;
+
+    // the clones of a template get dropped after the run
+    if (settings.connection_pool && (settings.template_db == NULL)) {
+        db = settings.connection_pool->take(connection_key(settings));
+    }
+    return db ? db : new Db();
+}
+
+
+/**
+ * end the transaction and close the connection. the server keeps it
+ * for the next request
+ */
+void
+release_db(Settings & settings, Db * db)
+{
+    if (settings.interrupted) {
+        db->setCommit(false);
+    }
+
+    if (settings.connection_pool && (settings.template_db == NULL) && db->isConnected()) {
+        try {
+            db->finish();
+            settings.connection_pool->put(connection_key(settings), db);
+            return;
+        }
+        catch (DbException &e) {
+            log_debug("not keeping the connection: %s", e.what());
+            db->abandon();
+        }
+    }
+    delete db;
+}
+
+
+/**
+ * connect to the database the chunks are run in. with a template this
+ * is the clone with the given index, which may still be created.
+ */
+int
+connect_run_db(Settings & settings, Db & db, TemplateClones * clones, size_t clone_index,
+            const char * password)
+{
+    const char * db_name = settings.db_name;
+    std::string clone_name;
+    if (clones) {
+        std::string errmsg;
+        if (!clones->wait(clone_index, clone_name, errmsg)) {
+            fprintf(stderr, "Could not create a database from the template \"%s\": %s\n",
+                        settings.template_db, errmsg.c_str());
+            return RC_E_DB;
+        }
+        db_name = clone_name.c_str();
+    }
+
+    int rc = connect_db(settings, db, db_name, password);
+    db.clearTotals();
+    db.setCommit(settings.commit_sql);
+    db.setPipeline(settings.pipeline);
+    if (rc == RC_OK) {
+        db.setResourceAccounting(settings.account_resources);
+    }
+    return rc;
+}
+
+
+/**
+ * start creating the databases the chunks are run in from the template.
+ * the clones are created from the database given with -d
+ */
+int
+start_clones(Settings & settings, TemplateClones & clones, size_t count, const char * password)
+{
+    if (!clones.connect(settings.db_host, settings.db_name, settings.db_port,
+                settings.db_user, password)) {
+        fprintf(stderr, "%s\n", clones.getErrorMessage().c_str());
+        return RC_E_USAGE;
+    }
+    clones.start(count);
+    return RC_OK;
+}
+
+
+void
+drop_clones(TemplateClones & clones)
+{
+    std::string errmsg;
+    if (!clones.dropAll(errmsg)) {
+        fprintf(stderr, "Could not drop the databases created from the template: %s\n",
+                    errmsg.c_str());
+    }
+}
+
+
+/**
+ * print the end message of the run command
+ */
+int
+print_run_summary(Settings & settings, unsigned int failed_count, const PhaseTimes & times,
+            const ResourceUsage & resources)
+{
+    int rc = RC_OK;
+
+    if ((settings.result_cache != NULL) && (settings.result_cache->getHitCount() > 0)) {
+        printf("\n%u chunks passed according to the result cache.",
+                    settings.result_cache->getHitCount());
+    }
+    if (settings.interrupted) {
+        printf("\nInterrupted, %u chunks failed.\n", failed_count);
+        print_totals(times, resources);
+        printf("%sRollback%s\n", ansi_code(ANSI_YELLOW), ansi_code(ANSI_RESET));
+    }
+    else if (failed_count == 0) {
+        printf("\nAll chunks passed.\n");
+        print_totals(times, resources);
+        if (settings.commit_sql) {
+            printf("%sCommit%s\n", ansi_code(ANSI_YELLOW), ansi_code(ANSI_RESET));
+        }
+        else {
+            printf("%sRollback%s\n", ansi_code(ANSI_YELLOW), ansi_code(ANSI_RESET));
+        }
+    }
+    else {
+        printf("\n%d chunks failed.\n", failed_count);
+        print_totals(times, resources);
+        rc = RC_E_SQL;
+        printf("%sRollback%s\n", ansi_code(ANSI_YELLOW), ansi_code(ANSI_RESET));
+    }
+
+    // updating the baseline accepts the slower chunks
+    if ((settings.baseline != NULL) && (settings.baseline->getRegressedCount() > 0)) {
+        printf("%s%u chunks got slower than the baseline.%s\n", ansi_code(ANSI_RED),
+                    settings.baseline->getRegressedCount(), ansi_code(ANSI_RESET));
+        if ((rc == RC_OK) && !settings.update_baseline) {
+            rc = RC_E_REGRESSION;
+        }
+    }
+    return rc;
+}
+
+
+/**
+ * print the time spent in each phase of the chunks which were run and
+ * the resources they used, when they were measured
+ */
+void
+print_totals(const PhaseTimes & times, const ResourceUsage & resources)
+{
+    printf("Time:");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        printf("%s %s %.3fms", (p > 0) ? "," : "", phase_name(static_cast<TimingPhase>(p)),
+                    times.ns[p] / 1e6);
+    }
+    printf("\n");
+
+    if (resources.measured) {
+        printf("Resources: %s\n", format_resources(resources).c_str());
+    }
+}
+
+
+/**
+ * a size in bytes with a unit
+ */
+std::string
+format_bytes(int64_t bytes)
+{
+    static const char * units[] = {"B", "kB", "MB", "GB", "TB"};
+
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while ((fabs(value) >= 1024.0) && (unit < ((sizeof(units) / sizeof(units[0])) - 1))) {
+        value /= 1024.0;
+        unit++;
+    }
+
+    char buf[32];
+    if (unit == 0) {
+        snprintf(buf, sizeof(buf), "%" PRId64 "%s", bytes, units[unit]);
+    }
+    else {
+        snprintf(buf, sizeof(buf), "%.1f%s", value, units[unit]);
+    }
+    return std::string(buf);
+}
+
+
+/**
+ * the counters of the server in one line. the counters which are not
+ * available are left out, the local buffers when no temporary table was used
+ */
+std::string
+format_resources(const ResourceUsage & resources)
+{
+    std::stringstream line;
+    if (resources.wal_bytes != RESOURCE_NOT_AVAILABLE) {
+        line << "wal " << format_bytes(resources.wal_bytes) << ", ";
+    }
+    line << "shared " << resources.shared_hit << " hit " << resources.shared_read << " read, ";
+    if ((resources.local_hit != 0) || (resources.local_read != 0)) {
+        line << "local " << resources.local_hit << " hit " << resources.local_read << " read, ";
+    }
+    line << "rows " << resources.rows;
+    if (resources.memory_bytes != RESOURCE_NOT_AVAILABLE) {
+        line << ", memory " << format_bytes(resources.memory_bytes);
+    }
+    return line.str();
+}
+
+
+template <class T>
+void
+add_filter(FilterChain &filterchain, const char * params)
+{
+    T * filter = new T();
+    std::string errmsg;
+    if (!filter->setParams(params, errmsg)) {
+        delete filter;
+        quit(errmsg.c_str());
+    }
+    filterchain.addFilter(filter);
+}
+
+
+/**
+ * read the options and the command. returns the index of the first file.
+ * exits on invalid arguments, while the server handles a request a
+ * UsageError is thrown instead.
+ */
+int
+parse_args(Settings & settings, int argc, char * argv[])
+{
+    // read options
+    static struct option long_options[] = {
+        {"index",       no_argument,        NULL, OPT_INDEX},
+        {"index-dir",   required_argument,  NULL, OPT_INDEX_DIR},
+        {"result-cache", required_argument, NULL, OPT_RESULT_CACHE},
+        {"cache-verify", required_argument, NULL, OPT_CACHE_VERIFY},
+        {"filter-stats", no_argument,       NULL, OPT_FILTER_STATS},
+        {"pipeline",    no_argument,        NULL, OPT_PIPELINE},
+        {"template",    required_argument,  NULL, OPT_TEMPLATE},
+        {"socket",      required_argument,  NULL, OPT_SOCKET},
+        {"resources",   no_argument,        NULL, OPT_RESOURCES},
+        {"report",      required_argument,  NULL, OPT_REPORT},
+        {"report-file", required_argument,  NULL, OPT_REPORT_FILE},
+        {"baseline",    required_argument,  NULL, OPT_BASELINE},
+        {"update-baseline", no_argument,    NULL, OPT_UPDATE_BASELINE},
+        {"max-slowdown", required_argument, NULL, OPT_MAX_SLOWDOWN},
+        {"max-slowdown-ms", required_argument, NULL, OPT_MAX_SLOWDOWN_MS},
+        {NULL,          0,                  NULL, 0}
+    };
+
+    int opt;
+    // reset getopt, the server parses the arguments of every request
+    optind = 0;
+    while ( (opt = getopt_long(argc, argv, "l:p:U:d:h:WCaFE:L:S:I:j:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'p': /* port */
+                settings.db_port = optarg;
+                break;
+            case 'U': /* username */
+                settings.db_user = optarg;
+                break;
+            case 'd':
+                settings.db_name = optarg;
                 break;
             case 'l':
                 {
@@ -611,6 +2328,19 @@ main(int argc, char * argv[] )
                     log_debug("context_lines: %ud", settings.context_lines);
                 }
                 break;
+            case 'j':
+                {
+                    std::stringstream jobs_ss;
+                    jobs_ss << optarg;
+
+                    int jobs_i;
+                    jobs_ss >> jobs_i;
+                    if (jobs_ss.fail() || (jobs_i < 1)) {
+                        quit("Illegal value for jobs. Jobs must be a positive number.");
+                    }
+                    settings.jobs = static_cast<unsigned int>(jobs_i);
+                }
+                break;
             case 'h':
                 settings.db_host = optarg;
                 break;
@@ -629,6 +2359,86 @@ main(int argc, char * argv[] )
             case 'E': /* client_encoding */
                 settings.client_encoding = optarg;
                 break;
+            case OPT_INDEX:
+                settings.use_index = true;
+                break;
+            case OPT_INDEX_DIR:
+                settings.use_index = true;
+                settings.index_dir = optarg;
+                break;
+            case OPT_RESULT_CACHE:
+                settings.result_cache_dir = optarg;
+                break;
+            case OPT_CACHE_VERIFY:
+                {
+                    std::stringstream ratio_ss;
+                    ratio_ss << optarg;
+                    ratio_ss >> settings.cache_verify_ratio;
+                    if (ratio_ss.fail() || (settings.cache_verify_ratio < 0.0)
+                            || (settings.cache_verify_ratio > 1.0)) {
+                        quit("Illegal value for cache-verify. Must be between 0.0 and 1.0.");
+                    }
+                }
+                break;
+            case OPT_FILTER_STATS:
+                settings.filter_stats = true;
+                break;
+            case OPT_RESOURCES:
+                settings.account_resources = true;
+                break;
+            case OPT_REPORT:
+                if (strcmp(optarg, "json") == 0) {
+                    settings.report_format = REPORT_JSON;
+                }
+                else if (strcmp(optarg, "junit") == 0) {
+                    settings.report_format = REPORT_JUNIT;
+                }
+                else {
+                    quit("Unknown report format. Supported are json and junit.");
+                }
+                settings.write_report = true;
+                break;
+            case OPT_REPORT_FILE:
+                settings.report_path = optarg;
+                break;
+            case OPT_BASELINE:
+                settings.baseline_path = optarg;
+                break;
+            case OPT_UPDATE_BASELINE:
+                settings.update_baseline = true;
+                break;
+            case OPT_MAX_SLOWDOWN:
+                {
+                    std::stringstream slowdown_ss;
+                    slowdown_ss << optarg;
+                    slowdown_ss >> settings.max_slowdown;
+                    if (slowdown_ss.fail() || (settings.max_slowdown < 1.0)) {
+                        quit("Illegal value for max-slowdown. Must be at least 1.0.");
+                    }
+                }
+                break;
+            case OPT_MAX_SLOWDOWN_MS:
+                {
+                    std::stringstream slowdown_ss;
+                    slowdown_ss << optarg;
+
+                    int slowdown_ms_i;
+                    slowdown_ss >> slowdown_ms_i;
+                    if (slowdown_ss.fail() || (slowdown_ms_i < 0)) {
+                        quit("Illegal value for max-slowdown-ms. Must be a positive number.");
+                    }
+                    settings.max_slowdown_ms = static_cast<unsigned int>(slowdown_ms_i);
+                }
+                break;
+            case OPT_PIPELINE:
+                settings.pipeline = true;
+                break;
+            case OPT_TEMPLATE:
+                settings.template_db = optarg;
+                break;
+            case OPT_SOCKET:
+                settings.socket_path = optarg;
+                break;
             case 'L': /* line filter */
                 add_filter<LineFilter>(settings.filterchain, optarg);
                 break;
@@ -647,6 +2457,10 @@ main(int argc, char * argv[] )
     if (optind >= argc) {
         quit("No command specified.");
     }
+    // the client only forwards these, but any program may connect to the socket
+    if (s_serving && (strcmp(*(argv+optind), "run") != 0) && (strcmp(*(argv+optind), "list") != 0)) {
+        quit("The server only handles the run and list commands.");
+    }
     if (strcmp(*(argv+optind), "print") == 0) {
         settings.command = PRINT;
     }
@@ -662,23 +2476,397 @@ main(int argc, char * argv[] )
     else if (strcmp(*(argv+optind), "run") == 0) {
         settings.command = RUN;
     }
+    else if (strcmp(*(argv+optind), "watch") == 0) {
+        settings.command = WATCH;
+    }
+    else if (strcmp(*(argv+optind), "serve") == 0) {
+        settings.command = SERVE;
+    }
     else if (strcmp(*(argv+optind), "help") == 0) {
         print_help();
-        return RC_OK;
+        exit(RC_OK);
     }
     else if (strcmp(*(argv+optind), "version") == 0) {
         print_version();
-        return RC_OK;
+        exit(RC_OK);
     }
     else {
         quit("Unknown command");
     }
 
-    // check for input files
     int fileind = optind+1;
+    if (settings.command == SERVE) {
+        if (settings.socket_path == NULL) {
+            quit("The server needs a socket given with --socket.");
+        }
+        return fileind;
+    }
+
+    // check for input files
     if (fileind >= argc) {
         quit("No input file(s) given.");
     }
 
-    return handle_files(settings, argv+fileind, argc-fileind);
+    if (settings.commit_sql && (settings.result_cache_dir != NULL)) {
+        quit("The result cache can only be used when the SQL is not commited.");
+    }
+    if (settings.commit_sql && (settings.template_db != NULL)) {
+        quit("The databases created from a template are dropped, there is nothing to commit.");
+    }
+    if ((settings.jobs > 1) && (settings.command == RUN) && (settings.result_cache_dir != NULL)) {
+        // the result cache relies on the order the chunks are run in
+        quit("The result cache can not be used when running files in parallel.");
+    }
+    if ((settings.write_report || (settings.report_path != NULL)) && (settings.command != RUN)) {
+        quit("The report is only written by the run command.");
+    }
+    if ((settings.report_path != NULL) && !settings.write_report) {
+        quit("The format of the report has to be given with --report.");
+    }
+    if ((settings.baseline_path != NULL) && (settings.command != RUN)) {
+        quit("The baseline is only used by the run command.");
+    }
+    if (settings.update_baseline && (settings.baseline_path == NULL)) {
+        quit("The baseline to update has to be given with --baseline.");
+    }
+    if (settings.ask_pass && (settings.socket_path != NULL)) {
+        quit("The server can not ask for a password.");
+    }
+    if (settings.command == WATCH) {
+        if (settings.commit_sql || (settings.result_cache_dir != NULL)
+                    || (settings.template_db != NULL) || (settings.socket_path != NULL)
+                    || (settings.jobs > 1)) {
+            quit("The watch command can not be used with -C, -j, --result-cache, --template or --socket.");
+        }
+        for (int i = fileind; i < argc; i++) {
+            if (strcmp(argv[i], "-") == 0) {
+                quit("The watch command can not read from stdin.");
+            }
+        }
+    }
+    return fileind;
+}
+
+
+/**
+ * execute the command of the settings on the files
+ */
+int
+run_command(Settings & settings, char * files[], int nufiles)
+{
+    int rc;
+    if (settings.write_report && (settings.report == NULL)) {
+        rc = run_with_report(settings, files, nufiles);
+    }
+    else if ((settings.baseline_path != NULL) && (settings.baseline == NULL)) {
+        rc = run_with_baseline(settings, files, nufiles);
+    }
+    else if (settings.command == WATCH) {
+        rc = watch_files(settings, files, nufiles);
+    }
+    else if ((settings.jobs > 1) && (settings.command == RUN)) {
+        rc = handle_files_run_parallel(settings, files, nufiles);
+    }
+    else if (settings.jobs > 1) {
+        rc = handle_files_parallel(settings, files, nufiles);
+    }
+    else {
+        rc = handle_files(settings, files, nufiles);
+    }
+
+    if (settings.filter_stats) {
+        settings.filterchain.printStats(stderr);
+    }
+    return rc;
+}
+
+
+/**
+ * run the command while writing the report. the report is finished
+ * even when the run ends early
+ */
+int
+run_with_report(Settings & settings, char * files[], int nufiles)
+{
+    const char * path = settings.report_path;
+    if (path == NULL) {
+        path = (settings.report_format == REPORT_JSON) ? DEFAULT_REPORT_JSON : DEFAULT_REPORT_JUNIT;
+    }
+
+    Report report;
+    if (!report.open(path, settings.report_format)) {
+        fprintf(stderr, "Could not write the report \"%s\".\n", path);
+        return RC_E_USAGE;
+    }
+
+    settings.report = &report;
+    int rc = run_command(settings, files, nufiles);
+    settings.report = NULL;
+
+    if (!report.finish()) {
+        fprintf(stderr, "Could not write the report \"%s\".\n", path);
+        if (rc == RC_OK) {
+            rc = RC_E_OTHER;
+        }
+    }
+    return rc;
+}
+
+
+/**
+ * run the command comparing the query times with the baseline. with
+ * --update-baseline the baseline is written afterwards, a missing
+ * baseline is created
+ */
+int
+run_with_baseline(Settings & settings, char * files[], int nufiles)
+{
+    Baseline baseline(settings.max_slowdown, settings.max_slowdown_ms * 1000000ULL);
+    bool exists = (access(settings.baseline_path, F_OK) == 0);
+    if ((exists || !settings.update_baseline) && !baseline.load(settings.baseline_path)) {
+        fprintf(stderr, "Could not read the baseline \"%s\".\n", settings.baseline_path);
+        return RC_E_USAGE;
+    }
+
+    settings.baseline = &baseline;
+    int rc = run_command(settings, files, nufiles);
+    settings.baseline = NULL;
+
+    if (settings.update_baseline && !settings.interrupted && (rc != RC_E_USAGE)) {
+        if (!baseline.save(settings.baseline_path)) {
+            fprintf(stderr, "Could not write the baseline \"%s\".\n", settings.baseline_path);
+            if (rc == RC_OK) {
+                rc = RC_E_OTHER;
+            }
+        }
+    }
+    return rc;
+}
+
+
+/**
+ * handle the requests of clients until SIGINT or SIGTERM
+ */
+int
+serve(const char * socket_path)
+{
+    Server server;
+    std::string errmsg;
+    if (!server.listen(socket_path, errmsg)) {
+        fprintf(stderr, "Could not listen on \"%s\": %s\n", socket_path, errmsg.c_str());
+        return RC_E_USAGE;
+    }
+
+    // the signals interrupt waiting for the next request. a client which
+    // is gone must not end the server
+    struct sigaction stop_act, ignore_act;
+    stop_act.sa_handler = handle_stop_server;
+    sigemptyset(&stop_act.sa_mask);
+    stop_act.sa_flags = 0;
+    ignore_act.sa_handler = SIG_IGN;
+    sigemptyset(&ignore_act.sa_mask);
+    ignore_act.sa_flags = 0;
+    if ((sigaction(SIGINT, &stop_act, NULL) != 0) || (sigaction(SIGTERM, &stop_act, NULL) != 0)
+                || (sigaction(SIGPIPE, &ignore_act, NULL) != 0)) {
+        log_error("could not register signal handlers");
+        return RC_E_OTHER;
+    }
+
+    // the requests write to the stdout and stderr of the client
+    int saved_fds[3];
+    for (int i = 0; i < 3; i++) {
+        saved_fds[i] = dup(i);
+    }
+
+    ConnectionPool connection_pool;
+    IndexCache index_cache;
+    ServerRequest * request;
+    s_serving = true;
+    while (!s_stop_server && ((request = server.next()) != NULL)) {
+        int rc = handle_request(*request, connection_pool, index_cache);
+
+        for (int i = 0; i < 3; i++) {
+            dup2(saved_fds[i], i);
+        }
+        request->reply(rc);
+        delete request;
+
+        // not needed for the reply
+        connection_pool.reset();
+        index_cache.trim();
+    }
+
+    for (int i = 0; i < 3; i++) {
+        close(saved_fds[i]);
+    }
+    return RC_OK;
+}
+
+
+/**
+ * run the command of a client with its working directory, stdin,
+ * stdout and stderr. returns the exit code for the client
+ */
+int
+handle_request(ServerRequest & request, ConnectionPool & connection_pool,
+            IndexCache & index_cache)
+{
+    fflush(stdout);
+    for (int i = 0; i < 3; i++) {
+        dup2(request.fds[i], i);
+    }
+    if (chdir(request.cwd.c_str()) != 0) {
+        fprintf(stderr, "Could not change to the directory \"%s\".\n", request.cwd.c_str());
+        return RC_E_OTHER;
+    }
+
+    // getopt expects the name of the program in front of the arguments
+    std::vector<std::string> args(request.args);
+    std::vector<char *> argv;
+    argv.push_back(const_cast<char *>("psqlchunks"));
+    for (std::vector<std::string>::iterator ait = args.begin(); ait != args.end(); ++ait) {
+        argv.push_back(&(*ait)[0]);
+    }
+    argv.push_back(NULL);
+    int argc = argv.size() - 1;
+
+    Settings settings;
+    settings.is_terminal = (isatty(STDOUT_FILENO) == 1);
+
+    int fileind;
+    try {
+        fileind = parse_args(settings, argc, &argv[0]);
+    }
+    catch (UsageError &e) {
+        fflush(stdout);
+        return RC_E_USAGE;
+    }
+    settings_ptr = &settings;
+    settings.connection_pool = &connection_pool;
+    settings.index_cache = &index_cache;
+
+    request.watch(interrupt_request, &settings);
+    int rc = run_command(settings, &argv[fileind], argc - fileind);
+    request.unwatch();
+    fflush(stdout);
+
+    settings_ptr = NULL;
+    if (settings.interrupted) {
+        rc = settings.interrupt_rc;
+    }
+    return rc;
+}
+
+
+/**
+ * waits for SIGINT and cancels the running queries. parallel runs end
+ * like after a failed chunk, so the workers complete their files and the
+ * connections are closed as usual. the other commands exit. a second
+ * SIGINT exits without waiting for the workers.
+ */
+void *
+interrupt_main(void * arg)
+{
+    Settings * settings = static_cast<Settings *>(arg);
+    bool parallel_run = (settings->command == RUN) && (settings->jobs > 1);
+
+    sigset_t sigint_set;
+    sigemptyset(&sigint_set);
+    sigaddset(&sigint_set, SIGINT);
+
+    int sig;
+    while (sigwait(&sigint_set, &sig) == 0) {
+        if (settings->interrupted) {
+            exit(RC_E_OTHER);
+        }
+
+        settings->interrupted = parallel_run;
+        int rc = cancel_queries();
+        pthread_mutex_lock(&db_ptrs_mutex);
+        settings->interrupt_rc = rc;
+        pthread_mutex_unlock(&db_ptrs_mutex);
+
+        if (!parallel_run) {
+            exit(rc);
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * called on an other thread when the client of the running request
+ * received SIGINT. cancels the queries like interrupt_main does.
+ */
+void
+interrupt_request(void * arg)
+{
+    Settings * settings = static_cast<Settings *>(arg);
+    settings->interrupted = true;
+
+    int rc = cancel_queries();
+    pthread_mutex_lock(&db_ptrs_mutex);
+    settings->interrupt_rc = rc;
+    pthread_mutex_unlock(&db_ptrs_mutex);
+
+    // the client exits with the reply, nothing may be written to its
+    // terminal afterwards
+    fflush(stdout);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd >= 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+}
+
+
+int
+main(int argc, char * argv[] )
+{
+    Settings settings;
+    settings_ptr = &settings;
+
+    // use is_terminal output if run in a shell
+    if (isatty(fileno(stdout)) == 1) {
+        settings.is_terminal = true;
+        // disable output buffering
+        setvbuf(stdout, NULL, _IONBF, BUFSIZ);
+    };
+
+    int fileind = parse_args(settings, argc, argv);
+    if (settings.command == SERVE) {
+        return serve(settings.socket_path);
+    }
+
+    // without a server the command runs in this process
+    if ((settings.socket_path != NULL) && ((settings.command == RUN) || (settings.command == LIST))) {
+        int rc;
+        if (forward_to_server(settings.socket_path, argc - 1, argv + 1, rc)) {
+            return (rc < 0) ? RC_E_OTHER : rc;
+        }
+    }
+
+    // from now on SIGINT is received by a thread. the threads started
+    // by the command inherit the blocked signal. no connection exists
+    // before, so SIGINT may just end the process
+    sigset_t sigint_set;
+    sigemptyset(&sigint_set);
+    sigaddset(&sigint_set, SIGINT);
+    pthread_t interrupt_thread;
+    if ((pthread_sigmask(SIG_BLOCK, &sigint_set, NULL) != 0)
+                || (pthread_create(&interrupt_thread, NULL, interrupt_main, &settings) != 0)) {
+        log_error("could not start the thread handling SIGINT");
+        return RC_E_OTHER;
+    }
+    pthread_detach(interrupt_thread);
+
+    int rc = run_command(settings, argv+fileind, argc-fileind);
+
+    pthread_mutex_lock(&db_ptrs_mutex);
+    if (settings.interrupted) {
+        rc = settings.interrupt_rc;
+    }
+    pthread_mutex_unlock(&db_ptrs_mutex);
+    return rc;
 }
@@ -0,0 +1,489 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdarg>
+#include <cerrno>
+#include <algorithm>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+
+#include "report.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+static const unsigned int s_histogram_bounds[] = REPORT_HISTOGRAM_BOUNDS;
+
+// the start tag of the testsuite gets rewritten with the counts of the
+// chunks, padded to this length so it keeps its size
+#define JUNIT_SUITE_TAG_LENGTH  128
+
+size_t static utf8_length(const char * c);
+void static append_json_string(std::string & out, const char * value);
+void static append_xml_string(std::string & out, const char * value);
+void static append_format(std::string & out, const char * format, ...)
+            __attribute__((format(printf, 2, 3)));
+
+
+Report::Report()
+    : fd(-1), format(REPORT_JSON), mutex(), end_pos(0), suite_pos(0), passed_count(0),
+      failed_count(0), cached_count(0), total_ns(0), runtimes(), slowest()
+{
+    pthread_mutex_init(&mutex, NULL);
+    for (int b = 0; b < REPORT_HISTOGRAM_BUCKETS; b++) {
+        histogram[b] = 0;
+    }
+}
+
+
+Report::~Report()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+
+bool
+Report::open(const char * path, ReportFormat _format)
+{
+    format = _format;
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("could not create the report %s: %s", path, strerror(errno));
+        return false;
+    }
+
+    if (format == REPORT_JSON) {
+        return write("{\"chunks\": [", "\n], \"complete\": false}\n");
+    }
+    std::string start("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n");
+    suite_pos = start.size();
+    formatSuiteTag(start);
+    return write(start, "</testsuite>\n</testsuites>\n");
+}
+
+
+bool
+Report::write(const std::string & text, const std::string & end)
+{
+    std::string buf;
+    buf.reserve(text.size() + end.size());
+    buf.append(text);
+    buf.append(end);
+
+    // a single write, so the document is only incomplete while it is running
+    if (!writeAt(buf, end_pos)) {
+        return false;
+    }
+    end_pos += text.size();
+    return true;
+}
+
+
+bool
+Report::writeAt(const std::string & buf, off_t pos)
+{
+    size_t written = 0;
+    while (written < buf.size()) {
+        ssize_t nwritten = pwrite(fd, buf.data() + written, buf.size() - written, pos + written);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("could not write the report: %s", strerror(errno));
+            return false;
+        }
+        written += nwritten;
+    }
+    return true;
+}
+
+
+void
+Report::add(const Chunk & chunk, bool cached)
+{
+    std::string record;
+    const char * status = cached ? "cached" : (chunk.failed() ? "failed" : "passed");
+    if (format == REPORT_JSON) {
+        formatJson(record, chunk, status);
+    }
+    else {
+        formatJunit(record, chunk, status);
+    }
+
+    uint64_t ns = chunk.diagnostics.times.queryNs();
+
+    pthread_mutex_lock(&mutex);
+    if (cached) {
+        cached_count++;
+    }
+    else {
+        if (chunk.failed()) {
+            failed_count++;
+        }
+        else {
+            passed_count++;
+        }
+        runtimes.push_back(ns);
+        total_ns += ns;
+
+        int bucket = 0;
+        while ((bucket < (REPORT_HISTOGRAM_BUCKETS - 1))
+                    && ((ns / 1000000) >= s_histogram_bounds[bucket])) {
+            bucket++;
+        }
+        histogram[bucket]++;
+
+        if ((slowest.size() < REPORT_SLOWEST_CHUNKS) || (ns > slowest.back().ns)) {
+            SlowChunk slow;
+            slow.ns = ns;
+            slow.filename = chunk.filename ? chunk.filename : "";
+            slow.start_line = chunk.start_line;
+            slow.end_line = chunk.end_line;
+            slow.description = chunk.getDescription();
+            slowest.insert(std::upper_bound(slowest.begin(), slowest.end(), slow), slow);
+            if (slowest.size() > REPORT_SLOWEST_CHUNKS) {
+                slowest.pop_back();
+            }
+        }
+    }
+
+    // the first chunk has no separator in front of it
+    if ((format == REPORT_JSON) && ((passed_count + failed_count + cached_count) > 1)) {
+        record.insert(0, ",");
+    }
+    if (format == REPORT_JSON) {
+        write(record, "\n], \"complete\": false}\n");
+    }
+    else {
+        write(record, "</testsuite>\n</testsuites>\n");
+
+        std::string suite_tag;
+        formatSuiteTag(suite_tag);
+        writeAt(suite_tag, suite_pos);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+
+bool
+Report::finish()
+{
+    if (fd < 0) {
+        return false;
+    }
+
+    std::string summary;
+    if (format == REPORT_JSON) {
+        formatSummaryJson(summary);
+    }
+    else {
+        formatSummaryJunit(summary);
+    }
+
+    bool success = write(summary, "") && (ftruncate(fd, end_pos) == 0);
+    success = (close(fd) == 0) && success;
+    fd = -1;
+    return success;
+}
+
+
+void
+Report::formatJson(std::string & record, const Chunk & chunk, const char * status)
+{
+    const Diagnostics & diagnostics = chunk.diagnostics;
+
+    record.append("\n{\"file\": ");
+    append_json_string(record, chunk.filename ? chunk.filename : "");
+    append_format(record, ", \"start_line\": %" PRIu64 ", \"end_line\": %" PRIu64 ", \"description\": ",
+                chunk.start_line, chunk.end_line);
+    append_json_string(record, chunk.getDescription().c_str());
+    append_format(record, ", \"status\": \"%s\", \"sqlstate\": ", status);
+    if (chunk.failed()) {
+        append_json_string(record, diagnostics.sqlstate.c_str());
+        record.append(", \"message\": ");
+        append_json_string(record, diagnostics.msg_primary.c_str());
+    }
+    else {
+        record.append("null");
+    }
+
+    append_format(record, ", \"query_ms\": %.3f, \"times_ms\": {", diagnostics.times.queryNs() / 1e6);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        append_format(record, "%s\"%s\": %.3f", (p > 0) ? ", " : "",
+                    phase_name(static_cast<TimingPhase>(p)), diagnostics.times.ns[p] / 1e6);
+    }
+    record.append("}}");
+}
+
+
+void
+Report::formatSuiteTag(std::string & tag)
+{
+    size_t start = tag.size();
+    append_format(tag, "<testsuite name=\"psqlchunks\" tests=\"%u\" failures=\"%u\" errors=\"0\" time=\"%.6f\"",
+                passed_count + failed_count + cached_count, failed_count, total_ns / 1e9);
+    if ((tag.size() - start) < JUNIT_SUITE_TAG_LENGTH) {
+        tag.append(JUNIT_SUITE_TAG_LENGTH - (tag.size() - start), ' ');
+    }
+    tag.append(">\n");
+}
+
+
+void
+Report::formatJunit(std::string & record, const Chunk & chunk, const char * status)
+{
+    const Diagnostics & diagnostics = chunk.diagnostics;
+
+    record.append("<testcase classname=\"");
+    append_xml_string(record, chunk.filename ? chunk.filename : "");
+    append_format(record, "\" name=\"[%" PRIu64 "-%" PRIu64 "] ", chunk.start_line, chunk.end_line);
+    append_xml_string(record, chunk.getDescription().c_str());
+    append_format(record, "\" time=\"%.6f\"", diagnostics.times.queryNs() / 1e9);
+
+    if (chunk.failed()) {
+        record.append(">\n<failure type=\"");
+        append_xml_string(record, diagnostics.sqlstate.c_str());
+        record.append("\" message=\"");
+        append_xml_string(record, diagnostics.msg_primary.c_str());
+        record.append("\"/>\n</testcase>\n");
+    }
+    else if (strcmp(status, "cached") == 0) {
+        record.append(">\n<system-out>passed according to the result cache</system-out>\n</testcase>\n");
+    }
+    else {
+        record.append("/>\n");
+    }
+}
+
+
+uint64_t
+Report::percentile(unsigned int p)
+{
+    if (runtimes.empty()) {
+        return 0;
+    }
+
+    // nearest rank
+    size_t rank = ((runtimes.size() * p) + 99) / 100;
+    if (rank > 0) {
+        rank--;
+    }
+    std::nth_element(runtimes.begin(), runtimes.begin() + rank, runtimes.end());
+    return runtimes[rank];
+}
+
+
+void
+Report::formatSummaryJson(std::string & summary)
+{
+    append_format(summary, "\n], \"summary\": {\"passed\": %u, \"failed\": %u, \"cached\": %u",
+                passed_count, failed_count, cached_count);
+
+    uint64_t max_ns = slowest.empty() ? 0 : slowest.front().ns;
+    append_format(summary, ", \"query_ms\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+                percentile(50) / 1e6, percentile(90) / 1e6, percentile(99) / 1e6, max_ns / 1e6);
+
+    summary.append(", \"histogram\": [");
+    for (int b = 0; b < REPORT_HISTOGRAM_BUCKETS; b++) {
+        if (b < (REPORT_HISTOGRAM_BUCKETS - 1)) {
+            append_format(summary, "{\"below_ms\": %u, \"count\": %u}, ", s_histogram_bounds[b], histogram[b]);
+        }
+        else {
+            append_format(summary, "{\"below_ms\": null, \"count\": %u}", histogram[b]);
+        }
+    }
+
+    summary.append("], \"slowest\": [");
+    for (std::vector<SlowChunk>::iterator sit = slowest.begin(); sit != slowest.end(); ++sit) {
+        summary.append((sit == slowest.begin()) ? "\n{\"file\": " : ",\n{\"file\": ");
+        append_json_string(summary, sit->filename.c_str());
+        append_format(summary, ", \"start_line\": %" PRIu64 ", \"end_line\": %" PRIu64 ", \"description\": ",
+                    sit->start_line, sit->end_line);
+        append_json_string(summary, sit->description.c_str());
+        append_format(summary, ", \"query_ms\": %.3f}", sit->ns / 1e6);
+    }
+    summary.append("]}, \"complete\": true}\n");
+}
+
+
+void
+Report::formatSummaryJunit(std::string & summary)
+{
+    std::string text;
+    append_format(text, "passed: %u, failed: %u, cached: %u\n", passed_count, failed_count, cached_count);
+
+    uint64_t max_ns = slowest.empty() ? 0 : slowest.front().ns;
+    append_format(text, "query time: p50 %.3fms, p90 %.3fms, p99 %.3fms, max %.3fms\n",
+                percentile(50) / 1e6, percentile(90) / 1e6, percentile(99) / 1e6, max_ns / 1e6);
+
+    text.append("histogram:\n");
+    for (int b = 0; b < REPORT_HISTOGRAM_BUCKETS; b++) {
+        if (b < (REPORT_HISTOGRAM_BUCKETS - 1)) {
+            append_format(text, "  below %ums: %u\n", s_histogram_bounds[b], histogram[b]);
+        }
+        else {
+            append_format(text, "  longer: %u\n", histogram[b]);
+        }
+    }
+
+    text.append("slowest:\n");
+    for (std::vector<SlowChunk>::iterator sit = slowest.begin(); sit != slowest.end(); ++sit) {
+        append_format(text, "  %.3fms ", sit->ns / 1e6);
+        text.append(sit->filename);
+        append_format(text, " [%" PRIu64 "-%" PRIu64 "] ", sit->start_line, sit->end_line);
+        text.append(sit->description);
+        text.append("\n");
+    }
+
+    summary.append("<system-out>");
+    append_xml_string(summary, text.c_str());
+    summary.append("</system-out>\n</testsuite>\n</testsuites>\n");
+}
+
+
+// ### helpers ######################################
+
+/**
+ * length of the utf8 sequence of the character at c. 0 when the sequence
+ * is not valid, overlong or encodes a surrogate
+ */
+size_t static
+utf8_length(const char * c)
+{
+    const unsigned char * u = reinterpret_cast<const unsigned char *>(c);
+    size_t length;
+    uint32_t code;
+    uint32_t min_code;
+
+    if (u[0] < 0x80) {
+        return 1;
+    }
+    else if ((u[0] & 0xe0) == 0xc0) {
+        length = 2;
+        code = u[0] & 0x1f;
+        min_code = 0x80;
+    }
+    else if ((u[0] & 0xf0) == 0xe0) {
+        length = 3;
+        code = u[0] & 0x0f;
+        min_code = 0x800;
+    }
+    else if ((u[0] & 0xf8) == 0xf0) {
+        length = 4;
+        code = u[0] & 0x07;
+        min_code = 0x10000;
+    }
+    else {
+        return 0;
+    }
+
+    // the terminating zero is no continuation byte
+    for (size_t i = 1; i < length; i++) {
+        if ((u[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        code = (code << 6) | (u[i] & 0x3f);
+    }
+    if ((code < min_code) || (code > 0x10ffff) || ((code >= 0xd800) && (code <= 0xdfff))) {
+        return 0;
+    }
+    return length;
+}
+
+
+/**
+ * append a quoted json string. bytes which are not valid utf8 are
+ * replaced by U+FFFD
+ */
+void static
+append_json_string(std::string & out, const char * value)
+{
+    out.push_back('"');
+    for (const char * c = value; *c; c++) {
+        switch (*c) {
+            case '"':   out.append("\\\""); break;
+            case '\\':  out.append("\\\\"); break;
+            case '\n':  out.append("\\n"); break;
+            case '\r':  out.append("\\r"); break;
+            case '\t':  out.append("\\t"); break;
+            default:
+                if (static_cast<unsigned char>(*c) < 0x20) {
+                    append_format(out, "\\u%04x", static_cast<unsigned char>(*c));
+                }
+                else {
+                    size_t length = utf8_length(c);
+                    if (length == 0) {
+                        out.append("\\ufffd");
+                    }
+                    else {
+                        out.append(c, length);
+                        c += length - 1;
+                    }
+                }
+        }
+    }
+    out.push_back('"');
+}
+
+
+/**
+ * append text escaped for attributes and contents of xml. control
+ * characters are not allowed in xml and get dropped, bytes which are
+ * not valid utf8 are replaced by U+FFFD
+ */
+void static
+append_xml_string(std::string & out, const char * value)
+{
+    for (const char * c = value; *c; c++) {
+        switch (*c) {
+            case '&':   out.append("&amp;"); break;
+            case '<':   out.append("&lt;"); break;
+            case '>':   out.append("&gt;"); break;
+            case '"':   out.append("&quot;"); break;
+            case '\n':  out.append("&#10;"); break;
+            case '\t':  out.append("&#9;"); break;
+            default:
+                if (static_cast<unsigned char>(*c) >= 0x20) {
+                    size_t length = utf8_length(c);
+                    if (length == 0) {
+                        out.append("\xef\xbf\xbd");
+                    }
+                    else {
+                        out.append(c, length);
+                        c += length - 1;
+                    }
+                }
+        }
+    }
+}
+
+
+void static
+append_format(std::string & out, const char * format, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+
+    if (len < 0) {
+        return;
+    }
+    if (static_cast<size_t>(len) < sizeof(buf)) {
+        out.append(buf, len);
+        return;
+    }
+
+    // longer than the buffer, format again
+    std::vector<char> large(len + 1);
+    va_start(args, format);
+    vsnprintf(&large[0], large.size(), format, args);
+    va_end(args);
+    out.append(&large[0], len);
+}
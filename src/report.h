@@ -0,0 +1,125 @@
+#ifndef __report_h__
+#define __report_h__
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "chunk.h"
+#include "timing.h"
+
+// number of chunks listed as the slowest in the summary
+#define REPORT_SLOWEST_CHUNKS   10
+
+// upper bounds of the buckets of the runtime histogram in milliseconds.
+// the last bucket takes all longer runtimes
+#define REPORT_HISTOGRAM_BOUNDS { 1, 10, 100, 1000, 10000, 100000 }
+#define REPORT_HISTOGRAM_BUCKETS 7
+
+namespace PsqlChunks
+{
+
+    enum ReportFormat
+    {
+        REPORT_JSON,
+        REPORT_JUNIT
+    };
+
+
+    /**
+     * a file recording the result and the times of every chunk run.
+     *
+     * the file is written while the chunks run. after each chunk the closing
+     * part of the document is written behind it and gets overwritten by the
+     * next chunk, so the file stays valid when the run gets killed. the
+     * start tag of the junit testsuite is rewritten with the counts. the
+     * summary with the percentiles, the histogram and the slowest chunks is
+     * only written by finish.
+     *
+     * the runtime of a chunk is the time of its query, as shown on the
+     * status line.
+     */
+    class Report
+    {
+        private:
+            Report(const Report&);
+            Report& operator=(const Report&);
+
+            /** a chunk of the ranking of the slowest chunks */
+            struct SlowChunk
+            {
+                uint64_t ns;
+                std::string filename;
+                linenumber_t start_line;
+                linenumber_t end_line;
+                std::string description;
+
+                bool operator<(const SlowChunk & other) const
+                {
+                    return ns > other.ns;
+                }
+            };
+
+            int fd;
+            ReportFormat format;
+
+            /** the chunks are added by the threads of parallel runs */
+            pthread_mutex_t mutex;
+
+            /** position of the closing part of the document */
+            off_t end_pos;
+
+            /** position of the start tag of the junit testsuite */
+            off_t suite_pos;
+
+            unsigned int passed_count;
+            unsigned int failed_count;
+            unsigned int cached_count;
+
+            /** the sum of the runtimes of the executed chunks */
+            uint64_t total_ns;
+
+            /** the runtimes of the executed chunks */
+            std::vector<uint64_t> runtimes;
+            unsigned int histogram[REPORT_HISTOGRAM_BUCKETS];
+
+            /** sorted by the runtime, slowest first */
+            std::vector<SlowChunk> slowest;
+
+            /** replace the closing part of the document */
+            bool write(const std::string & text, const std::string & end);
+
+            bool writeAt(const std::string & buf, off_t pos);
+
+            void formatJson(std::string & record, const Chunk & chunk, const char * status);
+            void formatJunit(std::string & record, const Chunk & chunk, const char * status);
+
+            /** the start tag of the testsuite with the counts of the chunks so far */
+            void formatSuiteTag(std::string & tag);
+            void formatSummaryJson(std::string & summary);
+            void formatSummaryJunit(std::string & summary);
+
+            /** the runtime at the percentile, 0 without executed chunks */
+            uint64_t percentile(unsigned int p);
+
+        public:
+            Report();
+            ~Report();
+
+            /** create the file. false when it can not be written */
+            bool open(const char * path, ReportFormat _format);
+
+            /**
+             * record a chunk after it has been run. chunks skipped because of
+             * the result cache are recorded as cached
+             */
+            void add(const Chunk & chunk, bool cached);
+
+            /** write the summary and close the file */
+            bool finish();
+    };
+
+};
+
+#endif /* __report_h__ */
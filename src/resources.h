@@ -0,0 +1,93 @@
+#ifndef __resources_h__
+#define __resources_h__
+
+#include <algorithm>
+
+#include <stdint.h>
+
+// a counter the server does not provide
+#define RESOURCE_NOT_AVAILABLE  (-1)
+
+namespace PsqlChunks
+{
+
+    /**
+     * counters of the server for the work done by a chunk. see
+     * Db::setResourceAccounting
+     */
+    struct ResourceUsage
+    {
+        /** false unless the counters have been read from the server */
+        bool measured;
+
+        /** bytes of wal written by the whole server */
+        int64_t wal_bytes;
+
+        /** blocks found in and read into the shared buffers */
+        int64_t shared_hit;
+        int64_t shared_read;
+
+        /** blocks of temporary tables found in and read into the local buffers */
+        int64_t local_hit;
+        int64_t local_read;
+
+        /** rows inserted, updated and deleted */
+        int64_t rows;
+
+        /** memory of the backend after the chunk. not a difference */
+        int64_t memory_bytes;
+
+        ResourceUsage()
+        {
+            clear();
+        }
+
+        void clear()
+        {
+            measured = false;
+            wal_bytes = RESOURCE_NOT_AVAILABLE;
+            shared_hit = 0;
+            shared_read = 0;
+            local_hit = 0;
+            local_read = 0;
+            rows = 0;
+            memory_bytes = RESOURCE_NOT_AVAILABLE;
+        }
+
+        /** the usage between two snapshots of the counters */
+        void setDifference(const ResourceUsage & before, const ResourceUsage & after)
+        {
+            measured = before.measured && after.measured;
+            wal_bytes = ((before.wal_bytes == RESOURCE_NOT_AVAILABLE)
+                            || (after.wal_bytes == RESOURCE_NOT_AVAILABLE))
+                        ? RESOURCE_NOT_AVAILABLE : (after.wal_bytes - before.wal_bytes);
+            shared_hit = after.shared_hit - before.shared_hit;
+            shared_read = after.shared_read - before.shared_read;
+            local_hit = after.local_hit - before.local_hit;
+            local_read = after.local_read - before.local_read;
+            rows = after.rows - before.rows;
+            memory_bytes = after.memory_bytes;
+        }
+
+        /** sum up the usage of several chunks. the memory is the maximum */
+        void add(const ResourceUsage & other)
+        {
+            if (!other.measured) {
+                return;
+            }
+            if (other.wal_bytes != RESOURCE_NOT_AVAILABLE) {
+                wal_bytes = std::max<int64_t>(wal_bytes, 0) + other.wal_bytes;
+            }
+            shared_hit += other.shared_hit;
+            shared_read += other.shared_read;
+            local_hit += other.local_hit;
+            local_read += other.local_read;
+            rows += other.rows;
+            memory_bytes = std::max(memory_bytes, other.memory_bytes);
+            measured = true;
+        }
+    };
+
+};
+
+#endif /* __resources_h__ */
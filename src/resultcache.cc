@@ -0,0 +1,125 @@
+#include <cstdlib>
+#include <ctime>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "resultcache.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+
+ResultCache::ResultCache(const char * _directory, double _verify_ratio)
+    : directory(_directory), chain(0), verify_ratio(_verify_ratio),
+      rand_state(static_cast<unsigned int>(time(NULL) ^ getpid())),
+      deferred(), deferred_bytes(0), hit_count(0)
+{
+    if (!directory.empty() && (directory[directory.size()-1] != '/')) {
+        directory.append("/");
+    }
+}
+
+
+ResultCache::~ResultCache()
+{
+    for (std::vector<DeferredChunk>::iterator dit = deferred.begin(); dit != deferred.end(); ++dit) {
+        delete dit->chunk;
+    }
+}
+
+
+bool
+ResultCache::init(const std::string & server_fingerprint)
+{
+    if ((mkdir(directory.c_str(), 0755) != 0) && (errno != EEXIST)) {
+        log_error("could not create result cache directory %s", directory.c_str());
+        return false;
+    }
+    if (access(directory.c_str(), W_OK) != 0) {
+        log_error("result cache directory %s is not writable", directory.c_str());
+        return false;
+    }
+
+    chain = hash_string(server_fingerprint);
+    return true;
+}
+
+
+hash_t
+ResultCache::nextKey(const Chunk & chunk)
+{
+    hash_t sql_hash = chunk.getSqlHash();
+    chain = hash_bytes(&sql_hash, sizeof(sql_hash), chain);
+    return chain;
+}
+
+
+std::string
+ResultCache::pathFor(hash_t key) const
+{
+    return directory + hash_to_hex(key);
+}
+
+
+bool
+ResultCache::contains(hash_t key) const
+{
+    return access(pathFor(key).c_str(), F_OK) == 0;
+}
+
+
+void
+ResultCache::store(hash_t key)
+{
+    int fd = open(pathFor(key).c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        log_warn("could not write to the result cache");
+        return;
+    }
+    close(fd);
+}
+
+
+void
+ResultCache::remove(hash_t key)
+{
+    unlink(pathFor(key).c_str());
+}
+
+
+bool
+ResultCache::sampleForVerification()
+{
+    if (verify_ratio <= 0.0) {
+        return false;
+    }
+    return (static_cast<double>(rand_r(&rand_state)) / RAND_MAX) < verify_ratio;
+}
+
+
+void
+ResultCache::defer(const Chunk & chunk, hash_t key)
+{
+    DeferredChunk dchunk;
+    dchunk.chunk = new Chunk();
+    dchunk.chunk->copyOwned(chunk);
+    dchunk.key = key;
+    dchunk.printed = false;
+    deferred.push_back(dchunk);
+
+    const linevector_t & lines = chunk.getSqlLines();
+    for (linevector_t::const_iterator lit = lines.begin(); lit != lines.end(); ++lit) {
+        deferred_bytes += lit->length + 1;
+    }
+}
+
+
+void
+ResultCache::takeDeferred(std::vector<DeferredChunk> & target)
+{
+    target.insert(target.end(), deferred.begin(), deferred.end());
+    deferred.clear();
+    deferred_bytes = 0;
+}
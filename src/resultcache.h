@@ -0,0 +1,120 @@
+#ifndef __resultcache_h__
+#define __resultcache_h__
+
+#include <string>
+#include <vector>
+
+#include "chunk.h"
+#include "hash.h"
+
+// maximum number of bytes of sql held back for skipped chunks. when this
+// limit is reached cached chunks get executed anyways
+#define RESULT_CACHE_MAX_DEFERRED_BYTES     (64*1024*1024)
+
+namespace PsqlChunks
+{
+
+    /**
+     * a chunk which was not executed because it passed in an earlier run
+     */
+    struct DeferredChunk
+    {
+        Chunk * chunk;
+        hash_t key;
+
+        /** the result line has been printed at the end of its file */
+        bool printed;
+    };
+
+
+    /**
+     * remembers chunks which passed in earlier runs.
+     *
+     * the key of a chunk is built from the hash of its sql, the keys of all
+     * chunks executed before it in the same run and a fingerprint of the
+     * server. so a key is only found in the cache when the complete sequence
+     * of chunks up to it passed before.
+     *
+     * skipped chunks are not executed at all. as the chunks following them
+     * may depend on their changes, the skipped chunks are kept and have to be
+     * executed before the first chunk which is not found in the cache. their
+     * results are only reported once they have been executed or the file
+     * ended, so a stale result is not reported as passed.
+     *
+     * the cache is a directory containing an empty file for each key.
+     */
+    class ResultCache
+    {
+        private:
+            ResultCache(const ResultCache&);
+            ResultCache& operator=(const ResultCache&);
+
+            std::string directory;
+            hash_t chain;
+
+            /** fraction of the cached chunks which will be executed anyways */
+            double verify_ratio;
+            unsigned int rand_state;
+
+            std::vector<DeferredChunk> deferred;
+            size_t deferred_bytes;
+            unsigned int hit_count;
+
+            std::string pathFor(hash_t key) const;
+
+        public:
+            ResultCache(const char * _directory, double _verify_ratio);
+            ~ResultCache();
+
+            /**
+             * prepare the cache for a run against the server with the given fingerprint.
+             * returns false if the cache directory is not usable.
+             */
+            bool init(const std::string & server_fingerprint);
+
+            /** the key of the next chunk in the run */
+            hash_t nextKey(const Chunk & chunk);
+
+            bool contains(hash_t key) const;
+            void store(hash_t key);
+            void remove(hash_t key);
+
+            /** randomly decide if a cached chunk should be verified */
+            bool sampleForVerification();
+
+            /** keep a copy of a skipped chunk */
+            void defer(const Chunk & chunk, hash_t key);
+
+            size_t deferredBytes() const
+            {
+                return deferred_bytes;
+            }
+
+            /** the skipped chunks which have not been executed yet */
+            std::vector<DeferredChunk> & getDeferred()
+            {
+                return deferred;
+            }
+
+            /**
+             * move the skipped chunks to the given vector. the caller
+             * takes ownership of the chunks.
+             */
+            void takeDeferred(std::vector<DeferredChunk> & target);
+
+            /** count a skipped chunk which was not found to be stale */
+            void countHit()
+            {
+                hit_count++;
+            }
+
+            /** number of chunks reported as passed because of the cache */
+            unsigned int getHitCount() const
+            {
+                return hit_count;
+            }
+    };
+
+};
+
+#endif /* __resultcache_h__ */
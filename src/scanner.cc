@@ -1,7 +1,10 @@
 #include <string>
-#include <cctype>
+#include <cstring>
+#include <algorithm>
 
 #include "scanner.h"
+#include "simd.h"
+#include "timing.h"
 #include "debug.h"
 
 
@@ -10,6 +13,9 @@ using namespace PsqlChunks;
 // byte order matk for utf8 strings
 static const char * bom_utf8 = "\xef\xbb\xbf";
 
+static const char * s_marker_start = "start";
+static const char * s_marker_end = "end";
+
 /**
  * does not include linebreaks
  */
@@ -21,19 +27,22 @@ is_inline_whitespace( const char ch) {
 
 /**
  * check if a string starts with another string
- * not unicode compatible
+ * not unicode compatible. with ignore_case set the needle has to consist
+ * of lowercase ascii letters only.
  */
 bool static
-starts_with(const std::string &haystack, const std::string& needle, size_t start_pos, bool ignore_case)
+starts_with(const char * haystack, size_t haystack_len, const char * needle, size_t needle_len,
+            size_t start_pos, bool ignore_case)
 {
-    if ((haystack.size()-start_pos) < needle.size()) {
+    if ((haystack_len-start_pos) < needle_len) {
         return false;
     }
 
-    for( size_t c=0;c<needle.size(); c++) {
+    for( size_t c=0;c<needle_len; c++) {
         if (ignore_case) {
-            if ((haystack[start_pos+c] != tolower(needle[c])) &&
-                    (haystack[start_pos+c] != toupper(needle[c])) ) {
+            // folding with 0x20 maps exactly the upper and lower case
+            // variant of an ascii letter to the lowercase letter
+            if ((haystack[start_pos+c] | 0x20) != needle[c]) {
                 return false;
             }
         }
@@ -48,18 +57,18 @@ starts_with(const std::string &haystack, const std::string& needle, size_t start
 
 
 bool
-ChunkScanner::hasMarker(const std::string &haystack, const std::string& marker,
-        size_t start_pos, size_t &end_pos)
+ChunkScanner::hasMarker(const char * haystack, size_t haystack_len, const char * marker,
+        size_t marker_len, size_t start_pos, size_t &end_pos)
 {
-    if (starts_with(haystack, marker, start_pos, true)) {
-        size_t c = marker.size();
-        while (((start_pos+c) < haystack.size()) && is_inline_whitespace(haystack[start_pos+c])) {
+    if (starts_with(haystack, haystack_len, marker, marker_len, start_pos, true)) {
+        size_t c = marker_len;
+        while (((start_pos+c) < haystack_len) && is_inline_whitespace(haystack[start_pos+c])) {
             c++;
         }
-        if (haystack.size() > (start_pos+c)) {
+        if (haystack_len > (start_pos+c)) {
             if (haystack[start_pos+c] == ':') {
                 end_pos = start_pos+c;
-                while (((end_pos) < haystack.size()) &&
+                while (((end_pos) < haystack_len) &&
                         ( is_inline_whitespace(haystack[end_pos]) || (haystack[end_pos] == ':') )) {
                     end_pos++;
                 }
@@ -72,37 +81,199 @@ ChunkScanner::hasMarker(const std::string &haystack, const std::string& marker,
 }
 
 
+ChunkScanner::ChunkScanner( Input & _input )
+    :   input(_input),
+        owned_input(NULL),
+        chunkCache(),
+        line_number(1),
+        stm_last_cls(EMPTY),
+        stm_state(CAPTURE_SQL),
+        last_nonempty_line(1),
+        filterchain(NULL),
+        filter_last_line(LINE_NUMBER_NOT_AVAILABLE),
+        timed(false),
+        filter_ns(0),
+        header_checked(false),
+        header_rejected(false),
+        header_changed(false),
+        skip_chunk(false),
+        skip_until_line(LINE_NUMBER_NOT_AVAILABLE),
+        passed_last_line(false),
+        rewind_point()
+{
+}
+
+
 ChunkScanner::ChunkScanner( std::istream & _strm )
-    :   strm(_strm),
+    :   input(*(new StreamInput(_strm))),
+        owned_input(NULL),
         chunkCache(),
         line_number(1),
         stm_last_cls(EMPTY),
         stm_state(CAPTURE_SQL),
-        last_nonempty_line(1)
+        last_nonempty_line(1),
+        filterchain(NULL),
+        filter_last_line(LINE_NUMBER_NOT_AVAILABLE),
+        timed(false),
+        filter_ns(0),
+        header_checked(false),
+        header_rejected(false),
+        header_changed(false),
+        skip_chunk(false),
+        skip_until_line(LINE_NUMBER_NOT_AVAILABLE),
+        passed_last_line(false),
+        rewind_point()
 {
+    owned_input = &input;
 }
 
 
 ChunkScanner::~ChunkScanner()
 {
+    delete owned_input;
 }
 
 bool
 ChunkScanner::eof()
 {
-    return !strm.good();
+    return input.eof();
+}
+
+
+void
+ChunkScanner::setFilterChain(FilterChain * _filterchain)
+{
+    filterchain = _filterchain;
+    filter_last_line = filterchain ? filterchain->lastLine() : LINE_NUMBER_NOT_AVAILABLE;
+}
+
+
+bool
+ChunkScanner::checkHeader(Chunk & chunk, linenumber_t first_line, byteoffset_t position,
+            State state_before)
+{
+    if (!filterchain) {
+        return true;
+    }
+    header_checked = true;
+
+    if ((filter_last_line != LINE_NUMBER_NOT_AVAILABLE) && (first_line > filter_last_line)) {
+        passed_last_line = true;
+        return false;
+    }
+    // a chunk starting between the lines of the line filters only
+    // matches once it reaches the next of them
+    linenumber_t next_line = LINE_NUMBER_NOT_AVAILABLE;
+    if (matchFilters(chunk, true)) {
+        next_line = filterchain->nextLine(first_line);
+        if (next_line <= first_line) {
+            return true;
+        }
+    }
+    else {
+        header_rejected = true;
+    }
+
+    // the lines of other inputs have to be kept, as the chunk may be
+    // accepted when its start comment changes
+    if (!input.isStable()) {
+        return true;
+    }
+    skip_chunk = true;
+    skip_until_line = next_line;
+
+    rewind_point.position = position;
+    rewind_point.state = state_before;
+    rewind_point.last_cls = stm_last_cls;
+    rewind_point.line_number = line_number;
+    rewind_point.last_nonempty_line = last_nonempty_line;
+    rewind_point.chunk = chunk;
+    return true;
+}
+
+
+void
+ChunkScanner::rewindChunk(Chunk & chunk)
+{
+    log_debug("skipped chunk may match - rescanning from line %" PRIu64,
+                rewind_point.line_number);
+
+    input.seek(rewind_point.position);
+    stm_state = rewind_point.state;
+    stm_last_cls = rewind_point.last_cls;
+    line_number = rewind_point.line_number;
+    last_nonempty_line = rewind_point.last_nonempty_line;
+
+    chunk = rewind_point.chunk;
+
+    skip_chunk = false;
+    skip_until_line = LINE_NUMBER_NOT_AVAILABLE;
+    header_changed = true;
+}
+
+
+bool
+ChunkScanner::matchFilters(const Chunk & chunk, bool header)
+{
+    uint64_t start = timed ? monotonic_ns() : 0;
+    bool matched = header ? filterchain->matchHeader(chunk) : filterchain->matchBody(chunk);
+    if (timed) {
+        filter_ns += monotonic_ns() - start;
+    }
+    return matched;
+}
+
+
+bool
+ChunkScanner::nextChunk( Chunk &chunk )
+{
+    uint64_t start = timed ? monotonic_ns() : 0;
+    filter_ns = 0;
+
+    while (scanChunk(chunk)) {
+        if (skip_chunk) {
+            continue;
+        }
+        if (filterchain) {
+            // the start comment may have changed after the header filters were matched
+            bool header_matched = header_changed ? matchFilters(chunk, true) : !header_rejected;
+            if (!header_matched || !matchFilters(chunk, false)) {
+                continue;
+            }
+        }
+
+        // includes the time spent on the rejected chunks before this one
+        if (timed) {
+            chunk.diagnostics.times.ns[PHASE_FILTER] = filter_ns;
+            chunk.diagnostics.times.ns[PHASE_SCAN] = (monotonic_ns() - start) - filter_ns;
+        }
+        return true;
+    }
+    return false;
 }
 
 
 
 ChunkScanner::Content
-ChunkScanner::classifyLine( std::string & line, size_t & content_pos)
+ChunkScanner::classifyLine(const char * line, size_t line_len, size_t & content_pos)
 {
     Content cls = EMPTY;
     int dash_counter = 0;
     content_pos=0;
 
-    for (size_t c=0; c<line.size(); c++) {
+    // fast path: everything which does not start with a dash after the
+    // leading whitespace is either empty or sql
+    const char * first = skip_inline_whitespace(line, line + line_len);
+    if (first == (line + line_len)) {
+        return EMPTY;
+    }
+    if (*first != '-') {
+        content_pos = first - line;
+        return OTHER;
+    }
+
+    // leading whitespace does not change the state, so start at the first dash
+    for (size_t c=first-line; c<line_len; c++) {
 
         if (line[c] == '-') {
             dash_counter++;
@@ -129,10 +300,10 @@ ChunkScanner::classifyLine( std::string & line, size_t & content_pos)
             else {
                 if (!is_inline_whitespace(line[c])) {
                     content_pos = c;
-                    if (hasMarker(line, "start", c, content_pos)) {
+                    if (hasMarker(line, line_len, s_marker_start, 5, c, content_pos)) {
                         cls = COMMENT_START;
                     }
-                    if (hasMarker(line, "end", c, content_pos)) {
+                    if (hasMarker(line, line_len, s_marker_end, 3, c, content_pos)) {
                         cls = COMMENT_END;
                     }
                     break;
@@ -148,35 +319,95 @@ ChunkScanner::classifyLine( std::string & line, size_t & content_pos)
 }
 
 
+void
+ChunkScanner::startAtSplitPoint(linenumber_t first_line)
+{
+    // the state after the separator line
+    line_number = first_line;
+    last_nonempty_line = first_line;
+    stm_last_cls = SEP;
+    stm_state = IGNORE;
+    chunkCache.clear();
+}
+
+
 bool
-ChunkScanner::nextChunk( Chunk &chunk )
+ChunkScanner::isSplitPoint(const LineRef lines[4])
+{
+    Content cls[4];
+    size_t content_pos;
+    for (int i = 0; i < 4; i++) {
+        cls[i] = classifyLine(lines[i].data, lines[i].length, content_pos);
+    }
+
+    // a separator ends an end comment without updating stm_last_cls
+    if ((cls[0] == COMMENT) || (cls[0] == COMMENT_END)) {
+        return false;
+    }
+    if ((cls[1] != SEP) || (cls[2] != COMMENT_START)) {
+        return false;
+    }
+    // the start comment sets stm_last_cls only when no chunk was pending.
+    // only these classes depend on it
+    return (cls[3] != COMMENT_START) && (cls[3] != COMMENT_END);
+}
+
+
+bool
+ChunkScanner::scanChunk( Chunk &chunk )
 {
     chunk.clear();
+    header_checked = false;
+    header_rejected = false;
+    header_changed = false;
+    skip_chunk = false;
+    skip_until_line = LINE_NUMBER_NOT_AVAILABLE;
+
+    if (passed_last_line) {
+        return false;
+    }
 
     if (stm_state == COPY_CACHED) {
-        chunk = chunkCache;
+        // the cleared chunk becomes the new cache
+        chunk.swap(chunkCache);
         chunkCache.clear();
         stm_state = NEW_CHUNK;
-    }
 
-    std::string line;
-    bool is_first_line = true;
+        // a chunk following an end comment starts with its first sql line. the
+        // empty lines re-added in front of the next sql line are numbered from
+        // the last non-empty line, which may lie before it
+        linenumber_t first_line = std::min(chunk.start_line, last_nonempty_line);
+        if (chunk.hasSql() && !checkHeader(chunk, first_line, input.position(), stm_state)) {
+            chunk.clear();
+            return false;
+        }
+        // the cached line was read already and may be the one to skip to
+        if (skip_chunk && (skip_until_line != LINE_NUMBER_NOT_AVAILABLE)
+                && (skip_until_line <= chunk.start_line)) {
+            skip_chunk = false;
+            skip_until_line = LINE_NUMBER_NOT_AVAILABLE;
+        }
+    }
 
-    while (strm.good()) {
+    // lines of inputs which reuse their buffers have to be copied
+    bool copy_lines = !input.isStable();
+    LineRef line;
 
-        line.clear();
-        getline(strm, line);
+    while (input.nextLine(line)) {
 
         // strip the Byte Order Mark
-        if (is_first_line) {
-            if (!line.substr(0, strlen(bom_utf8)).compare(bom_utf8)) {
-                line = line.substr( strlen(bom_utf8));
+        if (line.offset == 0) {
+            size_t bom_len = strlen(bom_utf8);
+            if ((line.length >= bom_len) && (memcmp(line.data, bom_utf8, bom_len) == 0)) {
+                line.data += bom_len;
+                line.length -= bom_len;
+                line.offset += bom_len;
             }
-            is_first_line = false;
         }
 
         size_t content_pos;
-        Content cls = classifyLine(line, content_pos);
+        Content cls = classifyLine(line.data, line.length, content_pos);
+        State state_before = stm_state;
         switch (cls) {
             case OTHER:
                 if (stm_state == CAPTURE_END_COMMENT) {
@@ -227,34 +458,52 @@ ChunkScanner::nextChunk( Chunk &chunk )
                 break;
         }
 
+        // rejected chunks have no sql lines
+        bool has_sql = skip_chunk || chunk.hasSql();
+
         switch (stm_state) {
             case CAPTURE_SQL:
+                // the start comment is complete with the first sql line
+                if (!has_sql && !header_checked
+                        && !checkHeader(chunk, line_number, line.offset, state_before)) {
+                    chunk.clear();
+                    return false;
+                }
+                if (skip_chunk) {
+                    if ((skip_until_line != LINE_NUMBER_NOT_AVAILABLE) && (line_number >= skip_until_line)) {
+                        rewindChunk(chunk);
+                        continue;
+                    }
+                    break;
+                }
+
                 // re-add empty lines in case we skipped some inbetween the
                 // sql lines
                 if (chunk.hasSql()) {
-                    for (unsigned int i = 0; i < (line_number - 1 - last_nonempty_line); i++) {
-                        chunk.appendSqlLine("", i+last_nonempty_line);
+                    for (linenumber_t i = 0; i < (line_number - 1 - last_nonempty_line); i++) {
+                        chunk.appendSqlLine("", 0, i+last_nonempty_line, line.offset, false);
                     }
                 }
                 // append the sql and set the min max line numbers
-                chunk.appendSqlLine(line, line_number);
+                chunk.appendSqlLine(line.data, line.length, line_number, line.offset, copy_lines);
                 break;
             case END_CHUNK:
-                if (chunk.hasSql()) {
+                if (has_sql) {
                     stm_state = COPY_CACHED;
                     chunkCache.clear();
                     if (cls == OTHER) {
-                        chunkCache.appendSqlLine(line, line_number);
+                        chunkCache.appendSqlLine(line.data, line.length, line_number,
+                                    line.offset, copy_lines);
                     }
                     line_number++;
                     return true;
                 }
                 break;
             case NEW_CHUNK:
-                if (chunk.hasSql()) {
+                if (has_sql) {
                     stm_state = COPY_CACHED;
                     chunkCache.clear();
-                    chunkCache.appendStartComment( line.substr(content_pos, std::string::npos ) );
+                    chunkCache.appendStartComment( std::string(line.data+content_pos, line.length-content_pos) );
                     line_number++;
                     return true;
                 }
@@ -263,10 +512,18 @@ ChunkScanner::nextChunk( Chunk &chunk )
                     chunk.clear();
                 }
             case CAPTURE_START_COMMENT:
-                chunk.appendStartComment( line.substr(content_pos, std::string::npos));
+                // consecutive start comments in the sql extend the start comment
+                if (has_sql && header_checked) {
+                    if (skip_chunk) {
+                        rewindChunk(chunk);
+                        continue;
+                    }
+                    header_changed = true;
+                }
+                chunk.appendStartComment( std::string(line.data+content_pos, line.length-content_pos));
                 break;
             case CAPTURE_END_COMMENT:
-                chunk.appendEndComment( line.substr(content_pos, std::string::npos));
+                chunk.appendEndComment( std::string(line.data+content_pos, line.length-content_pos));
                 break;
             case IGNORE:
                 break;
@@ -284,7 +541,7 @@ ChunkScanner::nextChunk( Chunk &chunk )
     }
 
     // remove chunk contents if they are incomplete
-    if (!chunk.hasSql()) {
+    if (skip_chunk || !chunk.hasSql()) {
         chunk.clear();
         return false;
     }
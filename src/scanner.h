@@ -7,14 +7,39 @@
 #include <iterator>
 
 #include "chunk.h"
+#include "filter.h"
+#include "input.h"
 
 namespace PsqlChunks
 {
-    class ChunkScanner
+    /**
+     * interface for everything chunks can be read from
+     */
+    class ChunkSource
+    {
+        public:
+            virtual ~ChunkSource() {};
+
+            /** read next chunk
+             *
+             * returns false on failure or when there are no more chunks
+             */
+            virtual bool nextChunk( Chunk& ) = 0;
+
+            /** true when all chunks have been read */
+            virtual bool eof() = 0;
+    };
+
+
+    class ChunkScanner : public ChunkSource
     {
         protected:
 
-            std::istream & strm;
+            Input & input;
+
+            /** input created by the scanner itself. will be destroyed with the scanner */
+            Input * owned_input;
+
             Chunk chunkCache;
 
             linenumber_t line_number;
@@ -39,16 +64,88 @@ namespace PsqlChunks
                 COPY_CACHED
             };
 
-            bool hasMarker(const std::string &, const std::string &, size_t , size_t &);
-            Content classifyLine( std::string &, size_t &);
+            static bool hasMarker(const char *, size_t, const char *, size_t, size_t , size_t &);
+            static Content classifyLine(const char *, size_t, size_t &);
 
             // state machine variables
             Content stm_last_cls;
             State stm_state;
             linenumber_t last_nonempty_line;
 
+            /** filters applied while scanning. see setFilterChain */
+            FilterChain * filterchain;
+            linenumber_t filter_last_line;
+
+            /** measure the time of scanning and filtering. see setTimed */
+            bool timed;
+            uint64_t filter_ns;
+
+            /** the header filters have been matched against the current chunk */
+            bool header_checked;
+            bool header_rejected;
+
+            /** the start comment changed after the header filters were matched */
+            bool header_changed;
+
+            /** the current chunk has been rejected, its sql is not stored */
+            bool skip_chunk;
+
+            /**
+             * the line the skipped chunk has to reach to match the line
+             * filters. it gets scanned again from its first line once it
+             * reaches it. LINE_NUMBER_NOT_AVAILABLE when the chunk has been
+             * rejected by the header filters
+             */
+            linenumber_t skip_until_line;
+
+            /** a chunk started after the last line the filters accept */
+            bool passed_last_line;
+
+            /**
+             * the state before the first sql line of a skipped chunk. when
+             * the start comment of the chunk changes later on or it reaches
+             * the line of a line filter, the chunk gets scanned again from
+             * there.
+             */
+            struct RewindPoint
+            {
+                byteoffset_t position;
+                State state;
+                Content last_cls;
+                linenumber_t line_number;
+                linenumber_t last_nonempty_line;
+
+                /** the comments and the first sql line of the chunk */
+                Chunk chunk;
+
+                RewindPoint() : position(0), state(CAPTURE_SQL), last_cls(EMPTY), line_number(0),
+                        last_nonempty_line(0), chunk() {};
+            };
+            RewindPoint rewind_point;
+
+            /** scan the next chunk, including rejected chunks */
+            bool scanChunk( Chunk& );
+
+            /**
+             * match the header filters when the first sql line of a chunk is reached.
+             * first_line is the lowest line the chunk may start at.
+             * returns false when no further chunk can match the filters.
+             */
+            bool checkHeader(Chunk &, linenumber_t first_line, byteoffset_t position,
+                        State state_before);
+
+            /** continue at the rewind point with storing the sql */
+            void rewindChunk(Chunk &);
+
+            /** match the header or the body filters */
+            bool matchFilters(const Chunk &, bool header);
+
+        private:
+            ChunkScanner(const ChunkScanner&);
+            ChunkScanner& operator=(const ChunkScanner&);
 
         public:
+            ChunkScanner(Input &);
             ChunkScanner(std::istream &);
             ~ChunkScanner();
 
@@ -59,6 +156,43 @@ namespace PsqlChunks
             bool nextChunk( Chunk& );
 
             bool eof();
+
+            /**
+             * only return chunks matching the filters. filters which only use the
+             * start comment (see Filter::matchesHeader) reject chunks at their first
+             * sql line, the rest of a rejected chunk is skipped without storing it.
+             * scanning ends when a chunk starts after the last line the filters
+             * accept.
+             */
+            void setFilterChain(FilterChain * _filterchain);
+
+            /**
+             * store the time spent scanning and filtering in the diagnostics
+             * of the returned chunks
+             */
+            void inline setTimed(bool _timed)
+            {
+                timed = _timed;
+            }
+
+            /**
+             * continue scanning in the middle of a file. the input has to start
+             * at a split point (see isSplitPoint). first_line is the line number
+             * of the first line of the input.
+             */
+            void startAtSplitPoint(linenumber_t first_line);
+
+            /**
+             * check if the third of the four given consecutive lines is a split point.
+             * the state of the scanner at a split point does not depend on the lines
+             * before it, so the parts of a file before and after it can be scanned
+             * independently with the same result as scanning the whole file.
+             *
+             * a split point is a start comment following a separator, when the line
+             * before the separator does not belong to an end comment and the line after
+             * the start comment is no start or end comment.
+             */
+            static bool isSplitPoint(const LineRef lines[4]);
     };
 
 
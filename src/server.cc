@@ -0,0 +1,498 @@
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "debug.h"
+
+// upper limit for the size of a request, protects the server from garbage
+#define MAX_REQUEST_SIZE    (1024*1024)
+
+using namespace PsqlChunks;
+
+bool static fill_address(const char * path, struct sockaddr_un & addr);
+bool static read_all(int fd, char * buf, size_t len);
+bool static write_all(int fd, const char * buf, size_t len);
+void static client_sigint(int sig);
+
+/** the connection of the client to the server, used by the sigint handler */
+static volatile int s_client_fd = -1;
+
+
+bool static
+fill_address(const char * path, struct sockaddr_un & addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+
+bool static
+read_all(int fd, char * buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+bool static
+write_all(int fd, const char * buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+// ### ConnectionPool ###
+
+ConnectionPool::~ConnectionPool()
+{
+    for (std::multimap<std::string, Db*>::iterator iit = idle.begin(); iit != idle.end(); ++iit) {
+        delete iit->second;
+    }
+}
+
+
+Db *
+ConnectionPool::take(const std::string & key)
+{
+    std::multimap<std::string, Db*>::iterator iit;
+    while ((iit = idle.find(key)) != idle.end()) {
+        Db * db = iit->second;
+        idle.erase(iit);
+
+        // the database server may have closed it in the meantime
+        if (db->isAlive()) {
+            return db;
+        }
+        log_debug("discarding closed connection");
+        db->abandon();
+        delete db;
+    }
+    return NULL;
+}
+
+
+void
+ConnectionPool::put(const std::string & key, Db * db)
+{
+    if (idle.size() >= SERVER_MAX_IDLE_CONNECTIONS) {
+        delete db;
+        return;
+    }
+    idle.insert(std::make_pair(key, db));
+    returned.push_back(db);
+}
+
+
+void
+ConnectionPool::reset()
+{
+    for (std::vector<Db*>::iterator dit = returned.begin(); dit != returned.end(); ++dit) {
+        try {
+            // temporary tables, prepared statements, settings, ...
+            (*dit)->executeSql("discard all;");
+        }
+        catch (DbException &e) {
+            // take() drops the connection when it is broken
+            log_debug("could not reset connection: %s", e.what());
+        }
+    }
+    returned.clear();
+}
+
+
+// ### ServerRequest ###
+
+ServerRequest::ServerRequest(int _client_fd)
+    : client_fd(_client_fd), watch_thread(), watching(false), on_interrupt(NULL),
+      interrupt_arg(NULL), cwd(), args()
+{
+    wakeup_pipe[0] = wakeup_pipe[1] = -1;
+    fds[0] = fds[1] = fds[2] = -1;
+}
+
+
+ServerRequest::~ServerRequest()
+{
+    unwatch();
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    close(client_fd);
+}
+
+
+bool
+ServerRequest::receive()
+{
+    // the descriptors are sent together with the length of the request
+    uint32_t length;
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    iov.iov_base = &length;
+    iov.iov_len = sizeof(length);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(client_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while ((n < 0) && (errno == EINTR));
+    if (n <= 0) {
+        return false;
+    }
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)
+                || (cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))) {
+        log_error("received a request without stdin, stdout and stderr");
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    if (!read_all(client_fd, reinterpret_cast<char *>(&length) + n, sizeof(length) - n)) {
+        return false;
+    }
+    if ((length == 0) || (length > MAX_REQUEST_SIZE)) {
+        log_error("received a request of invalid size %u", length);
+        return false;
+    }
+
+    // the working directory followed by the arguments, each terminated by a NUL
+    std::vector<char> payload(length);
+    if (!read_all(client_fd, &payload[0], length) || (payload[length - 1] != '\0')) {
+        return false;
+    }
+    const char * pos = &payload[0];
+    const char * end = pos + length;
+    cwd.assign(pos);
+    pos += cwd.size() + 1;
+    while (pos < end) {
+        args.push_back(std::string(pos));
+        pos += args.back().size() + 1;
+    }
+    return true;
+}
+
+
+void *
+ServerRequest::watchMain(void * arg)
+{
+    static_cast<ServerRequest *>(arg)->watchClient();
+    return NULL;
+}
+
+
+void
+ServerRequest::watchClient()
+{
+    struct pollfd pfds[2];
+    pfds[0].fd = client_fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = wakeup_pipe[0];
+    pfds[1].events = POLLIN;
+
+    while (true) {
+        pfds[0].revents = pfds[1].revents = 0;
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error("could not watch the client");
+            return;
+        }
+        if (pfds[1].revents) {
+            return;
+        }
+        if (pfds[0].revents) {
+            // the client sends a byte when it receives SIGINT, or it is gone
+            on_interrupt(interrupt_arg);
+            return;
+        }
+    }
+}
+
+
+void
+ServerRequest::watch(void (*_on_interrupt)(void *), void * arg)
+{
+    on_interrupt = _on_interrupt;
+    interrupt_arg = arg;
+
+    if (pipe(wakeup_pipe) != 0) {
+        log_error("could not create pipe");
+        return;
+    }
+    if (pthread_create(&watch_thread, NULL, watchMain, this) != 0) {
+        log_error("could not create thread for watching the client");
+        return;
+    }
+    watching = true;
+}
+
+
+void
+ServerRequest::unwatch()
+{
+    if (watching) {
+        char c = 0;
+        if (write(wakeup_pipe[1], &c, 1) != 1) {
+            log_error("could not wake up the watching thread");
+        }
+        pthread_join(watch_thread, NULL);
+        watching = false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (wakeup_pipe[i] >= 0) {
+            close(wakeup_pipe[i]);
+            wakeup_pipe[i] = -1;
+        }
+    }
+}
+
+
+void
+ServerRequest::reply(int rc)
+{
+    int32_t reply_rc = rc;
+    if (!write_all(client_fd, reinterpret_cast<const char *>(&reply_rc), sizeof(reply_rc))) {
+        log_debug("could not reply to the client");
+    }
+}
+
+
+// ### Server ###
+
+Server::~Server()
+{
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(socket_path.c_str());
+    }
+}
+
+
+bool
+Server::listen(const char * path, std::string & errmsg)
+{
+    struct sockaddr_un addr;
+    if (!fill_address(path, addr)) {
+        errmsg = "The socket path is too long.";
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        errmsg = strerror(errno);
+        return false;
+    }
+
+    // replace the socket of a server which did not exit cleanly
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0) {
+        close(fd);
+        errmsg = "An other server is listening on the socket.";
+        return false;
+    }
+    if (errno == ECONNREFUSED) {
+        unlink(path);
+    }
+    close(fd);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        errmsg = strerror(errno);
+        return false;
+    }
+
+    // the requests run with the permissions of the server, only allow
+    // the owner to connect
+    mode_t old_umask = umask(077);
+    int bind_rc = bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+    umask(old_umask);
+
+    if ((bind_rc != 0) || (::listen(fd, SOMAXCONN) != 0)) {
+        errmsg = strerror(errno);
+        close(fd);
+        return false;
+    }
+
+    socket_path = path;
+    listen_fd = fd;
+    return true;
+}
+
+
+ServerRequest *
+Server::next()
+{
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                log_error("could not accept connection");
+            }
+            return NULL;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+#ifdef SO_PEERCRED
+        struct ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if ((getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0)
+                    || (cred.uid != getuid())) {
+            log_error("rejected a client of an other user");
+            close(fd);
+            continue;
+        }
+#endif
+
+        ServerRequest * request = new ServerRequest(fd);
+        if (request->receive()) {
+            return request;
+        }
+        log_error("received an invalid request");
+        delete request;
+    }
+}
+
+
+// ### client ###
+
+void static
+client_sigint(int sig)
+{
+    UNUSED_PARAMETER(sig);
+
+    // the server cancels the running queries and replies afterwards
+    char c = 0;
+    if (s_client_fd >= 0) {
+        ssize_t rc = send(s_client_fd, &c, 1, MSG_NOSIGNAL);
+        UNUSED_PARAMETER(rc);
+    }
+}
+
+
+bool
+PsqlChunks::forward_to_server(const char * socket_path, int argc, char * argv[], int & rc)
+{
+    struct sockaddr_un addr;
+    if (!fill_address(socket_path, addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0) {
+        log_debug("no server listening on %s", socket_path);
+        close(fd);
+        return false;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        close(fd);
+        return false;
+    }
+    std::string payload(cwd, strlen(cwd) + 1);
+    for (int i = 0; i < argc; i++) {
+        payload.append(argv[i], strlen(argv[i]) + 1);
+    }
+
+    // send the length together with stdin, stdout and stderr
+    uint32_t length = payload.size();
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov;
+    iov.iov_base = &length;
+    iov.iov_len = sizeof(length);
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if ((sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(length))
+                || !write_all(fd, payload.data(), payload.size())) {
+        log_debug("could not send the request");
+        close(fd);
+        return false;
+    }
+
+    // forward SIGINT to the server while waiting for the reply
+    struct sigaction sigint_act, o_sigint_act;
+    sigint_act.sa_handler = client_sigint;
+    sigemptyset(&sigint_act.sa_mask);
+    sigint_act.sa_flags = 0;
+    s_client_fd = fd;
+    sigaction(SIGINT, &sigint_act, &o_sigint_act);
+
+    int32_t reply_rc;
+    if (read_all(fd, reinterpret_cast<char *>(&reply_rc), sizeof(reply_rc))) {
+        rc = reply_rc;
+    }
+    else {
+        log_error("lost the connection to the server");
+        rc = -1;
+    }
+
+    sigaction(SIGINT, &o_sigint_act, NULL);
+    s_client_fd = -1;
+    close(fd);
+    return true;
+}
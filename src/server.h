@@ -0,0 +1,150 @@
+#ifndef __server_h__
+#define __server_h__
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include <pthread.h>
+
+#include "db.h"
+
+// maximum number of idle database connections kept by the server
+#define SERVER_MAX_IDLE_CONNECTIONS 16
+
+namespace PsqlChunks
+{
+
+    /**
+     * idle database connections kept open between the requests of
+     * the server. connections are only shared between requests with the
+     * same connection parameters, which make up the key.
+     */
+    class ConnectionPool
+    {
+        private:
+            ConnectionPool(const ConnectionPool&);
+            ConnectionPool& operator=(const ConnectionPool&);
+
+            std::multimap<std::string, Db*> idle;
+
+            /** returned since the last reset */
+            std::vector<Db*> returned;
+
+        public:
+            ConnectionPool() : idle(), returned() {};
+            ~ConnectionPool();
+
+            /** returns NULL when there is no usable idle connection */
+            Db * take(const std::string & key);
+
+            /**
+             * keep a connection for a later request. the transaction of
+             * the connection has to be finished
+             */
+            void put(const std::string & key, Db * db);
+
+            /**
+             * discard the session state the last requests left on the returned
+             * connections. called while the server is waiting for requests
+             */
+            void reset();
+    };
+
+
+    /**
+     * a request received by the server. the client hands over its working
+     * directory, the command line arguments and its stdin, stdout and stderr,
+     * so the output is written directly to the terminal of the client.
+     */
+    class ServerRequest
+    {
+        private:
+            ServerRequest(const ServerRequest&);
+            ServerRequest& operator=(const ServerRequest&);
+
+            int client_fd;
+
+            /** woken up to stop the thread watching for interrupts */
+            int wakeup_pipe[2];
+
+            pthread_t watch_thread;
+            bool watching;
+            void (*on_interrupt)(void *);
+            void * interrupt_arg;
+
+            static void * watchMain(void * arg);
+            void watchClient();
+
+        public:
+            std::string cwd;
+            std::vector<std::string> args;
+
+            /** stdin, stdout and stderr of the client */
+            int fds[3];
+
+            ServerRequest(int _client_fd);
+            ~ServerRequest();
+
+            /** read the request from the client */
+            bool receive();
+
+            /**
+             * call the function on an other thread when the client was
+             * interrupted. the client waits for the reply afterwards
+             */
+            void watch(void (*_on_interrupt)(void *), void * arg);
+            void unwatch();
+
+            /** send the return code to the client */
+            void reply(int rc);
+    };
+
+
+    /**
+     * listens on a unix domain socket for requests of clients. the requests
+     * are handled one after the other.
+     *
+     * Usage:
+     *   Server server;
+     *   server.listen(path, errmsg);
+     *   ServerRequest * request;
+     *   while ((request = server.next()) != NULL) {
+     *       // handle the request
+     *       request->reply(rc);
+     *       delete request;
+     *   }
+     */
+    class Server
+    {
+        private:
+            Server(const Server&);
+            Server& operator=(const Server&);
+
+            std::string socket_path;
+            int listen_fd;
+
+        public:
+            Server() : socket_path(), listen_fd(-1) {};
+            ~Server();
+
+            /** fails when an other server is listening on the socket */
+            bool listen(const char * path, std::string & errmsg);
+
+            /**
+             * wait for the next request. returns NULL when the server
+             * has been interrupted by a signal
+             */
+            ServerRequest * next();
+    };
+
+
+    /**
+     * send the command line to the server listening on socket_path and wait
+     * until it has been executed. returns false when there is no server.
+     */
+    bool forward_to_server(const char * socket_path, int argc, char * argv[], int & rc);
+
+};
+
+#endif /* __server_h__ */
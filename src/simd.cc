@@ -0,0 +1,111 @@
+#include "simd.h"
+
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+using namespace PsqlChunks;
+
+typedef const char * (*skip_func_t)(const char *, const char *);
+
+static skip_func_t select_implementation(const char ** name);
+
+// resolved once at startup
+static const char * skip_impl_name = "scalar";
+static skip_func_t skip_impl = select_implementation(&skip_impl_name);
+
+
+bool inline static
+is_inline_whitespace(const char ch)
+{
+    return (ch == '\t' || ch == ' ');
+}
+
+
+static const char *
+skip_scalar(const char * p, const char * end)
+{
+    while ((p < end) && is_inline_whitespace(*p)) {
+        p++;
+    }
+    return p;
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+static const char *
+skip_sse2(const char * p, const char * end)
+{
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+
+    while ((end - p) >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab));
+        unsigned int mask = ~static_cast<unsigned int>(_mm_movemask_epi8(ws)) & 0xffff;
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return skip_scalar(p, end);
+}
+
+
+__attribute__((target("avx2"))) static const char *
+skip_avx2(const char * p, const char * end)
+{
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+
+    while ((end - p) >= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab));
+        unsigned int mask = ~static_cast<unsigned int>(_mm256_movemask_epi8(ws));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return skip_sse2(p, end);
+}
+
+#endif /* HAVE_X86_SIMD */
+
+
+static skip_func_t
+select_implementation(const char ** name)
+{
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return skip_avx2;
+    }
+    *name = "sse2";
+    return skip_sse2;
+#else
+    *name = "scalar";
+    return skip_scalar;
+#endif
+}
+
+
+const char *
+PsqlChunks::skip_inline_whitespace(const char * begin, const char * end)
+{
+    // most lines do not start with whitespace at all
+    if ((begin == end) || !is_inline_whitespace(*begin)) {
+        return begin;
+    }
+    return skip_impl(begin, end);
+}
+
+
+const char *
+PsqlChunks::simd_implementation()
+{
+    return skip_impl_name;
+}
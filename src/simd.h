@@ -0,0 +1,22 @@
+#ifndef __simd_h__
+#define __simd_h__
+
+#include <cstddef>
+
+namespace PsqlChunks
+{
+
+    /**
+     * returns a pointer to the first character in [begin, end) which is
+     * neither a space nor a tab. returns end if there is no such character.
+     *
+     * uses SSE2 or AVX2 - depending on what the cpu supports.
+     */
+    const char * skip_inline_whitespace(const char * begin, const char * end);
+
+    /** name of the implementation selected for this cpu */
+    const char * simd_implementation();
+
+};
+
+#endif /* __simd_h__ */
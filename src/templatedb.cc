@@ -0,0 +1,145 @@
+#include <sstream>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "templatedb.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+
+TemplateClones::TemplateClones(const char * _template_name)
+    : template_name(_template_name), admin(), names(), created_count(0),
+      error(), failed(false), thread(), started(false), mutex(), cond_created()
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond_created, NULL);
+}
+
+
+TemplateClones::~TemplateClones()
+{
+    join();
+    pthread_cond_destroy(&cond_created);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+bool
+TemplateClones::connect(const char * host, const char * db_name, const char * port,
+            const char * user, const char * passwd)
+{
+    return admin.connect(host, db_name, port, user, passwd);
+}
+
+
+void
+TemplateClones::start(size_t count)
+{
+    // the pid keeps the clones of concurrent runs apart
+    for (size_t i = 0; i < count; i++) {
+        std::stringstream name;
+        name << template_name << "_psqlchunks_" << getpid() << "_" << i;
+        names.push_back(name.str());
+    }
+
+    if (pthread_create(&thread, NULL, threadMain, this) != 0) {
+        log_error("could not create thread for creating databases");
+        abort();
+    }
+    started = true;
+}
+
+
+void *
+TemplateClones::threadMain(void * arg)
+{
+    static_cast<TemplateClones *>(arg)->create();
+    return NULL;
+}
+
+
+void
+TemplateClones::create()
+{
+    for (size_t i = 0; i < names.size(); i++) {
+        std::string errmsg;
+        try {
+            std::string sql = "create database " + admin.quoteIdentifier(names[i])
+                        + " template " + admin.quoteIdentifier(template_name) + ";";
+            admin.executeSql(sql.c_str(), true);
+            log_debug("created database %s", names[i].c_str());
+        }
+        catch (DbException &e) {
+            errmsg = e.what();
+        }
+
+        pthread_mutex_lock(&mutex);
+        if (errmsg.empty()) {
+            created_count++;
+        }
+        else {
+            error = errmsg;
+            failed = true;
+        }
+        pthread_cond_broadcast(&cond_created);
+        pthread_mutex_unlock(&mutex);
+
+        if (!errmsg.empty()) {
+            break;
+        }
+    }
+}
+
+
+bool
+TemplateClones::wait(size_t index, std::string & name, std::string & errmsg)
+{
+    pthread_mutex_lock(&mutex);
+    while (!failed && (created_count <= index)) {
+        pthread_cond_wait(&cond_created, &mutex);
+    }
+    bool created = created_count > index;
+    if (created) {
+        name = names[index];
+    }
+    else {
+        errmsg = error;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return created;
+}
+
+
+void
+TemplateClones::join()
+{
+    if (started) {
+        pthread_join(thread, NULL);
+        started = false;
+    }
+}
+
+
+bool
+TemplateClones::dropAll(std::string & errmsg)
+{
+    join();
+
+    bool success = true;
+    for (size_t i = 0; i < created_count; i++) {
+        try {
+            std::string sql = "drop database " + admin.quoteIdentifier(names[i]) + ";";
+            admin.executeSql(sql.c_str(), true);
+            log_debug("dropped database %s", names[i].c_str());
+        }
+        catch (DbException &e) {
+            errmsg = e.what();
+            success = false;
+        }
+    }
+    created_count = 0;
+    return success;
+}
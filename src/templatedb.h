@@ -0,0 +1,89 @@
+#ifndef __templatedb_h__
+#define __templatedb_h__
+
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+#include "db.h"
+
+namespace PsqlChunks
+{
+
+    /**
+     * creates disposable databases from a template database, so every
+     * connection of a run works on a fresh copy, and drops them afterwards.
+     *
+     * the databases are created one after the other on a background
+     * thread, so the first connection can start working while the
+     * databases of the others are still being created.
+     *
+     * Usage:
+     *   TemplateClones clones("template_db");
+     *   clones.connect(host, db_name, port, user, passwd);
+     *   clones.start(workers);
+     *   // on each worker
+     *   clones.wait(worker_id, name, errmsg);
+     *   // when all connections to the clones are closed
+     *   clones.dropAll(errmsg);
+     */
+    class TemplateClones
+    {
+        private:
+            TemplateClones(const TemplateClones&);
+            TemplateClones& operator=(const TemplateClones&);
+
+            std::string template_name;
+
+            /** the connection used to create and drop the clones */
+            Db admin;
+
+            std::vector<std::string> names;
+            size_t created_count;
+
+            /** the error which stopped the creation of further clones */
+            std::string error;
+            bool failed;
+
+            pthread_t thread;
+            bool started;
+            pthread_mutex_t mutex;
+            pthread_cond_t cond_created;
+
+            static void * threadMain(void * arg);
+            void create();
+            void join();
+
+        public:
+            TemplateClones(const char * _template_name);
+            ~TemplateClones();
+
+            /**
+             * connect to the database the clones get created from. this
+             * can not be the template, which must not have any connections.
+             */
+            bool connect(const char * host, const char * db_name, const char * port,
+                        const char * user, const char * passwd);
+
+            std::string getErrorMessage()
+            {
+                return admin.getErrorMessage();
+            }
+
+            /** start creating count clones */
+            void start(size_t count);
+
+            /**
+             * wait until the clone with the given index has been created. returns
+             * false and sets errmsg if it could not be created.
+             */
+            bool wait(size_t index, std::string & name, std::string & errmsg);
+
+            /** drop the created clones. all connections to them have to be closed */
+            bool dropAll(std::string & errmsg);
+    };
+
+};
+
+#endif /* __templatedb_h__ */
@@ -0,0 +1,98 @@
+#ifndef __timing_h__
+#define __timing_h__
+
+#include <ctime>
+
+#include <stdint.h>
+
+namespace PsqlChunks
+{
+
+    /**
+     * the steps the time spent on a chunk is split into
+     */
+    enum TimingPhase
+    {
+        /** reading the chunk from the input */
+        PHASE_SCAN,
+        PHASE_FILTER,
+
+        /** beginning the transaction and setting the savepoint */
+        PHASE_SAVEPOINT,
+
+        /** sending the sql to the server */
+        PHASE_SEND,
+
+        /** waiting for the server to send the results */
+        PHASE_EXECUTE,
+
+        /** receiving and parsing the results */
+        PHASE_FETCH,
+
+        /** releasing the savepoint or rolling back to it */
+        PHASE_RELEASE,
+
+        PHASE_COUNT
+    };
+
+
+    inline const char * phase_name(TimingPhase phase)
+    {
+        switch (phase) {
+            case PHASE_SCAN:        return "scan";
+            case PHASE_FILTER:      return "filter";
+            case PHASE_SAVEPOINT:   return "savepoint";
+            case PHASE_SEND:        return "send";
+            case PHASE_EXECUTE:     return "execute";
+            case PHASE_FETCH:       return "fetch";
+            case PHASE_RELEASE:     return "release";
+            default:                return "";
+        }
+    }
+
+
+    /** nanoseconds of a clock which is not affected by changes of the system time */
+    inline uint64_t monotonic_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+    }
+
+
+    /**
+     * nanoseconds spent in each phase
+     */
+    struct PhaseTimes
+    {
+        uint64_t ns[PHASE_COUNT];
+
+        PhaseTimes()
+        {
+            clear();
+        }
+
+        void clear()
+        {
+            for (int p = 0; p < PHASE_COUNT; p++) {
+                ns[p] = 0;
+            }
+        }
+
+        void add(const PhaseTimes & other)
+        {
+            for (int p = 0; p < PHASE_COUNT; p++) {
+                ns[p] += other.ns[p];
+            }
+        }
+
+        /** the time of the query, as seen by the client */
+        uint64_t queryNs() const
+        {
+            return ns[PHASE_SEND] + ns[PHASE_EXECUTE] + ns[PHASE_FETCH];
+        }
+    };
+
+};
+
+#endif /* __timing_h__ */
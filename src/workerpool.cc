@@ -0,0 +1,150 @@
+#include <cstdlib>
+
+#include "workerpool.h"
+#include "debug.h"
+
+using namespace PsqlChunks;
+
+struct ThreadArg {
+    WorkerPool * pool;
+    unsigned int worker_id;
+};
+
+
+WorkerPool::WorkerPool(unsigned int _nthreads, size_t _max_ahead)
+    : nthreads(_nthreads == 0 ? 1 : _nthreads),
+      max_ahead(_max_ahead),
+      threads(), mutex(), cond_finished(), cond_window(),
+      tasks(), finished(), next_task(0), next_emit(0),
+      emitted(false), canceled(false)
+{
+    if (max_ahead == 0) {
+        max_ahead = nthreads * 4;
+    }
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond_finished, NULL);
+    pthread_cond_init(&cond_window, NULL);
+}
+
+
+WorkerPool::~WorkerPool()
+{
+    cancel();
+    join();
+    pthread_cond_destroy(&cond_window);
+    pthread_cond_destroy(&cond_finished);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+void
+WorkerPool::start(const std::vector<Task*> & _tasks)
+{
+    tasks = _tasks;
+    finished.assign(tasks.size(), false);
+    next_task = 0;
+    next_emit = 0;
+    emitted = false;
+    canceled = false;
+
+    for (unsigned int i = 0; i < nthreads; i++) {
+        ThreadArg * arg = new ThreadArg;
+        arg->pool = this;
+        arg->worker_id = i;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, threadMain, arg) != 0) {
+            log_error("could not create worker thread");
+            delete arg;
+            abort();
+        }
+        threads.push_back(thread);
+    }
+}
+
+
+void *
+WorkerPool::threadMain(void * arg)
+{
+    ThreadArg * targ = static_cast<ThreadArg *>(arg);
+    WorkerPool * pool = targ->pool;
+    unsigned int worker_id = targ->worker_id;
+    delete targ;
+
+    pool->work(worker_id);
+    return NULL;
+}
+
+
+void
+WorkerPool::work(unsigned int worker_id)
+{
+    while (true) {
+        pthread_mutex_lock(&mutex);
+        while (!canceled && (next_task < tasks.size())
+                    && (next_task >= (next_emit + max_ahead))) {
+            pthread_cond_wait(&cond_window, &mutex);
+        }
+        if (canceled || (next_task >= tasks.size())) {
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+        size_t index = next_task++;
+        pthread_mutex_unlock(&mutex);
+
+        tasks[index]->run(worker_id);
+
+        pthread_mutex_lock(&mutex);
+        finished[index] = true;
+        pthread_cond_broadcast(&cond_finished);
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+
+Task *
+WorkerPool::next()
+{
+    Task * task = NULL;
+
+    pthread_mutex_lock(&mutex);
+    if (emitted) {
+        // the consumer is done with the previous task
+        next_emit++;
+        emitted = false;
+        pthread_cond_broadcast(&cond_window);
+    }
+
+    while (!canceled && (next_emit < tasks.size()) && !finished[next_emit]) {
+        pthread_cond_wait(&cond_finished, &mutex);
+    }
+
+    if (!canceled && (next_emit < tasks.size())) {
+        task = tasks[next_emit];
+        emitted = true;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return task;
+}
+
+
+void
+WorkerPool::cancel()
+{
+    pthread_mutex_lock(&mutex);
+    canceled = true;
+    pthread_cond_broadcast(&cond_window);
+    pthread_cond_broadcast(&cond_finished);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+void
+WorkerPool::join()
+{
+    for (std::vector<pthread_t>::iterator tit = threads.begin(); tit != threads.end(); ++tit) {
+        pthread_join(*tit, NULL);
+    }
+    threads.clear();
+}
@@ -0,0 +1,107 @@
+#ifndef __workerpool_h__
+#define __workerpool_h__
+
+#include <vector>
+#include <cstddef>
+
+#include <pthread.h>
+
+namespace PsqlChunks
+{
+
+    /**
+     * a unit of work for the WorkerPool
+     */
+    class Task
+    {
+        private:
+            Task(const Task&);
+            Task& operator=(const Task&);
+
+        public:
+            Task() {};
+            virtual ~Task() {};
+
+            /**
+             * execute the task. worker_id is the index of the
+             * thread running the task, ranging from 0 to the number of threads-1
+             */
+            virtual void run(unsigned int worker_id) = 0;
+    };
+
+
+    /**
+     * runs tasks on a fixed number of threads and hands the finished
+     * tasks back in the order they were submitted.
+     *
+     * Usage:
+     *   WorkerPool pool(4);
+     *   pool.start(tasks);
+     *   Task * task;
+     *   while ((task = pool.next()) != NULL) {
+     *       // consume the results of task
+     *   }
+     *   pool.join();
+     */
+    class WorkerPool
+    {
+        private:
+            WorkerPool(const WorkerPool&);
+            WorkerPool& operator=(const WorkerPool&);
+
+            unsigned int nthreads;
+
+            /**
+             * maximum number of tasks which may be started ahead of
+             * the task the consumer is waiting for. bounds the memory
+             * used for buffered results
+             */
+            size_t max_ahead;
+
+            std::vector<pthread_t> threads;
+            pthread_mutex_t mutex;
+            pthread_cond_t cond_finished;
+            pthread_cond_t cond_window;
+
+            std::vector<Task*> tasks;
+            std::vector<bool> finished;
+            size_t next_task;
+            size_t next_emit;
+            bool emitted;
+            bool canceled;
+
+            static void * threadMain(void * arg);
+            void work(unsigned int worker_id);
+
+        public:
+            WorkerPool(unsigned int _nthreads, size_t _max_ahead = 0);
+            ~WorkerPool();
+
+            unsigned int size() const
+            {
+                return nthreads;
+            }
+
+            /**
+             * start processing the tasks. the pool does not take ownership
+             * of the tasks.
+             */
+            void start(const std::vector<Task*> & _tasks);
+
+            /**
+             * wait for the next task in submission order to finish.
+             * returns NULL when all tasks have been handed out or the pool
+             * was canceled.
+             */
+            Task * next();
+
+            /** do not start any further tasks */
+            void cancel();
+
+            /** wait for all threads to exit */
+            void join();
+    };
+
+};
+
+#endif /* __workerpool_h__ */
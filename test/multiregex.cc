@@ -0,0 +1,444 @@
+/**
+ * compares MultiRegex with regexec on random patterns and texts.
+ *
+ * the patterns are generated together with a text they match, so both
+ * matching and non-matching texts are covered. the random numbers are
+ * seeded with a fixed value, every run checks the same cases.
+ *
+ * Usage: multiregex [seed]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <regex.h>
+#include <stdint.h>
+
+#include "multiregex.h"
+#include "chunk.h"
+
+using namespace PsqlChunks;
+
+#define DEFAULT_SEED        20261016
+#define PATTERN_SETS        3000
+#define TEXTS_PER_SET       40
+#define MAX_REPORTED        10
+
+
+/***** random numbers *****/
+
+static uint64_t rng_state = DEFAULT_SEED;
+
+/** xorshift64*, so the cases do not depend on the libc */
+static unsigned int
+rnd(unsigned int n)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return static_cast<unsigned int>((rng_state * 2685821657736338717ULL) >> 33) % n;
+}
+
+
+static char
+pick(const char * chars)
+{
+    return chars[rnd(strlen(chars))];
+}
+
+
+/***** patterns *****/
+
+// characters of the texts. includes the characters the patterns use
+static const char * text_chars = "abcxyzABXZ019-_ .\t\n";
+
+struct Bracket {
+    const char * pattern;
+    const char * sample;    // characters matched by the pattern
+};
+
+static const Bracket brackets[] = {
+    { "[abc]",          "abcABC" },
+    { "[^a]",           "bxZ9-\n" },
+    { "[a-c]",          "abcB" },
+    { "[x-z0-9]",       "xyZ09" },
+    { "[[:digit:]]",    "0179" },
+    { "[[:alpha:]]",    "aZqX" },
+    { "[[:space:]]",    " \t\n" },
+    { "[]a]",           "]aA" },
+    { "[a-]",           "aA-" },
+    { "[^[:alnum:]]",   "-_ ." },
+};
+
+
+static void
+gen_regex(unsigned int depth, std::string & pattern, std::string & sample);
+
+
+/** appends a single atom. atoms can be repeated */
+static void
+gen_atom(unsigned int depth, std::string & pattern, std::string & sample)
+{
+    unsigned int kind = rnd(depth > 0 ? 5 : 4);
+    if (kind == 0) {
+        char c = pick("abcxyz019-_ ");
+        pattern += c;
+        // the patterns are case insensitive
+        sample += (rnd(2) && (c >= 'a') && (c <= 'z')) ? static_cast<char>(c - 'a' + 'A') : c;
+    }
+    else if (kind == 1) {
+        pattern += "\\.";
+        sample += '.';
+    }
+    else if (kind == 2) {
+        pattern += '.';
+        sample += pick(text_chars);
+    }
+    else if (kind == 3) {
+        const Bracket & b = brackets[rnd(sizeof(brackets) / sizeof(brackets[0]))];
+        pattern += b.pattern;
+        sample += pick(b.sample);
+    }
+    else {
+        pattern += '(';
+        gen_regex(depth - 1, pattern, sample);
+        pattern += ')';
+    }
+}
+
+
+/** appends an atom, possibly repeated */
+static void
+gen_piece(unsigned int depth, std::string & pattern, std::string & sample)
+{
+    std::string atom_sample;
+    gen_atom(depth, pattern, atom_sample);
+
+    unsigned int min = 1;
+    unsigned int max = 1;
+    switch (rnd(10)) {
+        case 0: pattern += '*'; min = 0; max = 3; break;
+        case 1: pattern += '+'; min = 1; max = 3; break;
+        case 2: pattern += '?'; min = 0; max = 1; break;
+        case 3: {
+            min = rnd(4);
+            max = min + rnd(4);
+            char buff[32];
+            unsigned int form = rnd(3);
+            if (form == 0) {
+                snprintf(buff, sizeof(buff), "{%u}", min);
+                max = min;
+            }
+            else if (form == 1) {
+                snprintf(buff, sizeof(buff), "{%u,}", min);
+            }
+            else {
+                snprintf(buff, sizeof(buff), "{%u,%u}", min, max);
+            }
+            pattern += buff;
+            break;
+        }
+        default:
+            break;
+    }
+
+    // the atom matches its sample each time
+    unsigned int count = min + rnd(max - min + 1);
+    for (unsigned int i = 0; i < count; i++) {
+        sample += atom_sample;
+    }
+}
+
+
+static void
+gen_branch(unsigned int depth, std::string & pattern, std::string & sample)
+{
+    unsigned int pieces = 1 + rnd(3);
+    for (unsigned int i = 0; i < pieces; i++) {
+        gen_piece(depth, pattern, sample);
+    }
+}
+
+
+static void
+gen_regex(unsigned int depth, std::string & pattern, std::string & sample)
+{
+    unsigned int branches = rnd(3) ? 1 : 2 + rnd(2);
+    unsigned int sampled = rnd(branches);
+    for (unsigned int i = 0; i < branches; i++) {
+        if (i > 0) {
+            pattern += '|';
+        }
+        std::string unused;
+        gen_branch(depth, pattern, (i == sampled) ? sample : unused);
+    }
+}
+
+
+/** a pattern and a text it matches */
+static void
+gen_pattern(std::string & pattern, std::string & sample)
+{
+    unsigned int kind = rnd(20);
+    if (kind == 0) {
+        // back references are matched with regexec
+        std::string inner;
+        pattern = "(";
+        gen_branch(1, pattern, inner);
+        pattern += ")\\1";
+        sample = inner + inner;
+        return;
+    }
+
+    bool bol = (rnd(5) == 0);
+    bool eol = (rnd(5) == 0);
+    pattern = bol ? "^" : "";
+    gen_regex(2, pattern, sample);
+    if (eol) {
+        pattern += '$';
+    }
+}
+
+
+/** patterns testing the limits of the automaton */
+static const char * fixed_patterns[] = {
+    "a.{11}b",                  // many DFA states
+    "^(a|b)*a.{9}b$",
+    "[ab]{3,40}x",
+    "a{2000}",                  // too many NFA states, matched with regexec
+    "(ab|ba){30,}",
+    "zz[[:digit:]]{2}y",
+    "^$",
+    "^",
+    "$",
+    "x*",
+    "(^a|b$)",
+    "a|^b|c$",
+    "(a|)b",
+};
+
+
+/***** texts *****/
+
+static std::string
+gen_noise(unsigned int max_len)
+{
+    std::string text;
+    unsigned int len = rnd(max_len + 1);
+    for (unsigned int i = 0; i < len; i++) {
+        text += pick(text_chars);
+    }
+    return text;
+}
+
+
+static std::string
+gen_text(const std::vector<std::string> & samples)
+{
+    std::string text;
+    unsigned int kind = rnd(6);
+    if (kind == 0) {
+        return gen_noise(200);
+    }
+    if (kind == 1) {
+        // the samples alone, anchors match
+        for (size_t i = 0; i < samples.size(); i++) {
+            text += samples[i];
+        }
+        return text;
+    }
+
+    text = gen_noise(20);
+    for (size_t i = 0; i < samples.size(); i++) {
+        if (rnd(8) != 0) {
+            text += samples[i];
+        }
+        text += gen_noise(20);
+    }
+    if (rnd(10) == 0) {
+        // the text ends at a NUL byte
+        text.insert(rnd(text.size() + 1), 1, '\0');
+    }
+    return text;
+}
+
+
+/***** comparison *****/
+
+struct Reference {
+    std::vector<regex_t*> regexes;
+
+    ~Reference()
+    {
+        for (size_t i = 0; i < regexes.size(); i++) {
+            regfree(regexes[i]);
+            delete regexes[i];
+        }
+    }
+
+    /** false if the pattern is invalid */
+    bool add(const std::string & pattern)
+    {
+        regex_t * re = new regex_t;
+        if (regcomp(re, pattern.c_str(), REG_EXTENDED | REG_ICASE) != 0) {
+            delete re;
+            return false;
+        }
+        regexes.push_back(re);
+        return true;
+    }
+
+    bool matchAll(const std::string & text) const
+    {
+        for (size_t i = 0; i < regexes.size(); i++) {
+            if (regexec(regexes[i], text.c_str(), 0, NULL, 0) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+
+static void
+print_escaped(const std::string & s)
+{
+    putchar('"');
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '\n') {
+            printf("\\n");
+        }
+        else if (c == '\t') {
+            printf("\\t");
+        }
+        else if ((c < 0x20) || (c >= 0x7f) || (c == '"') || (c == '\\')) {
+            printf("\\x%02x", c);
+        }
+        else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+
+static unsigned long mismatches = 0;
+
+
+static void
+report(const std::vector<std::string> & patterns, const std::string & text,
+            const char * what, bool expected)
+{
+    mismatches++;
+    if (mismatches > MAX_REPORTED) {
+        return;
+    }
+    printf("mismatch in %s, regexec %s:", what, expected ? "matches" : "does not match");
+    for (size_t i = 0; i < patterns.size(); i++) {
+        printf(" ");
+        print_escaped(patterns[i]);
+    }
+    printf(" text ");
+    print_escaped(text);
+    printf("\n");
+}
+
+
+/** returns true if the text matched */
+static bool
+compare(const MultiRegex & mr, const Reference & ref,
+            const std::vector<std::string> & patterns, const std::string & text)
+{
+    bool expected = ref.matchAll(text);
+    if (mr.matchAll(text.data(), text.size()) != expected) {
+        report(patterns, text, "matchAll", expected);
+    }
+
+    if (mr.matchesLines()) {
+        // matchAllLines adds a linebreak after the last line
+        std::string joined = text + "\n";
+        bool expected_lines = ref.matchAll(joined);
+
+        linevector_t lines;
+        size_t begin = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            if (text[i] == '\n') {
+                lines.push_back(Line(text.data() + begin, i - begin, lines.size() + 1, begin));
+                begin = i + 1;
+            }
+        }
+        lines.push_back(Line(text.data() + begin, text.size() - begin, lines.size() + 1, begin));
+
+        if (mr.matchAllLines(lines.begin(), lines.end()) != expected_lines) {
+            report(patterns, joined, "matchAllLines", expected_lines);
+        }
+    }
+    return expected;
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    if (argc > 1) {
+        rng_state = strtoull(argv[1], NULL, 10);
+    }
+
+    unsigned long texts = 0;
+    unsigned long matched = 0;
+    unsigned long invalid = 0;
+
+    size_t fixed_count = sizeof(fixed_patterns) / sizeof(fixed_patterns[0]);
+    for (unsigned int set = 0; set < (PATTERN_SETS + fixed_count); set++) {
+        std::vector<std::string> patterns;
+        std::vector<std::string> samples;
+
+        if (set < fixed_count) {
+            patterns.push_back(fixed_patterns[set]);
+            samples.push_back(gen_noise(60));
+        }
+        else {
+            unsigned int count = 1 + rnd(4);
+            for (unsigned int i = 0; i < count; i++) {
+                std::string pattern;
+                std::string sample;
+                gen_pattern(pattern, sample);
+                patterns.push_back(pattern);
+                samples.push_back(sample);
+            }
+        }
+
+        MultiRegex mr;
+        Reference ref;
+        bool valid = true;
+        for (size_t i = 0; i < patterns.size(); i++) {
+            std::string errmsg;
+            bool ref_valid = ref.add(patterns[i]);
+            if (mr.addPattern(patterns[i].c_str(), errmsg) != ref_valid) {
+                printf("addPattern disagrees with regcomp on ");
+                print_escaped(patterns[i]);
+                printf("\n");
+                mismatches++;
+            }
+            valid = valid && ref_valid;
+        }
+        if (!valid) {
+            invalid++;
+            continue;
+        }
+
+        for (unsigned int t = 0; t < TEXTS_PER_SET; t++) {
+            texts++;
+            if (compare(mr, ref, patterns, gen_text(samples))) {
+                matched++;
+            }
+        }
+    }
+
+    printf("multiregex: %lu texts, %lu matched, %lu invalid pattern sets, %lu mismatches\n",
+            texts, matched, invalid, mismatches);
+    return (mismatches == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
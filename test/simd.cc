@@ -0,0 +1,249 @@
+/**
+ * compares the vectorized line classification with the scalar one.
+ *
+ * skip_inline_whitespace and ChunkScanner::classifyLine are checked
+ * against simple byte by byte implementations, on lines with lengths
+ * around the 16 and 32 byte blocks of SSE2 and AVX2. the random numbers
+ * are seeded with a fixed value, every run checks the same cases.
+ *
+ * Usage: simd [seed]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+
+#include <stdint.h>
+
+#include "scanner.h"
+#include "simd.h"
+
+using namespace PsqlChunks;
+
+#define DEFAULT_SEED        20261016
+#define MAX_LENGTH          100
+#define MAX_OFFSET          32
+#define LINES_PER_LENGTH    2000
+#define MAX_REPORTED        10
+
+
+/***** random numbers *****/
+
+static uint64_t rng_state = DEFAULT_SEED;
+
+/** xorshift64*, so the cases do not depend on the libc */
+static unsigned int
+rnd(unsigned int n)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return static_cast<unsigned int>((rng_state * 2685821657736338717ULL) >> 33) % n;
+}
+
+
+/***** reference implementations *****/
+
+static bool
+is_blank(char ch)
+{
+    return (ch == '\t') || (ch == ' ');
+}
+
+
+static const char *
+skip_reference(const char * p, const char * end)
+{
+    while ((p < end) && is_blank(*p)) {
+        p++;
+    }
+    return p;
+}
+
+
+/**
+ * exposes the line classification of the scanner next to the scalar
+ * version it replaced
+ */
+class ScannerProbe : public ChunkScanner
+{
+    public:
+        typedef ChunkScanner::Content Content;
+
+        static Content classify(const char * line, size_t len, size_t & content_pos)
+        {
+            return classifyLine(line, len, content_pos);
+        }
+
+        static Content classifyReference(const char * line, size_t len, size_t & content_pos)
+        {
+            Content cls = EMPTY;
+            int dash_counter = 0;
+            content_pos = 0;
+
+            for (size_t c = 0; c < len; c++) {
+                if (line[c] == '-') {
+                    dash_counter++;
+                }
+                else {
+                    if (dash_counter == 2) {
+                        cls = COMMENT;
+                    }
+                    else if ((dash_counter >= 4) && (line[c] == '[')) {
+                        cls = FILE_MARKER;
+                        content_pos = c;
+                        break;
+                    }
+                    else if (!is_blank(line[c])) {
+                        cls = OTHER;
+                        content_pos = c;
+                        break;
+                    }
+
+                    if (cls != COMMENT) {
+                        dash_counter = 0;
+                    }
+                    else if (!is_blank(line[c])) {
+                        content_pos = c;
+                        if (markerReference(line, len, "start", c, content_pos)) {
+                            cls = COMMENT_START;
+                        }
+                        if (markerReference(line, len, "end", c, content_pos)) {
+                            cls = COMMENT_END;
+                        }
+                        break;
+                    }
+                }
+
+                if (dash_counter >= 3) {
+                    cls = SEP;
+                }
+            }
+            return cls;
+        }
+
+    private:
+        static bool markerReference(const char * line, size_t len, const char * marker,
+                    size_t start, size_t & end_pos)
+        {
+            size_t marker_len = strlen(marker);
+            if ((len - start) < marker_len) {
+                return false;
+            }
+            for (size_t c = 0; c < marker_len; c++) {
+                if ((line[start + c] != tolower(marker[c]))
+                        && (line[start + c] != toupper(marker[c]))) {
+                    return false;
+                }
+            }
+
+            size_t c = start + marker_len;
+            while ((c < len) && is_blank(line[c])) {
+                c++;
+            }
+            if ((c >= len) || (line[c] != ':')) {
+                return false;
+            }
+            end_pos = c;
+            while ((end_pos < len) && (is_blank(line[end_pos]) || (line[end_pos] == ':'))) {
+                end_pos++;
+            }
+            return true;
+        }
+};
+
+
+/***** lines *****/
+
+// bytes next to the blanks in value or in the lower bits, and bytes
+// with the high bit set
+static const char stop_chars[] = "\x00\x08\x0a\x1f\x21\x89\xa0\xff-x";
+
+// pieces of comment, separator and marker lines
+static const char * pieces[] = {
+    "-", "--", "---", "----", " ", "\t", "  \t ", "x", "select 1;",
+    "start", "START", "sTaRt", "end", "End", ":", " :", ": ", "::",
+    "[", "\xd3", "\xe5nd",
+};
+
+
+static void
+gen_line(std::string & line, size_t len)
+{
+    line.clear();
+
+    // the leading blanks cross the block boundaries
+    size_t blanks = rnd(len + 1);
+    for (size_t i = 0; i < blanks; i++) {
+        line += rnd(2) ? ' ' : '\t';
+    }
+    while (line.size() < len) {
+        if (rnd(3) == 0) {
+            line += stop_chars[rnd(sizeof(stop_chars) - 1)];
+        }
+        else {
+            line += pieces[rnd(sizeof(pieces) / sizeof(pieces[0]))];
+        }
+    }
+    line.resize(len);
+}
+
+
+static unsigned long mismatches = 0;
+
+
+static void
+report(const char * what, const char * line, size_t len, size_t offset)
+{
+    mismatches++;
+    if (mismatches > MAX_REPORTED) {
+        return;
+    }
+    printf("mismatch in %s, length %zu, offset %zu:", what, len, offset);
+    for (size_t i = 0; i < len; i++) {
+        printf(" %02x", static_cast<unsigned char>(line[i]));
+    }
+    printf("\n");
+}
+
+
+int
+main(int argc, char * argv[])
+{
+    if (argc > 1) {
+        rng_state = strtoull(argv[1], NULL, 10);
+    }
+
+    // the lines are placed at all offsets of a 32 byte block and followed
+    // by blanks, which are skipped when reading past the end of a line
+    char buff[MAX_OFFSET + MAX_LENGTH + 64];
+    std::string line;
+    unsigned long lines = 0;
+
+    for (size_t len = 0; len <= MAX_LENGTH; len++) {
+        for (unsigned int n = 0; n < LINES_PER_LENGTH; n++) {
+            gen_line(line, len);
+            size_t offset = n % MAX_OFFSET;
+            memset(buff, ' ', sizeof(buff));
+            memcpy(buff + offset, line.data(), len);
+            const char * start = buff + offset;
+            lines++;
+
+            if (skip_inline_whitespace(start, start + len) != skip_reference(start, start + len)) {
+                report("skip_inline_whitespace", start, len, offset);
+            }
+
+            size_t pos = 0;
+            size_t ref_pos = 0;
+            ScannerProbe::Content cls = ScannerProbe::classify(start, len, pos);
+            ScannerProbe::Content ref_cls = ScannerProbe::classifyReference(start, len, ref_pos);
+            if ((cls != ref_cls) || (pos != ref_pos)) {
+                report("classifyLine", start, len, offset);
+            }
+        }
+    }
+
+    printf("simd (%s): %lu lines, %lu mismatches\n", simd_implementation(), lines, mismatches);
+    return (mismatches == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}